@@ -2,7 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
@@ -18,11 +20,15 @@
 
 #include <glib.h>
 
+#include <algorithm>
+
 extern "C" {
 #include <lzf.h>
 }
 
 #include "bitbox.h"
+#include "epoch.h"
+#include "hugepages.h"
 
 #define MIN_ARRAY_SIZE 1
 
@@ -39,28 +45,67 @@ extern "C" {
 #define BYTE_SLOT(b, i) (b->array[BYTE_OFFSET(i) - b->offset])
 #define MASK(i) (1 << BIT_OFFSET(i))
 
-static int64_t _get_time(void)
+// whole-array operations work through a buffer of this many bytes at a time.
+#define BITOP_CHUNK_SIZE (64*1024)
+
+// private bitarray functions
+
+static bool is_huge(int64_t size)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return ((int64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+    return BITARRAY_HUGE_THRESHOLD > 0 && size >= BITARRAY_HUGE_THRESHOLD;
 }
 
-// private bitarray functions
+// zeroed storage for an array buffer or a page.
+static uint8_t * alloc_buffer(int64_t size)
+{
+    uint8_t * p = (uint8_t *)(is_huge(size) ? huge_alloc(size) : calloc(size, 1));
+    assert(p);
+    return p;
+}
+
+// size must be what the buffer was allocated with.
+static void free_buffer(uint8_t * p, int64_t size)
+{
+    if(is_huge(size))
+        epoch_retire(p, huge_free);
+    else
+        epoch_free(p);
+}
+
+// returns zeroed storage for an array of the given size: the inline buffer if
+// it's small enough, otherwise a fresh heap allocation.
+uint8_t * Bitarray::alloc_array(int64_t size)
+{
+    if(size <= BITARRAY_INLINE_SIZE)
+    {
+        memset(this->inline_array, 0, BITARRAY_INLINE_SIZE);
+        return this->inline_array;
+    }
+    return alloc_buffer(size);
+}
+
+// storage an array lets go of is freed through epoch_free(), as lock-free
+// readers may still be looking at it.
+void Bitarray::replace_array(uint8_t * new_array, int64_t new_size)
+{
+    if(this->array && !this->is_inline())
+        free_buffer(this->array, this->size);
+    this->array = new_array;
+    this->size = new_size;
+}
 
 void Bitarray::init_data(int64_t start_bit)
 {
     this->offset = start_bit/8;
-    this->size = MIN_ARRAY_SIZE;
-    this->array = (uint8_t *)calloc(this->size, 1);
-    assert(this->array);
+    this->replace_array(this->alloc_array(MIN_ARRAY_SIZE), MIN_ARRAY_SIZE);
 }
 
-Bitarray::Bitarray(const char * key, int64_t start_bit)
-    : array(NULL), size(0), offset(0)
+Bitarray::Bitarray(const char * key, size_t keylen, int64_t start_bit)
+    : last_access(0), keylen(keylen), npages(0), bits(0), disk(NULL)
 {
-    this->last_access = _get_time();
-    this->key = strdup(key);
+    this->key = (char *)malloc(keylen + 1);
+    memcpy(this->key, key, keylen);
+    this->key[keylen] = '\0';
 
     if(start_bit > -1)
         this->init_data(start_bit);
@@ -70,8 +115,295 @@ Bitarray::~Bitarray()
 {
     assert(this->key);
     free(this->key);
-    if(this->array)
-        free(this->array);
+    this->replace_array(NULL, 0);
+    this->free_pages();
+    delete this->disk;
+}
+
+// paged layout
+
+static int64_t popcount_bytes(const uint8_t * p, int64_t n)
+{
+    int64_t count = 0;
+    for(; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        count += __builtin_popcountll(word);
+    }
+    for(; n > 0; p++, n--)
+        count += __builtin_popcount(*p);
+    return count;
+}
+
+static bool all_zero(const uint8_t * data, int64_t n)
+{
+    for(int64_t i = 0; i < n; i++)
+        if(data[i])
+            return false;
+    return true;
+}
+
+// sets up the page directory to cover data_size bytes of data, which start
+// at byte data_offset, copying in only the pages that aren't all zero.
+void Bitarray::make_paged(const uint8_t * data, int64_t data_offset, int64_t data_size)
+{
+    assert(!this->array && !this->pages && data_size > 0);
+
+    int64_t first_table = data_offset / BITARRAY_TABLE_SPAN;
+    int64_t last_table = (data_offset + data_size - 1) / BITARRAY_TABLE_SPAN;
+
+    this->offset = first_table * BITARRAY_TABLE_SPAN;
+    this->size = (last_table - first_table + 1) * BITARRAY_TABLE_SPAN;
+    this->pages = (uint8_t ***)calloc(last_table - first_table + 1, sizeof(uint8_t **));
+    assert(this->pages);
+
+    int64_t pos = data_offset;
+    int64_t end = data_offset + data_size;
+    while(pos < end)
+    {
+        int64_t n = MIN(end, (pos / BITARRAY_PAGE_SIZE + 1) * BITARRAY_PAGE_SIZE) - pos;
+        if(!all_zero(data + (pos - data_offset), n))
+            memcpy(this->page_for_write(pos), data + (pos - data_offset), n);
+        pos += n;
+    }
+}
+
+void Bitarray::convert_to_paged()
+{
+    uint8_t * old_array = this->array;
+    int64_t old_size = this->size;
+    bool was_inline = this->is_inline();
+
+    this->array = NULL;
+    this->make_paged(old_array, this->offset, this->size);
+
+    if(!was_inline)
+        free_buffer(old_array, old_size);
+}
+
+void Bitarray::free_pages()
+{
+    if(!this->pages)
+        return;
+
+    for(int64_t t = 0; t < this->size / BITARRAY_TABLE_SPAN; t++)
+    {
+        if(!this->pages[t])
+            continue;
+        for(int p = 0; p < BITARRAY_PAGES_PER_TABLE; p++)
+            free_buffer(this->pages[t][p], BITARRAY_PAGE_SIZE);
+        epoch_free(this->pages[t]);
+    }
+    epoch_free(this->pages);
+    this->pages = NULL;
+    this->npages = 0;
+}
+
+// extends the top level of the directory, in either direction, so that it
+// covers byte.  no pages are allocated or moved.
+void Bitarray::grow_pages_to_reach(int64_t byte)
+{
+    int64_t first_table = this->offset / BITARRAY_TABLE_SPAN;
+    int64_t num_tables = this->size / BITARRAY_TABLE_SPAN;
+    int64_t table = byte / BITARRAY_TABLE_SPAN;
+
+    if(table >= first_table + num_tables)
+    {
+        int64_t new_num_tables = table - first_table + 1;
+        uint8_t *** new_pages = (uint8_t ***)calloc(new_num_tables, sizeof(uint8_t **));
+        assert(new_pages);
+        memcpy(new_pages, this->pages, num_tables * sizeof(uint8_t **));
+        epoch_free(this->pages);
+        this->pages = new_pages;
+        this->size = new_num_tables * BITARRAY_TABLE_SPAN;
+    }
+    else if(table < first_table)
+    {
+        int64_t grow_by = first_table - table;
+        uint8_t *** new_pages = (uint8_t ***)calloc(num_tables + grow_by, sizeof(uint8_t **));
+        assert(new_pages);
+        memcpy(new_pages + grow_by, this->pages, num_tables * sizeof(uint8_t **));
+        epoch_free(this->pages);
+        this->pages = new_pages;
+        this->offset = table * BITARRAY_TABLE_SPAN;
+        this->size = (num_tables + grow_by) * BITARRAY_TABLE_SPAN;
+    }
+}
+
+// roughly how much memory the array takes up, in bytes.
+int64_t Bitarray::memory_size() const
+{
+    int64_t bytes = sizeof(Bitarray) + this->keylen + 1;
+    if(this->pages)
+        bytes += this->npages * (is_huge(BITARRAY_PAGE_SIZE) ? huge_rounded(BITARRAY_PAGE_SIZE) : BITARRAY_PAGE_SIZE) +
+            this->size / BITARRAY_TABLE_SPAN * BITARRAY_PAGES_PER_TABLE * sizeof(uint8_t *);
+    else if(this->array && !this->is_inline())
+        bytes += is_huge(this->size) ? huge_rounded(this->size) : this->size;
+    return bytes;
+}
+
+// these return a pointer to the given byte, which must be within
+// [offset, offset+size).  for reads, NULL means the byte is in a page that
+// was never allocated, and so is zero.
+
+const uint8_t * BitarrayLayout::page_for_read(int64_t byte) const
+{
+    int64_t rel = byte - this->offset;
+    int64_t page = rel / BITARRAY_PAGE_SIZE;
+    uint8_t ** table = this->pages[page / BITARRAY_PAGES_PER_TABLE];
+    if(!table)
+        return NULL;
+    uint8_t * p = table[page % BITARRAY_PAGES_PER_TABLE];
+    return p ? p + rel % BITARRAY_PAGE_SIZE : NULL;
+}
+
+uint8_t * Bitarray::page_for_write(int64_t byte)
+{
+    int64_t rel = byte - this->offset;
+    int64_t page = rel / BITARRAY_PAGE_SIZE;
+    uint8_t ** & table = this->pages[page / BITARRAY_PAGES_PER_TABLE];
+    if(!table)
+    {
+        table = (uint8_t **)calloc(BITARRAY_PAGES_PER_TABLE, sizeof(uint8_t *));
+        assert(table);
+    }
+    uint8_t * & p = table[page % BITARRAY_PAGES_PER_TABLE];
+    if(!p)
+    {
+        p = alloc_buffer(BITARRAY_PAGE_SIZE);
+        this->npages++;
+    }
+    if(this->disk)
+        this->disk->dirty_pages.insert(byte / BITARRAY_PAGE_SIZE);
+    return p + rel % BITARRAY_PAGE_SIZE;
+}
+
+// the smallest byte range that holds everything ever set in the array.  for
+// a flat array that's just the array; for a paged one it's the span of the
+// allocated pages.
+void BitarrayLayout::used_range(int64_t * first_byte, int64_t * nbytes) const
+{
+    if(!this->pages)
+    {
+        *first_byte = this->offset;
+        *nbytes = this->size;
+        return;
+    }
+
+    int64_t first = -1, last = -1;
+    int64_t num_pages = this->size / BITARRAY_PAGE_SIZE;
+    for(int64_t page = 0; page < num_pages; page++)
+    {
+        uint8_t ** table = this->pages[page / BITARRAY_PAGES_PER_TABLE];
+        if(!table)
+        {
+            page += BITARRAY_PAGES_PER_TABLE - 1;
+            continue;
+        }
+        if(table[page % BITARRAY_PAGES_PER_TABLE])
+        {
+            if(first < 0)
+                first = page;
+            last = page;
+        }
+    }
+
+    *first_byte = first < 0 ? 0 : this->offset + first * BITARRAY_PAGE_SIZE;
+    *nbytes = first < 0 ? 0 : (last - first + 1) * BITARRAY_PAGE_SIZE;
+}
+
+// copies nbytes bytes, starting at byte first_byte, into dest.  anything
+// outside of the array comes out as zeroes.
+void BitarrayLayout::copy_out(uint8_t * dest, int64_t first_byte, int64_t nbytes) const
+{
+    int64_t begin = MAX(first_byte, this->offset);
+    int64_t end = MIN(first_byte + nbytes, this->offset + this->size);
+
+    if(begin >= end || (!this->array && !this->pages))
+    {
+        memset(dest, 0, nbytes);
+        return;
+    }
+
+    memset(dest, 0, begin - first_byte);
+    memset(dest + (end - first_byte), 0, first_byte + nbytes - end);
+
+    if(!this->pages)
+    {
+        memcpy(dest + (begin - first_byte), this->array + (begin - this->offset), end - begin);
+        return;
+    }
+
+    int64_t pos = begin;
+    while(pos < end)
+    {
+        int64_t n = MIN(end, (pos / BITARRAY_PAGE_SIZE + 1) * BITARRAY_PAGE_SIZE) - pos;
+        const uint8_t * p = this->page_for_read(pos);
+        if(p)
+            memcpy(dest + (pos - first_byte), p, n);
+        else
+            memset(dest + (pos - first_byte), 0, n);
+        pos += n;
+    }
+}
+
+// like copy_out(), but starting at any bit: nbits bits from start_bit on,
+// moved down so that start_bit is bit 0 of dest[0].  the bits after nbits in
+// the last byte are zero.
+void BitarrayLayout::copy_bits(uint8_t * dest, int64_t start_bit, int64_t nbits) const
+{
+    int64_t nbytes = (nbits + 7) / 8;
+    int shift = BIT_OFFSET(start_bit);
+    if(nbytes <= 0)
+        return;
+
+    this->copy_out(dest, BYTE_OFFSET(start_bit), nbytes);
+    if(shift)
+    {
+        // each byte takes its high bits from the one after, which hasn't
+        // been shifted yet.  the last takes them from the byte past the end.
+        uint8_t past;
+        this->copy_out(&past, BYTE_OFFSET(start_bit) + nbytes, 1);
+        for(int64_t i = 0; i < nbytes; i++)
+        {
+            uint8_t next = i + 1 < nbytes ? dest[i + 1] : past;
+            dest[i] = (dest[i] >> shift) | (uint8_t)(next << (8 - shift));
+        }
+    }
+    if(BIT_OFFSET(nbits))
+        dest[nbytes - 1] &= (1 << BIT_OFFSET(nbits)) - 1;
+}
+
+// the reverse of copy_out(): overwrites nbytes bytes, starting at byte
+// first_byte, with data, growing the array as needed.
+void Bitarray::copy_in(int64_t first_byte, const uint8_t * data, int64_t nbytes)
+{
+    if(nbytes <= 0)
+        return;
+
+    if(!this->array && !this->pages)
+        this->init_data(first_byte * 8);
+
+    this->adjust_size_to_reach(first_byte * 8);
+    this->adjust_size_to_reach((first_byte + nbytes) * 8 - 1);
+
+    int64_t byte = first_byte;
+    while(byte < first_byte + nbytes)
+    {
+        int64_t n = MIN(this->run_length(byte), first_byte + nbytes - byte);
+        const uint8_t * src = data + (byte - first_byte);
+
+        // a missing page reads as zeroes already.
+        if(this->pages && all_zero(src, n) && !this->page_for_read(byte))
+        {
+            byte += n;
+            continue;
+        }
+        this->bits += popcount_bytes(src, n) - this->count_range(byte * 8, (byte + n) * 8);
+        memcpy(this->byte_for_write(byte), src, n);
+        byte += n;
+    }
 }
 
 #if 0
@@ -112,16 +444,22 @@ SerializedBitarray::~SerializedBitarray()
 //}
 
 SerializedBitarray::SerializedBitarray(Bitarray * b)
-    : b(b), key(b->key), buffer(NULL), bufsize(0), uncompressed_size(0), is_compressed(0)
+    : b(b), key(b->key), keylen(b->keylen), buffer(NULL), bufsize(0), uncompressed_size(0), is_compressed(0)
 {
-    assert((b->size && b->array) || (!b->size && !b->array));
-    this->uncompressed_size = sizeof(int64_t)*2 + b->size;
+    assert((b->size && (b->array || b->pages)) || (!b->size && !b->array));
+
+    // paged arrays are written out flat, trimmed to the pages actually in
+    // use, so the file format doesn't care which layout an array had.
+    int64_t size, offset;
+    b->used_range(&offset, &size);
+
+    this->uncompressed_size = sizeof(int64_t)*2 + size;
     uint8_t * buffer = (uint8_t *)malloc(this->uncompressed_size);
-    ((int64_t *)buffer)[0] = b->size;
-    ((int64_t *)buffer)[1] = b->offset;
+    ((int64_t *)buffer)[0] = size;
+    ((int64_t *)buffer)[1] = offset;
 
-    if(b->array)
-        memcpy(buffer + sizeof(int64_t)*2, b->array, b->size);
+    if(size)
+        b->copy_out(buffer + sizeof(int64_t)*2, offset, size);
 
     this->buffer = (uint8_t *)malloc(this->uncompressed_size);
     this->bufsize = lzf_compress(buffer, this->uncompressed_size, this->buffer, this->uncompressed_size);
@@ -143,358 +481,2572 @@ SerializedBitarray::SerializedBitarray(Bitarray * b)
     }
 }
 
-SerializedBitarray::SerializedBitarray(const char * key, uint8_t * buffer, int64_t bufsize, int64_t uncompressed_size, uint8_t is_compressed)
-    : b(NULL), key(key), buffer(buffer), bufsize(bufsize), uncompressed_size(uncompressed_size), is_compressed(is_compressed)
+SerializedBitarray::SerializedBitarray(const char * key, size_t keylen, uint8_t * buffer, int64_t bufsize, int64_t uncompressed_size, uint8_t is_compressed)
+    : b(NULL), key(key), keylen(keylen), buffer(buffer), bufsize(bufsize), uncompressed_size(uncompressed_size), is_compressed(is_compressed)
 {
     if(!buffer)
         return;
 
+    // the buffer can come from a client or a damaged file, so nothing in it
+    // is trusted: b is left NULL unless it holds a whole array.
+    if(this->uncompressed_size < (int64_t)sizeof(int64_t)*2 || this->bufsize < 0)
+        return;
+
     if(this->is_compressed)
     {
+        // lzf works in unsigned ints.
+        if(this->uncompressed_size > UINT_MAX || this->bufsize > UINT_MAX)
+            return;
         uint8_t * tmp_buffer = (uint8_t *)malloc(this->uncompressed_size);
-        assert(lzf_decompress(this->buffer, this->bufsize, tmp_buffer, this->uncompressed_size) == this->uncompressed_size);
+        if(!tmp_buffer)
+            return;
+        if(lzf_decompress(this->buffer, this->bufsize, tmp_buffer, this->uncompressed_size) != this->uncompressed_size)
+        {
+            free(tmp_buffer);
+            return;
+        }
         free(this->buffer);
         this->buffer = tmp_buffer;
+        this->bufsize = this->uncompressed_size;
     }
-    else
-        assert(this->uncompressed_size == this->bufsize);
+    else if(this->uncompressed_size != this->bufsize)
+        return;
+
+    int64_t size   = ((int64_t *)this->buffer)[0];
+    int64_t offset = ((int64_t *)this->buffer)[1];
+    if(size < 0 || size > this->uncompressed_size - (int64_t)sizeof(int64_t)*2 || offset < 0 || offset > INT64_MAX / 8 - size)
+        return;
 
-    this->b = new Bitarray(key, -1);
-    this->b->size   = ((int64_t *)this->buffer)[0];
-    this->b->offset = ((int64_t *)this->buffer)[1];
+    this->b = new Bitarray(key, keylen, -1);
+    this->b->size   = size;
+    this->b->offset = offset;
     this->b->array = NULL;
-    if(this->b->size)
+    if(BITARRAY_PAGED_THRESHOLD > 0 && this->b->size > BITARRAY_PAGED_THRESHOLD)
+        this->b->make_paged(this->buffer + sizeof(int64_t)*2, this->b->offset, this->b->size);
+    else if(this->b->size)
     {
-        this->b->array = (uint8_t *)malloc(b->size);
+        this->b->array = this->b->alloc_array(this->b->size);
         memcpy(this->b->array, this->buffer + sizeof(int64_t)*2, this->b->size);
     }
+    this->b->bits = popcount_bytes(this->buffer + sizeof(int64_t)*2, size);
+}
+
+// the array as SerializedBitarray lays it out before compressing: int64
+// size, int64 offset, then the bytes in use.
+void Bitarray::flatten(std::string & flat) const
+{
+    int64_t size, offset;
+    this->used_range(&offset, &size);
+
+    flat.resize(sizeof(int64_t)*2 + size);
+    uint8_t * buffer = (uint8_t *)&flat[0];
+    ((int64_t *)buffer)[0] = size;
+    ((int64_t *)buffer)[1] = offset;
+    if(size)
+        this->copy_out(buffer + sizeof(int64_t)*2, offset, size);
+}
+
+// the Bitarray::freeze() form of a flatten()ed array.  this is the slow
+// part of saving, and doesn't need the array, so flushes do it unlocked.
+void Bitarray::freeze_flat(const std::string & flat, std::string & contents)
+{
+    uint8_t * compressed = (uint8_t *)malloc(flat.size());
+    assert(compressed);
+    int64_t bufsize = lzf_compress(flat.data(), flat.size(), compressed, flat.size());
+    uint8_t is_compressed = bufsize > 0;
+    int64_t uncompressed_size = flat.size();
+    if(!is_compressed)
+        bufsize = flat.size();
+
+    contents.clear();
+    contents.reserve(sizeof(uint8_t) + sizeof(int64_t) + bufsize);
+    contents.append((const char *)&is_compressed,     sizeof(uint8_t));
+    contents.append((const char *)&uncompressed_size, sizeof(int64_t));
+    contents.append(is_compressed ? (const char *)compressed : flat.data(), bufsize);
+    free(compressed);
 }
 
 // XXX: g_file_set_contents writes to a temp file called
 // "key.RANDOM-GIBBERISH", which theoretically could be loaded accidentally if
 // someone requested that exact key at the right moment.  a more robust file
 // writing mechanism should eventually be used.
-void Bitarray::save_frozen(const char * key, SerializedBitarray& ser)
+void Bitarray::save_frozen(const char * key, const std::string & contents)
 {
-    int64_t file_size = sizeof(uint8_t) // is_compressed boolean
-                      + sizeof(int64_t) // uncompressed_size
-                      + ser.bufsize;
-
-    uint8_t * contents = (uint8_t *)malloc(file_size);
+    char * filename = g_strdup_printf("data/%s", key);
 
-    memcpy(contents,                   &ser.is_compressed,     sizeof(uint8_t));
-    memcpy(contents + sizeof(uint8_t), &ser.uncompressed_size, sizeof(int64_t));
-    memcpy(contents + sizeof(uint8_t)
-                    + sizeof(int64_t), ser.buffer, ser.bufsize);
+    g_file_set_contents(filename, contents.data(), contents.size(), NULL); // XXX error handling
 
-    char * filename = g_strdup_printf("data/%s", key);
+    g_free(filename);
 
-    g_file_set_contents(filename, (char *)contents, file_size, NULL); // XXX error handling
+    // the old deltas don't apply to the new file.
+    filename = g_strdup_printf("data/.delta/%s", key);
+    unlink(filename);
+    g_free(filename);
+}
 
+// save_frozen() in two steps, so that the slow part can be done without
+// holding anything: stage_frozen() writes the file under data/.flush, and
+// commit_staged() moves it into place, which is quick.  discard_staged()
+// throws a staged file away instead.
+void Bitarray::stage_frozen(const char * key, const std::string & contents, bool * staged)
+{
+    mkdir("data/.flush", 0755);
+    char * filename = g_strdup_printf("data/.flush/%s", key);
+    *staged = g_file_set_contents(filename, contents.data(), contents.size(), NULL);
     g_free(filename);
-    free(contents);
 }
 
-SerializedBitarray Bitarray::load_frozen(const char * key)
+void Bitarray::commit_staged(const char * key)
 {
+    char * staged_filename = g_strdup_printf("data/.flush/%s", key);
     char * filename = g_strdup_printf("data/%s", key);
-    int64_t file_size;
-    uint8_t * contents;
-
-    uint8_t * buffer = NULL;
-    uint8_t is_compressed = 0;
-    uint64_t bufsize = 0;
-    uint64_t uncompressed_size = 0;
-
-    gboolean got_contents = g_file_get_contents(filename, (char **)&contents, (gsize *)&file_size, NULL);
+    rename(staged_filename, filename);
+    g_free(staged_filename);
     g_free(filename);
 
-    if(got_contents)
-    {
-        is_compressed = contents[0];
-        uncompressed_size = ((int64_t *)(contents + sizeof(uint8_t)))[0];
-        bufsize = file_size - (sizeof(char) + sizeof(int64_t));
-        buffer = (uint8_t *)malloc(bufsize);
-        memcpy(buffer, contents + sizeof(uint8_t) + sizeof(int64_t), bufsize);
-        g_free(contents);
-    }
-
-    return SerializedBitarray(key, buffer, bufsize, uncompressed_size, is_compressed);
+    filename = g_strdup_printf("data/.delta/%s", key);
+    unlink(filename);
+    g_free(filename);
 }
 
-void Bitarray::save_to_disk()
+void Bitarray::discard_staged(const char * key)
 {
-    SerializedBitarray ser(this);
-    Bitarray::save_frozen(this->key, ser);
+    char * filename = g_strdup_printf("data/.flush/%s", key);
+    unlink(filename);
+    g_free(filename);
 }
 
-Bitarray * Bitarray::find_on_disk(const char * key)
+// a hash of a whole data file, for matching delta files up with it.
+static uint64_t hash_contents(const uint8_t * contents, int64_t size)
 {
-    SerializedBitarray ser = Bitarray::load_frozen(key);
-    return ser.b;
+    uint64_t hash = 0;
+    for(int64_t pos = 0; pos < size; pos += BITOP_CHUNK_SIZE)
+        hash = MurmurHash(contents + pos, MIN(BITOP_CHUNK_SIZE, size - pos), (unsigned int)hash);
+    return hash;
 }
 
-void Bitarray::grow_up(int64_t size)
+// a key's data from disk in the frozen form, with any delta file applied.
+// returns false if the key isn't on disk.
+bool Bitarray::read_frozen(const char * key, std::string & contents)
 {
-    uint8_t * new_array = (uint8_t *)calloc(size, 1);
-    memcpy(new_array, this->array, this->size);
-    free(this->array);
-    this->array = new_array;
-    this->size = size;
-}
+    char * filename = g_strdup_printf("data/%s", key);
+    char * delta_filename = g_strdup_printf("data/.delta/%s", key);
+    gchar * file_contents;
+    gsize size;
+    gboolean got_contents = g_file_get_contents(filename, &file_contents, &size, NULL);
+    bool has_delta = g_file_test(delta_filename, G_FILE_TEST_EXISTS);
+    g_free(filename);
+    g_free(delta_filename);
 
-void Bitarray::grow_down(int64_t new_size)
-{
-    // move the starting point back
-    int64_t grow_by = new_size - this->size;
-    int64_t new_begin = this->offset - grow_by;
+    if(!got_contents)
+        return false;
 
-    // if we went too far, past 0, then just reset the start to 0.
-    if(new_begin < 0)
+    if(!has_delta)
     {
-        new_begin = 0;
-        grow_by = this->offset;
-        new_size = this->offset + this->size;
+        contents.assign(file_contents, size);
+        g_free(file_contents);
+        return true;
     }
+    g_free(file_contents);
 
-    uint8_t * new_array = (uint8_t *)calloc(new_size, 1);
-    memcpy(new_array + grow_by, this->array, this->size);
-    free(this->array);
-
-    this->array = new_array;
-    this->size = new_size;
-    this->offset = new_begin;
+    Bitarray * b = Bitarray::find_on_disk(key, strlen(key));
+    if(!b)
+        return false;
+    SerializedBitarray ser(b);
+    Bitarray::freeze(ser, contents);
+    delete b;
+    return true;
 }
 
-void Bitarray::adjust_size_to_reach(int64_t new_index)
+// the on-disk form of an array: the is_compressed flag, the uncompressed
+// size, then the buffer.  replication sends arrays in the same form.
+void Bitarray::freeze(const SerializedBitarray & ser, std::string & contents)
 {
-    if(BYTE_OFFSET(new_index) >= this->offset + this->size)
-    {
-        int64_t min_increase_needed = BYTE_OFFSET(new_index) - (this->offset + this->size - 1);
-        int64_t new_size = MAX(this->size + min_increase_needed, this->size * 2);
-        this->grow_up(new_size);
-    }
-    if(BYTE_OFFSET(new_index) - this->offset < 0)
-    {
-        int64_t min_increase_needed = this->offset - BYTE_OFFSET(new_index);
-        int64_t new_size = MAX(this->size + min_increase_needed, this->size * 2);
-        this->grow_down(new_size);
-    }
+    contents.clear();
+    contents.reserve(sizeof(uint8_t) + sizeof(int64_t) + ser.bufsize);
+    contents.append((const char *)&ser.is_compressed,     sizeof(uint8_t));
+    contents.append((const char *)&ser.uncompressed_size, sizeof(int64_t));
+    contents.append((const char *)ser.buffer,             ser.bufsize);
 }
 
-// public bitarray api
-
-int Bitarray::get_bit(int64_t index)
+Bitarray * Bitarray::thaw(const char * key, size_t keylen, const uint8_t * contents, int64_t size)
 {
-    this->last_access = _get_time();
+    if(size < (int64_t)(sizeof(uint8_t) + sizeof(int64_t)))
+        return NULL;
 
-    if(!this->array || this->offset + this->size < index/8+1 || index/8 < this->offset)
-        return 0;
+    uint8_t is_compressed = contents[0];
+    int64_t uncompressed_size;
+    memcpy(&uncompressed_size, contents + sizeof(uint8_t), sizeof(int64_t));
 
-    return BYTE_SLOT(this, index) & MASK(index) ? 1 : 0;
+    int64_t bufsize = size - (sizeof(uint8_t) + sizeof(int64_t));
+    uint8_t * buffer = (uint8_t *)malloc(MAX(bufsize, 1));
+    memcpy(buffer, contents + sizeof(uint8_t) + sizeof(int64_t), bufsize);
+
+    SerializedBitarray ser(key, keylen, buffer, bufsize, uncompressed_size, is_compressed);
+    return ser.b;
 }
 
-void Bitarray::set_bit(int64_t index)
+// every key with a file in data/.  names starting with a dot are left for
+// bookkeeping files.
+void Bitarray::list_on_disk(std::vector<std::string> & keys)
 {
-    this->last_access = _get_time();
-
-    if(!this->array)
-        this->init_data(index);
+    GDir * dir = g_dir_open("data", 0, NULL);
+    if(!dir)
+        return;
 
-    this->adjust_size_to_reach(index);
+    const gchar * name;
+    while((name = g_dir_read_name(dir)))
+        if(name[0] != '.')
+            keys.push_back(name);
 
-    assert(index >= 0);
-    assert(this->offset >= 0);
-    if(BYTE_OFFSET(index) - this->offset < 0)
-    {
-        abort();
-    }
-    assert(BYTE_OFFSET(index) - this->offset <  this->size);
-    BYTE_SLOT(this, index) |= MASK(index);
+    g_dir_close(dir);
 }
 
-// public bitbox api
-
-gint timestamp_compare(gconstpointer ap, gconstpointer bp)
+void Bitarray::delete_from_disk(const char * key)
 {
-    gint a = GPOINTER_TO_INT(ap);
-    gint b = GPOINTER_TO_INT(bp);
-    return a == b ? 0 : (a < b ? -1 : 1);
+    char * filename = g_strdup_printf("data/%s", key);
+    unlink(filename);
+    g_free(filename);
+
+    filename = g_strdup_printf("data/.delta/%s", key);
+    unlink(filename);
+    g_free(filename);
 }
 
-Bitbox::Bitbox()
+// data/<key> and data/.delta/<key> together, or 0 if neither exists.
+int64_t Bitarray::disk_bytes(const char * key)
 {
-    this->hash.set_deleted_key("");
+    int64_t bytes = 0;
+    struct stat st;
 
-    this->need_disk_write.set_deleted_key(NULL);
-}
+    char * filename = g_strdup_printf("data/%s", key);
+    if(stat(filename, &st) == 0)
+        bytes += st.st_size;
+    g_free(filename);
 
-Bitbox::~Bitbox()
-{
-    Bitbox::hash_t::iterator it = this->hash.begin();
-    for(; it != this->hash.end(); ++it)
-    {
-        delete it->second;
-        this->hash.erase(it);
-    }
+    filename = g_strdup_printf("data/.delta/%s", key);
+    if(stat(filename, &st) == 0)
+        bytes += st.st_size;
+    g_free(filename);
+
+    return bytes;
 }
 
-void Bitbox::update_key_in_lru(const char * key, int64_t old_timestamp, int64_t new_timestamp)
+void Bitarray::save_to_disk()
 {
-    assert(new_timestamp);
-    if(old_timestamp)
-    {
-        // multiple keys may have the same last-modified time.  so scan through
-        // any siblings and find the one we're looking for.
-        Bitbox::lru_map_t::iterator it = this->lru.find(old_timestamp);
-        Bitbox::lru_map_t::iterator upper_bound = this->lru.upper_bound(old_timestamp);
+    if(this->disk && this->save_dirty_pages())
+        return;
 
-        for(; it != upper_bound; it++)
-        {
-            if(!strcmp(it->second, key)) // found it
-            {
-                // delete it
-                free(it->second);
-                this->lru.erase(it);
-                break;
-            }
-        }
+    std::string contents;
+    {
+        SerializedBitarray ser(this);
+        Bitarray::freeze(ser, contents);
     }
+    Bitarray::save_frozen(this->key, contents);
 
-    // and add the key with its new timestamp
-    this->lru.insert(Bitbox::lru_map_t::value_type(new_timestamp, strdup(key)));
-    // could be smarter about reusing the key instead of always freeing & re-copying
+    if(this->pages)
+        this->saved_in_full(hash_contents((const uint8_t *)contents.data(), contents.size()), contents.size());
 }
 
-Bitarray * Bitbox::find_array_in_memory(const char * key)
+// a paged array was just written out whole, so later saves can be deltas.
+void Bitarray::saved_in_full(uint64_t base_hash, int64_t base_bytes)
 {
-    Bitbox::hash_t::iterator it = this->hash.find(key);
-    return it == this->hash.end() ? NULL : it->second;
+    if(!this->disk)
+        this->disk = new BitarrayDiskState();
+    this->disk->dirty_pages.clear();
+    this->disk->base_hash = base_hash;
+    this->disk->base_bytes = base_bytes;
+    this->disk->delta_bytes = 0;
 }
 
-void Bitbox::add_array_to_hash(Bitarray * b)
+// appends the pages changed since the last save to the delta file, each as
+//
+//     int64 page, uint8 is_compressed, int64 bufsize, buffer
+//
+// where the buffer holds BITARRAY_PAGE_SIZE bytes once uncompressed.
+// returns false, having written nothing, if a full save would be better.
+bool Bitarray::save_dirty_pages()
 {
-    this->hash[b->key] = b;
-    this->update_key_in_lru(b->key, 0, b->last_access);
+    std::string records;
+    if(!this->disk->delta_bytes)
+        records.append((const char *)&this->disk->base_hash, sizeof(uint64_t));
+
+    uint8_t * page = (uint8_t *)malloc(BITARRAY_PAGE_SIZE);
+    uint8_t * compressed = (uint8_t *)malloc(BITARRAY_PAGE_SIZE);
+    assert(page && compressed);
+    std::set<int64_t>::iterator it = this->disk->dirty_pages.begin();
+    for(; it != this->disk->dirty_pages.end(); ++it)
+    {
+        int64_t page_number = *it;
+        this->copy_out(page, page_number * BITARRAY_PAGE_SIZE, BITARRAY_PAGE_SIZE);
+
+        int64_t bufsize = lzf_compress(page, BITARRAY_PAGE_SIZE, compressed, BITARRAY_PAGE_SIZE);
+        uint8_t is_compressed = bufsize > 0;
+        if(!is_compressed)
+            bufsize = BITARRAY_PAGE_SIZE;
+
+        records.append((const char *)&page_number, sizeof(int64_t));
+        records.append((const char *)&is_compressed, sizeof(uint8_t));
+        records.append((const char *)&bufsize, sizeof(int64_t));
+        records.append((const char *)(is_compressed ? compressed : page), bufsize);
+    }
+    free(page);
+    free(compressed);
+
+    if(this->disk->delta_bytes + (int64_t)records.size() > this->disk->base_bytes)
+        return false;
+
+    mkdir("data/.delta", 0755);
+    char * delta_filename = g_strdup_printf("data/.delta/%s", this->key);
+    // a fresh delta file replaces any that a crash left behind.
+    FILE * f = fopen(delta_filename, this->disk->delta_bytes ? "ab" : "wb");
+    g_free(delta_filename);
+    if(!f)
+        return false;
+
+    bool ok = fwrite(records.data(), 1, records.size(), f) == records.size();
+    ok = fclose(f) == 0 && ok;
+    if(!ok)
+        return false; // XXX a partly written record is ignored when it's read
+
+    this->disk->delta_bytes += records.size();
+    this->disk->dirty_pages.clear();
+    return true;
 }
 
-Bitarray * Bitbox::find_array(const char * key)
+// applies the records in a delta file, if it belongs to the file whose hash
+// is base_hash.
+void Bitarray::apply_deltas(const uint8_t * contents, int64_t size, uint64_t base_hash)
 {
-    Bitarray * b = this->find_array_in_memory(key);
-    if(b)
-        return b;
+    uint64_t hash;
+    if(size < (int64_t)sizeof(hash))
+        return;
+    memcpy(&hash, contents, sizeof(hash));
+    if(hash != base_hash)
+        return;
 
-    b = Bitarray::find_on_disk(key);
-    if(b)
-        this->add_array_to_hash(b);
+    uint8_t * page = (uint8_t *)malloc(BITARRAY_PAGE_SIZE);
+    assert(page);
+    const uint8_t * p = contents + sizeof(hash);
+    const uint8_t * end = contents + size;
+    const int64_t header = sizeof(int64_t) + sizeof(uint8_t) + sizeof(int64_t);
+    while(end - p >= header)
+    {
+        int64_t page_number, bufsize;
+        uint8_t is_compressed = p[sizeof(int64_t)];
+        memcpy(&page_number, p, sizeof(int64_t));
+        memcpy(&bufsize, p + sizeof(int64_t) + sizeof(uint8_t), sizeof(int64_t));
+        p += header;
+        if(bufsize < 0 || end - p < bufsize)
+            break; // cut short by a crash
+
+        if(is_compressed)
+        {
+            if(lzf_decompress(p, bufsize, page, BITARRAY_PAGE_SIZE) != BITARRAY_PAGE_SIZE)
+                break;
+        }
+        else if(bufsize == BITARRAY_PAGE_SIZE)
+            memcpy(page, p, BITARRAY_PAGE_SIZE);
+        else
+            break;
 
-    return b;
+        this->copy_in(page_number * BITARRAY_PAGE_SIZE, page, BITARRAY_PAGE_SIZE);
+        p += bufsize;
+    }
+    free(page);
 }
 
-Bitarray * Bitbox::find_or_create_array(const char * key)
+Bitarray * Bitarray::find_on_disk(const char * key, size_t keylen)
 {
-    Bitarray * b = Bitbox::find_array(key);
+    char * filename = g_strdup_printf("data/%s", key);
+    gchar * contents;
+    gsize size;
+    gboolean got_contents = g_file_get_contents(filename, &contents, &size, NULL);
+    g_free(filename);
+    if(!got_contents)
+        return NULL;
+
+    Bitarray * b = Bitarray::thaw(key, keylen, (const uint8_t *)contents, size);
     if(!b)
     {
-        b = new Bitarray(key, -1);
-        this->add_array_to_hash(b);
+        g_free(contents);
+        return NULL;
+    }
+    uint64_t base_hash = hash_contents((const uint8_t *)contents, size);
+    g_free(contents);
+
+    int64_t delta_bytes = 0;
+    filename = g_strdup_printf("data/.delta/%s", key);
+    if(g_file_get_contents(filename, &contents, (gsize *)&delta_bytes, NULL))
+    {
+        b->apply_deltas((const uint8_t *)contents, delta_bytes, base_hash);
+        g_free(contents);
+    }
+    g_free(filename);
+
+    // only a paged array can be saved a page at a time.
+    if(b->pages)
+    {
+        b->disk = new BitarrayDiskState();
+        b->disk->base_hash = base_hash;
+        b->disk->base_bytes = size;
+        b->disk->delta_bytes = delta_bytes;
+    }
+    return b;
+}
+
+void Bitarray::grow_up(int64_t size)
+{
+    // the inline buffer is kept zeroed past the end of the array, so growing
+    // within it is free.
+    if(this->is_inline() && size <= BITARRAY_INLINE_SIZE)
+    {
+        this->size = size;
+        return;
+    }
+
+    uint8_t * new_array = this->alloc_array(size);
+    memcpy(new_array, this->array, this->size);
+    this->replace_array(new_array, size);
+}
+
+void Bitarray::grow_down(int64_t new_size)
+{
+    // move the starting point back
+    int64_t grow_by = new_size - this->size;
+    int64_t new_begin = this->offset - grow_by;
+
+    // if we went too far, past 0, then just reset the start to 0.
+    if(new_begin < 0)
+    {
+        new_begin = 0;
+        grow_by = this->offset;
+        new_size = this->offset + this->size;
+    }
+
+    if(this->is_inline() && new_size <= BITARRAY_INLINE_SIZE)
+    {
+        memmove(this->array + grow_by, this->array, this->size);
+        memset(this->array, 0, grow_by);
+    }
+    else
+    {
+        uint8_t * new_array = this->alloc_array(new_size);
+        memcpy(new_array + grow_by, this->array, this->size);
+        this->replace_array(new_array, new_size);
+    }
+
+    this->size = new_size;
+    this->offset = new_begin;
+}
+
+void Bitarray::adjust_size_to_reach(int64_t new_index)
+{
+    int64_t byte = BYTE_OFFSET(new_index);
+
+    if(!this->pages && BITARRAY_PAGED_THRESHOLD > 0 &&
+            MAX(this->offset + this->size, byte + 1) - MIN(this->offset, byte) > BITARRAY_PAGED_THRESHOLD)
+        this->convert_to_paged();
+
+    if(this->pages)
+    {
+        this->grow_pages_to_reach(byte);
+        return;
+    }
+
+    if(byte >= this->offset + this->size)
+    {
+        int64_t min_increase_needed = byte - (this->offset + this->size - 1);
+        int64_t new_size = MAX(this->size + min_increase_needed, this->size * 2);
+        this->grow_up(new_size);
+    }
+    if(byte - this->offset < 0)
+    {
+        int64_t min_increase_needed = this->offset - byte;
+        int64_t new_size = MAX(this->size + min_increase_needed, this->size * 2);
+        this->grow_down(new_size);
+    }
+}
+
+// byte-level access for operations that work on runs of bytes.  byte must
+// be within [offset, offset+size).  run_length() is the number of bytes from
+// byte on that are contiguous in memory.
+
+const uint8_t * BitarrayLayout::byte_for_read(int64_t byte) const
+{
+    return this->pages ? this->page_for_read(byte) : this->array + (byte - this->offset);
+}
+
+uint8_t * Bitarray::byte_for_write(int64_t byte)
+{
+    return this->pages ? this->page_for_write(byte) : this->array + (byte - this->offset);
+}
+
+int64_t BitarrayLayout::run_length(int64_t byte) const
+{
+    if(this->pages)
+        return BITARRAY_PAGE_SIZE - (byte - this->offset) % BITARRAY_PAGE_SIZE;
+    return this->offset + this->size - byte;
+}
+
+// the position of the first bit in [start_bit, end_bit) that is equal to
+// value, or -1 if there isn't one.  everything outside of the array is zero.
+int64_t BitarrayLayout::find_bit(int value, int64_t start_bit, int64_t end_bit) const
+{
+    int64_t bit = start_bit;
+
+    while(bit < end_bit)
+    {
+        int64_t byte = BYTE_OFFSET(bit);
+
+        if((!this->array && !this->pages) || byte >= this->offset + this->size)
+            return value ? -1 : bit;
+
+        if(byte < this->offset)
+        {
+            if(!value)
+                return bit;
+            bit = this->offset * 8;
+            continue;
+        }
+
+        int64_t n = this->run_length(byte);
+        const uint8_t * p = this->byte_for_read(byte);
+
+        if(!p)
+        {
+            if(!value)
+                return bit;
+        }
+        else
+        {
+            for(int64_t i = 0; i < n && (byte + i) * 8 < end_bit; i++)
+            {
+                uint8_t v = value ? p[i] : (uint8_t)~p[i];
+                if(i == 0)
+                    v &= 0xff << BIT_OFFSET(bit);
+                if(v)
+                {
+                    int64_t found = (byte + i) * 8 + __builtin_ctz(v);
+                    return found < end_bit ? found : -1;
+                }
+            }
+        }
+
+        bit = (byte + n) * 8;
+    }
+
+    return -1;
+}
+
+// ORs nbytes bytes of data into the array, starting at byte first_byte,
+// growing the array as needed.
+void Bitarray::or_bytes(int64_t first_byte, const uint8_t * data, int64_t nbytes)
+{
+    if(nbytes <= 0)
+        return;
+
+    if(!this->array && !this->pages)
+        this->init_data(first_byte * 8);
+
+    this->adjust_size_to_reach(first_byte * 8);
+    this->adjust_size_to_reach((first_byte + nbytes) * 8 - 1);
+
+    int64_t byte = first_byte;
+    while(byte < first_byte + nbytes)
+    {
+        int64_t n = MIN(this->run_length(byte), first_byte + nbytes - byte);
+        const uint8_t * src = data + (byte - first_byte);
+
+        // don't allocate pages just to OR zeroes into them.
+        if(!this->pages || !all_zero(src, n))
+        {
+            uint8_t * p = this->byte_for_write(byte);
+            for(int64_t i = 0; i < n; i++)
+            {
+                this->bits += __builtin_popcount(src[i] & ~p[i]);
+                p[i] |= src[i];
+            }
+        }
+        byte += n;
+    }
+}
+
+// the same, but starting at any bit: bit i of data goes to start_bit + i.
+// each byte of the array takes the low bits of one byte of data, moved up,
+// and the high bits of the one before.
+void Bitarray::or_bits(int64_t start_bit, const uint8_t * data, int64_t nbytes)
+{
+    int shift = BIT_OFFSET(start_bit);
+    if(!shift)
+    {
+        this->or_bytes(BYTE_OFFSET(start_bit), data, nbytes);
+        return;
+    }
+    if(nbytes <= 0)
+        return;
+
+    if(!this->array && !this->pages)
+        this->init_data(start_bit);
+
+    this->adjust_size_to_reach(start_bit);
+    this->adjust_size_to_reach(start_bit + nbytes * 8 - 1);
+
+    int64_t first_byte = BYTE_OFFSET(start_bit);
+    int64_t last_byte = first_byte + nbytes; // takes data's last high bits
+    int64_t byte = first_byte;
+    while(byte <= last_byte)
+    {
+        int64_t n = MIN(this->run_length(byte), last_byte + 1 - byte);
+
+        // pages are only allocated for bytes that get something.
+        uint8_t * p = NULL;
+        for(int64_t i = 0; i < n; i++)
+        {
+            int64_t j = byte - first_byte + i;
+            uint8_t v = (j < nbytes ? (uint8_t)(data[j] << shift) : 0) | (j > 0 ? data[j - 1] >> (8 - shift) : 0);
+            if(!v)
+                continue;
+            if(!p)
+                p = this->byte_for_write(byte);
+            this->bits += __builtin_popcount(v & ~p[i]);
+            p[i] |= v;
+        }
+        byte += n;
+    }
+}
+
+// moves other's data into this array, replacing what was here, and leaves
+// other empty.
+void Bitarray::or_array(const Bitarray * other)
+{
+    int64_t first_byte, nbytes;
+    other->used_range(&first_byte, &nbytes);
+
+    uint8_t * chunk = (uint8_t *)malloc(BITOP_CHUNK_SIZE);
+    assert(chunk);
+    for(int64_t pos = first_byte; pos < first_byte + nbytes; pos += BITOP_CHUNK_SIZE)
+    {
+        int64_t n = MIN(BITOP_CHUNK_SIZE, first_byte + nbytes - pos);
+        other->copy_out(chunk, pos, n);
+        if(!all_zero(chunk, n))
+            this->or_bytes(pos, chunk, n);
+    }
+    free(chunk);
+}
+
+void Bitarray::take_data(Bitarray * other)
+{
+    this->replace_array(NULL, 0);
+    this->free_pages();
+    delete this->disk;
+    this->disk = NULL;
+
+    if(other->is_inline())
+    {
+        memcpy(this->inline_array, other->inline_array, BITARRAY_INLINE_SIZE);
+        this->array = this->inline_array;
+    }
+    else
+        this->array = other->array;
+
+    this->pages = other->pages;
+    this->npages = other->npages;
+    this->bits = other->bits;
+    this->size = other->size;
+    this->offset = other->offset;
+
+    delete other->disk;
+    other->array = NULL;
+    other->pages = NULL;
+    other->npages = 0;
+    other->bits = 0;
+    other->disk = NULL;
+    other->size = 0;
+    other->offset = 0;
+}
+
+// public bitarray api
+
+int BitarrayLayout::get_bit(int64_t index) const
+{
+    int64_t byte = BYTE_OFFSET(index);
+    if(byte < this->offset || byte >= this->offset + this->size)
+        return 0;
+
+    if(this->pages)
+    {
+        const uint8_t * p = this->page_for_read(byte);
+        return p && (*p & MASK(index)) ? 1 : 0;
+    }
+
+    return BYTE_SLOT(this, index) & MASK(index) ? 1 : 0;
+}
+
+static uint64_t field_mask(int width)
+{
+    return width >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+}
+
+// the width bits (1 to 64) from bit on, with bit as the lowest.  a field
+// covers at most 9 bytes, which are loaded as a word and a byte straight from
+// the array when they're all in one run, and gathered with copy_out() when
+// they aren't.
+uint64_t BitarrayLayout::get_field(int64_t bit, int width) const
+{
+    int64_t first = BYTE_OFFSET(bit);
+    int shift = BIT_OFFSET(bit);
+    uint8_t buf[9];
+    const uint8_t * p = buf;
+
+    if((this->array || this->pages) && first >= this->offset && first < this->offset + this->size &&
+            this->run_length(first) >= (int64_t)sizeof(buf))
+    {
+        p = this->byte_for_read(first);
+        if(!p)
+            return 0; // a missing page
+    }
+    else
+        this->copy_out(buf, first, sizeof(buf));
+
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    uint64_t value = word >> shift;
+    if(shift)
+        value |= (uint64_t)p[8] << (64 - shift);
+    return value & field_mask(width);
+}
+
+void Bitarray::set_bit(int64_t index)
+{
+    if(!this->array && !this->pages)
+        this->init_data(index);
+
+    this->adjust_size_to_reach(index);
+
+    assert(index >= 0);
+    assert(this->offset >= 0);
+    if(BYTE_OFFSET(index) - this->offset < 0)
+    {
+        abort();
+    }
+    assert(BYTE_OFFSET(index) - this->offset <  this->size);
+
+    uint8_t & byte = this->pages ? *this->page_for_write(BYTE_OFFSET(index)) : BYTE_SLOT(this, index);
+    if(!(byte & MASK(index)))
+    {
+        byte |= MASK(index);
+        this->bits++;
+    }
+}
+
+void Bitarray::clear_bit(int64_t index)
+{
+    int64_t byte = BYTE_OFFSET(index);
+    if(byte < this->offset || byte >= this->offset + this->size)
+        return;
+
+    // a missing page is already all zeroes.
+    uint8_t * p = (uint8_t *)this->byte_for_read(byte);
+    if(p && (*p & MASK(index)))
+    {
+        *p &= ~MASK(index);
+        this->bits--;
+    }
+    if(p && this->disk)
+        this->disk->dirty_pages.insert(byte / BITARRAY_PAGE_SIZE);
+}
+
+// overwrites the width bits from bit on with the low bits of value, and
+// returns what they were.  as in get_field(), the bytes are stored as a word
+// and a byte when they're in one run, and go through copy_in() otherwise.
+uint64_t Bitarray::set_field(int64_t bit, int width, uint64_t value)
+{
+    uint64_t mask = field_mask(width);
+    uint64_t old = this->get_field(bit, width);
+    value &= mask;
+    if(value == old)
+        return old;
+
+    if(!this->array && !this->pages)
+        this->init_data(bit);
+
+    this->adjust_size_to_reach(bit);
+    this->adjust_size_to_reach(bit + width - 1);
+
+    int64_t first = BYTE_OFFSET(bit);
+    int shift = BIT_OFFSET(bit);
+    uint8_t buf[9];
+    bool direct = this->run_length(first) >= (int64_t)sizeof(buf);
+    uint8_t * p = buf;
+    if(direct)
+        p = this->byte_for_write(first);
+    else
+        this->copy_out(buf, first, sizeof(buf));
+
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    word = (word & ~(mask << shift)) | (value << shift);
+    memcpy(p, &word, sizeof(word));
+    if(shift)
+        p[8] = (p[8] & ~(uint8_t)(mask >> (64 - shift))) | (uint8_t)(value >> (64 - shift));
+
+    if(direct)
+        this->bits += __builtin_popcountll(value) - __builtin_popcountll(old);
+    else
+        this->copy_in(first, buf, (shift + width + 7) / 8);
+    return old;
+}
+
+// sets every bit in [start_bit, end_bit)
+void Bitarray::set_range(int64_t start_bit, int64_t end_bit)
+{
+    if(end_bit <= start_bit)
+        return;
+
+    if(!this->array && !this->pages)
+        this->init_data(start_bit);
+
+    this->adjust_size_to_reach(start_bit);
+    this->adjust_size_to_reach(end_bit - 1);
+    this->bits += (end_bit - start_bit) - this->count_range(start_bit, end_bit);
+
+    int64_t first = BYTE_OFFSET(start_bit);
+    int64_t last = BYTE_OFFSET(end_bit - 1);
+    uint8_t first_mask = 0xff << BIT_OFFSET(start_bit);
+    uint8_t last_mask = 0xff >> (7 - BIT_OFFSET(end_bit - 1));
+
+    if(first == last)
+    {
+        *this->byte_for_write(first) |= first_mask & last_mask;
+        return;
+    }
+
+    *this->byte_for_write(first) |= first_mask;
+    *this->byte_for_write(last) |= last_mask;
+
+    for(int64_t byte = first + 1; byte < last; )
+    {
+        int64_t n = MIN(this->run_length(byte), last - byte);
+        memset(this->byte_for_write(byte), 0xff, n);
+        byte += n;
+    }
+}
+
+// counts the set bits in [start_bit, end_bit)
+int64_t BitarrayLayout::count_range(int64_t start_bit, int64_t end_bit) const
+{
+    start_bit = MAX(start_bit, this->offset * 8);
+    end_bit = MIN(end_bit, (this->offset + this->size) * 8);
+    if(end_bit <= start_bit || (!this->array && !this->pages))
+        return 0;
+
+    int64_t first = BYTE_OFFSET(start_bit);
+    int64_t last = BYTE_OFFSET(end_bit - 1);
+    int64_t count = 0;
+
+    for(int64_t byte = first; byte <= last; )
+    {
+        int64_t n = MIN(this->run_length(byte), last + 1 - byte);
+        const uint8_t * p = this->byte_for_read(byte);
+        if(p)
+            count += popcount_bytes(p, n);
+        byte += n;
+    }
+
+    // take back the bits in the edge bytes that fall outside of the range.
+    const uint8_t * p = this->byte_for_read(first);
+    if(p)
+        count -= __builtin_popcount(*p & (uint8_t)~(0xff << BIT_OFFSET(start_bit)));
+    p = this->byte_for_read(last);
+    if(p)
+        count -= __builtin_popcount(*p & (uint8_t)~(0xff >> (7 - BIT_OFFSET(end_bit - 1))));
+
+    return count;
+}
+
+// public bitbox api
+
+gint timestamp_compare(gconstpointer ap, gconstpointer bp)
+{
+    gint a = GPOINTER_TO_INT(ap);
+    gint b = GPOINTER_TO_INT(bp);
+    return a == b ? 0 : (a < b ? -1 : 1);
+}
+
+Bitbox::Bitbox(int partition, int npartitions)
+    : version(0), changing(0), partition(partition), npartitions(npartitions),
+      expiry_path(Bitbox::expiry_log_path(partition, npartitions)),
+      clock(0), eviction(EvictionPolicy::create(EVICTION_DEFAULT_POLICY)),
+      cache_hits(0), cache_tier_hits(0), cache_misses(0), cache_evictions(0), loads_waited(0),
+      prefetch_stopping(false), prefetch_loaded(0), prefetch_skipped(0),
+      tier(BITBOX_COMPRESSED_LIMIT / npartitions),
+      flush_pool(NULL), flush_batches(0), flush_arrays(0), flush_bytes(0),
+      expiry_log(NULL), keys_expired(0),
+      exporting(false), export_spoiled(false), export_keys(0), listener(NULL)
+{
+    assert(npartitions >= 1 && partition >= 0 && partition < npartitions);
+    this->need_disk_write.set_deleted_key(NULL);
+    this->load_expiries();
+    if(npartitions == 1)
+    {
+        this->open_expiry_log();
+        Bitbox::remove_stale_expiry_logs(1);
+    }
+
+    std::vector<std::string> keys, owned;
+    Bitarray::list_on_disk(keys);
+    for(size_t i = 0; i < keys.size(); i++)
+        if(this->owns(keys[i]))
+            owned.push_back(keys[i]);
+    this->key_index.rebuild(owned);
+}
+
+Bitbox::~Bitbox()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->prefetch_stopping = true;
+    }
+    this->prefetch_ready.notify_all();
+    for(size_t i = 0; i < this->prefetch_threads.size(); i++)
+        this->prefetch_threads[i].join();
+
+    Bitbox::hash_t::iterator it = this->hash.begin();
+    for(; it != this->hash.end(); ++it)
+    {
+        delete *it;
+        this->hash.erase_at(it);
+    }
+
+    delete this->eviction;
+    delete this->flush_pool;
+
+    if(this->expiry_log)
+        fclose(this->expiry_log);
+}
+
+int Bitbox::partition_for(const std::string & key, int npartitions)
+{
+    if(npartitions == 1)
+        return 0;
+    // the high half, so as not to line up with KeyTable's slots.
+    return (KeyTable::hash_key(key.data(), key.size()) >> 32) % npartitions;
+}
+
+bool Bitbox::owns(const std::string & key) const
+{
+    return Bitbox::partition_for(key, this->npartitions) == this->partition;
+}
+
+std::string Bitbox::expiry_log_path(int partition, int npartitions)
+{
+    if(npartitions == 1)
+        return "data/.expiries";
+
+    char path[64];
+    snprintf(path, sizeof(path), "data/.expiries.%d", partition);
+    return path;
+}
+
+void Bitbox::expiry_logs(std::vector<std::string> & paths)
+{
+    GDir * dir = g_dir_open("data", 0, NULL);
+    if(!dir)
+        return;
+
+    const gchar * name;
+    while((name = g_dir_read_name(dir)))
+        if(!strcmp(name, ".expiries") || !strncmp(name, ".expiries.", strlen(".expiries.")))
+            paths.push_back(std::string("data/") + name);
+    g_dir_close(dir);
+}
+
+// each partition reads every log, so that nothing is lost when the number of
+// partitions changes, and then writes its own keys back to its own.  once they
+// all have, the logs that aren't in use any more can go.
+void Bitbox::remove_stale_expiry_logs(int npartitions)
+{
+    std::vector<std::string> paths;
+    Bitbox::expiry_logs(paths);
+    for(size_t i = 0; i < paths.size(); i++)
+    {
+        bool used = false;
+        for(int p = 0; p < npartitions && !used; p++)
+            used = paths[i] == Bitbox::expiry_log_path(p, npartitions);
+        if(!used)
+            unlink(paths[i].c_str());
+    }
+}
+
+// data/.expiries (data/.expiries.N for partition N of several) is a log of
+// (int64 when, uint32 keylen, key) records, the last one for a key winning.  a
+// when of 0 means the key stopped expiring.
+void Bitbox::load_expiries()
+{
+    std::vector<std::pair<std::string, int64_t> > none;
+    this->expiry_wheel.advance(time(NULL), none);
+
+    std::vector<std::string> paths;
+    Bitbox::expiry_logs(paths);
+    for(size_t i = 0; i < paths.size(); i++)
+    {
+        gchar * contents;
+        gsize size;
+        if(!g_file_get_contents(paths[i].c_str(), &contents, &size, NULL))
+            continue;
+
+        const char * p = contents;
+        const char * end = contents + size;
+        while(end - p >= (ptrdiff_t)(sizeof(int64_t) + sizeof(uint32_t)))
+        {
+            int64_t when;
+            uint32_t keylen;
+            memcpy(&when, p, sizeof(when));
+            memcpy(&keylen, p + sizeof(when), sizeof(keylen));
+            p += sizeof(when) + sizeof(keylen);
+            if(end - p < keylen)
+                break; // cut short by a crash
+
+            std::string key(p, keylen);
+            p += keylen;
+            if(!this->owns(key))
+                continue;
+            if(when)
+                this->expiries[key] = when;
+            else
+                this->expiries.erase(key);
+        }
+        g_free(contents);
+    }
+
+    for(Bitbox::expiry_map_t::iterator it = this->expiries.begin(); it != this->expiries.end(); ++it)
+        this->expiry_wheel.add(it->first, it->second);
+}
+
+// writes the log back out without the superseded records, and starts
+// appending to it.  with several partitions, this waits until all of them
+// have read the logs, since it may overwrite one that another hasn't read.
+void Bitbox::open_expiry_log()
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    assert(!this->expiry_log);
+
+    std::string compacted;
+    for(Bitbox::expiry_map_t::iterator it = this->expiries.begin(); it != this->expiries.end(); ++it)
+    {
+        uint32_t keylen = it->first.size();
+        compacted.append((const char *)&it->second, sizeof(int64_t));
+        compacted.append((const char *)&keylen, sizeof(keylen));
+        compacted.append(it->first);
+    }
+    g_file_set_contents(this->expiry_path.c_str(), compacted.data(), compacted.size(), NULL);
+
+    this->expiry_log = fopen(this->expiry_path.c_str(), "ab");
+}
+
+void Bitbox::log_expiry(const std::string & key, int64_t when)
+{
+    if(!this->expiry_log)
+        return;
+
+    uint32_t keylen = key.size();
+    fwrite(&when, sizeof(when), 1, this->expiry_log);
+    fwrite(&keylen, sizeof(keylen), 1, this->expiry_log);
+    fwrite(key.data(), 1, keylen, this->expiry_log);
+    fflush(this->expiry_log); // XXX error handling
+}
+
+Bitbox::Change::Change(Bitbox * box)
+    : box(box)
+{
+    if(box->changing++ == 0)
+    {
+        box->version.store(box->version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+}
+
+Bitbox::Change::~Change()
+{
+    if(--this->box->changing == 0)
+        this->box->version.store(this->box->version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+static void delete_bitarray(void * b)
+{
+    delete (Bitarray *)b;
+}
+
+// for arrays that have been in the hash, which lock-free readers may still be
+// looking at.
+void Bitbox::retire(Bitarray * b)
+{
+    epoch_retire(b, delete_bitarray);
+}
+
+bool Bitbox::unchanged_since(uint64_t version)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return this->version.load(std::memory_order_relaxed) == version;
+}
+
+// a thread's lock-free reads, across every box.
+static thread_local int64_t unlocked_reads = 0;
+
+// lock-free reads don't touch the eviction policy as they go, so now and then
+// one does it for all of them, unless that would mean waiting.
+void Bitbox::note_unlocked_read(const std::string & key)
+{
+    if(++unlocked_reads % BITBOX_UNLOCKED_TOUCH_EVERY || !this->mu.try_lock())
+        return;
+
+    this->clock++;
+    this->cache_hits += BITBOX_UNLOCKED_TOUCH_EVERY;
+    Bitarray * b = this->hash.find(key.data(), key.size());
+    if(b)
+        this->touch(b);
+    this->mu.unlock();
+}
+
+// runs read on the array for key, if it's in memory, without taking the lock.
+// the hash and the array are copied, checked against the version, and read
+// from, and the version is checked again.  while a change is under way, or
+// if one gets in between, it starts over.  read may run more than once, so
+// it should only set its result.  returns false if the key isn't in memory,
+// or if changes kept getting in the way, and the caller should take the lock.
+template<typename Read>
+bool Bitbox::read_unlocked(const std::string & key, const Read & read)
+{
+    EpochGuard epoch;
+    if(!epoch.entered())
+        return false;
+
+    uint64_t hash = KeyTable::hash_key(key.data(), key.size());
+    for(int tries = 0; tries < BITBOX_UNLOCKED_READ_TRIES; tries++)
+    {
+        uint64_t version = this->version.load(std::memory_order_acquire);
+        if(version & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        KeyTable::Layout table = this->hash.layout();
+        if(!this->unchanged_since(version))
+            continue;
+
+        Bitarray * b = KeyTable::find_in(table, key.data(), key.size(), hash);
+        if(!b)
+        {
+            if(this->unchanged_since(version))
+                return false;
+            continue;
+        }
+
+        BitarrayLayout layout = *b;
+        if(!this->unchanged_since(version))
+            continue;
+
+        read(layout);
+        if(!this->unchanged_since(version))
+            continue;
+
+        this->note_unlocked_read(key);
+        return true;
+    }
+    return false;
+}
+
+void Bitbox::add_array_to_hash(Bitarray * b, uint64_t hash)
+{
+    Change change(this);
+    this->hash.insert(b, hash);
+    b->last_access = this->clock;
+    this->eviction->added(b, b->memory_size());
+}
+
+void Bitbox::touch(Bitarray * b)
+{
+    if(b->last_access == this->clock)
+        return;
+
+    b->last_access = this->clock;
+    this->eviction->accessed(b, b->memory_size());
+}
+
+Bitarray * Bitbox::find_array(const std::string & key, uint64_t hash)
+{
+    Bitarray * b = this->hash.find(key.data(), key.size(), hash);
+    if(b)
+    {
+        this->cache_hits++;
+        return b;
+    }
+
+    std::string frozen;
+    bool dirty;
+    if(this->tier.take(key, frozen, &dirty))
+    {
+        b = Bitarray::thaw(key.data(), key.size(), (const uint8_t *)frozen.data(), frozen.size());
+        assert(b);
+        this->cache_tier_hits++;
+        this->add_array_to_hash(b, hash);
+        if(dirty)
+            this->need_disk_write.insert(b);
+        return b;
+    }
+
+    b = Bitarray::find_on_disk(key.c_str(), key.size());
+    if(b)
+        this->add_loaded_array(b, key, hash);
+    return b;
+}
+
+void Bitbox::add_loaded_array(Bitarray * b, const std::string & key, uint64_t hash)
+{
+    this->cache_misses++;
+    this->add_array_to_hash(b, hash);
+
+    if(this->exporting && this->export_pending.erase(key))
+    {
+        SerializedBitarray ser(b);
+        this->export_captured.push_back(std::make_pair(key, std::string()));
+        Bitarray::freeze(ser, this->export_captured.back().second);
+    }
+}
+
+// brings a key that's only on disk into memory, reading it with the box
+// unlocked so that other requests carry on meanwhile.  requests for a key
+// that's already loading wait for that read instead.  it's usually still in
+// memory when the caller gets to it; if not, find_array() reads it again
+// with the box locked, as before.
+bool Bitbox::load_unlocked(std::unique_lock<std::mutex> & lock, const std::string & key)
+{
+    if(this->loading.count(key))
+    {
+        this->loads_waited++;
+        while(this->loading.count(key))
+            this->loaded.wait(lock);
+    }
+
+    uint64_t hash = KeyTable::hash_key(key.data(), key.size());
+    if(this->hash.find(key.data(), key.size(), hash) || this->tier.contains(key) || !this->key_index.contains(key))
+        return false;
+
+    this->loading.insert(key);
+    lock.unlock();
+    Bitarray * b = Bitarray::find_on_disk(key.c_str(), key.size());
+    lock.lock();
+    this->loading.erase(key);
+    this->loaded.notify_all();
+
+    // anything that would have made the key while we read waited for us,
+    // but it may have been deleted, or loaded by find_array() meanwhile.
+    if(b && this->key_index.contains(key) && !this->hash.find(key.data(), key.size(), hash) && !this->tier.contains(key))
+    {
+        this->add_loaded_array(b, key, hash);
+        return true;
+    }
+    delete b;
+    return false;
+}
+
+void Bitbox::prefetch(const std::vector<std::string> & keys)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->prefetch_queue.insert(this->prefetch_queue.end(), keys.begin(), keys.end());
+    while((int)this->prefetch_threads.size() < MAX(1, BITBOX_PREFETCH_THREADS / this->npartitions))
+        this->prefetch_threads.push_back(std::thread(&Bitbox::prefetch_loop, this));
+    this->prefetch_ready.notify_all();
+}
+
+void Bitbox::prefetch_loop()
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    while(!this->prefetch_stopping)
+    {
+        if(this->prefetch_queue.empty())
+        {
+            this->prefetch_ready.wait(lock);
+            continue;
+        }
+
+        if(this->over_limit(BITBOX_ITEM_LIMIT, BITBOX_MEMORY_LIMIT))
+        {
+            this->prefetch_skipped += this->prefetch_queue.size();
+            this->prefetch_queue.clear();
+            continue;
+        }
+
+        std::string key = this->prefetch_queue.front();
+        this->prefetch_queue.pop_front();
+        if(this->load_unlocked(lock, key))
+            this->prefetch_loaded++;
+    }
+}
+
+int64_t Bitbox::resident(const std::vector<std::string> & keys)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    int64_t n = 0;
+    for(size_t i = 0; i < keys.size(); i++)
+        if(this->hash.find(keys[i].data(), keys[i].size()) || this->tier.contains(keys[i]))
+            n++;
+    return n;
+}
+
+void Bitbox::describe(Bitarray * b, BitboxKeyInfo & info) const
+{
+    info.state = BITBOX_KEY_IN_MEMORY;
+    info.size = b->size;
+    info.offset = b->offset;
+    info.bits = b->bits;
+    info.memory_bytes = b->memory_size();
+    info.idle = this->clock - b->last_access;
+}
+
+// the file sizes are looked up with the box unlocked.
+void Bitbox::key_info(const std::string & key, BitboxKeyInfo & info)
+{
+    info.key = key;
+    info.size = info.offset = info.bits = info.idle = -1;
+    info.memory_bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        Bitarray * b = this->hash.find(key.data(), key.size());
+        if(b)
+            this->describe(b, info);
+        else if(this->tier.contains(key))
+        {
+            info.state = BITBOX_KEY_IN_TIER;
+            info.memory_bytes = this->tier.entry_bytes(key);
+        }
+        else
+            info.state = this->key_index.contains(key) ? BITBOX_KEY_ON_DISK : BITBOX_KEY_MISSING;
+    }
+    info.disk_bytes = Bitarray::disk_bytes(key.c_str());
+}
+
+void Bitbox::memory_top(size_t count, std::vector<BitboxKeyInfo> & top)
+{
+    size_t first = top.size();
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        std::vector<std::pair<Bitarray *, int64_t> > largest;
+        this->eviction->largest(count, largest);
+        for(size_t i = 0; i < largest.size(); i++)
+        {
+            BitboxKeyInfo info;
+            info.key.assign(largest[i].first->key, largest[i].first->keylen);
+            this->describe(largest[i].first, info);
+            top.push_back(info);
+        }
+    }
+    for(size_t i = first; i < top.size(); i++)
+        top[i].disk_bytes = Bitarray::disk_bytes(top[i].key.c_str());
+}
+
+Bitarray * Bitbox::find_array(const std::string & key)
+{
+    return this->find_array(key, KeyTable::hash_key(key.data(), key.size()));
+}
+
+Bitarray * Bitbox::find_or_create_array(const std::string & key)
+{
+    uint64_t hash = KeyTable::hash_key(key.data(), key.size());
+    Bitarray * b = this->find_array(key, hash);
+    if(!b)
+    {
+        b = new Bitarray(key.data(), key.size(), -1);
+        this->add_array_to_hash(b, hash);
+        this->key_index.insert(key);
     }
     return b;
 }
 
-void Bitbox::downsize_if_angry()
+void Bitbox::downsize_if_angry()
+{
+    // ok, that's it.  even if really busy, bring memory usage down below the
+    // "angry" limit before proceeding.  we'll never be very far past the
+    // limit, so the while loop isn't as scary as it might look.
+    while(this->over_limit(BITBOX_ITEM_PEAK_LIMIT, BITBOX_MEMORY_PEAK_LIMIT) && !this->hash.empty())
+        this->downsize_single_step(BITBOX_ITEM_PEAK_LIMIT, BITBOX_MEMORY_PEAK_LIMIT);
+}
+
+void Bitbox::mark_modified(Bitarray * b)
+{
+    assert(b);
+    this->touch(b);
+    this->eviction->resized(b, b->memory_size());
+    this->need_disk_write.insert(b);
+}
+
+void Bitbox::set_bit(const std::string & key, int64_t bit)
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+    Change change(this);
+    Bitarray * b = Bitbox::find_or_create_array(key);
+    b->set_bit(bit);
+    this->mark_modified(b);
+    if(this->listener)
+        this->listener->bits_set(key, &bit, 1);
+    this->downsize_if_angry();
+}
+
+bool Bitbox::key_ok(const std::string & key)
+{
+    return key.empty() || key[0] != '.';
+}
+
+bool Bitbox::field_ok(int64_t bit, int width, bool is_signed)
+{
+    return bit >= 0 && width >= 1 && width <= (is_signed ? 64 : 63);
+}
+
+// a field's bits as a number.
+static int64_t field_value(uint64_t raw, int width, bool is_signed)
+{
+    if(is_signed && width < 64 && (raw >> (width - 1)) & 1)
+        raw |= ~field_mask(width);
+    return (int64_t)raw;
+}
+
+// value, made to fit in a field of this width as overflow says.  returns
+// false if it doesn't fit and overflow is BITBOX_OVERFLOW_FAIL.  value is
+// wider than the field can be, so that a sum can't wrap before it gets here.
+static bool field_fit(__int128 value, int width, bool is_signed, BitboxOverflow overflow, int64_t * result)
+{
+    int64_t max = is_signed ? (int64_t)(field_mask(width) >> 1) : (int64_t)field_mask(width);
+    int64_t min = is_signed ? -max - 1 : 0;
+    if(value >= min && value <= max)
+    {
+        *result = (int64_t)value;
+        return true;
+    }
+
+    switch(overflow)
+    {
+        case BITBOX_OVERFLOW_WRAP:
+            *result = field_value((uint64_t)value & field_mask(width), width, is_signed);
+            return true;
+        case BITBOX_OVERFLOW_SAT:
+            *result = value > max ? max : min;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// runs one of the field operations in a batch, once its field is known to
+// be ok.
+void Bitbox::run_field_op(Bitarray * b, const std::string & key, BitboxOp * op)
+{
+    int64_t old = field_value(b->get_field(op->bit, op->width), op->width, op->is_signed);
+    int64_t value;
+    switch(op->type)
+    {
+        case BITBOX_OP_SET_FIELD:
+            if(!field_fit(op->value, op->width, op->is_signed, op->overflow, &value))
+            {
+                op->failed = true;
+                return;
+            }
+            op->result = old;
+            break;
+        case BITBOX_OP_INCR_FIELD:
+            if(!field_fit((__int128)old + op->value, op->width, op->is_signed, op->overflow, &value))
+            {
+                op->failed = true;
+                return;
+            }
+            op->result = value;
+            break;
+        default:
+            op->result = old;
+            return;
+    }
+
+    uint64_t raw = (uint64_t)value & field_mask(op->width);
+    if(b->set_field(op->bit, op->width, raw) != raw && this->listener)
+        this->listener->field_set(key, op->bit, op->width, raw);
+}
+
+int64_t Bitbox::get_field(const std::string & key, int64_t bit, int width, bool is_signed)
+{
+    if(!field_ok(bit, width, is_signed))
+        return 0;
+
+    uint64_t raw;
+    if(!this->read_unlocked(key, [&raw, bit, width](const BitarrayLayout & b) { raw = b.get_field(bit, width); }))
+    {
+        std::unique_lock<std::mutex> lock(this->mu);
+        this->load_unlocked(lock, key);
+        this->clock++;
+        Bitarray * b = this->find_array(key);
+
+        if(!b)
+            return 0;
+
+        this->touch(b);
+        raw = b->get_field(bit, width);
+    }
+    return field_value(raw, width, is_signed);
+}
+
+// the writes are batches of one, which already look after the locking,
+// the LRU and the listener.
+int64_t Bitbox::set_field(const std::string & key, int64_t bit, int width, bool is_signed, int64_t value)
+{
+    if(!field_ok(bit, width, is_signed))
+        return 0;
+
+    std::vector<BitboxOp> ops(1);
+    ops[0].type = BITBOX_OP_SET_FIELD;
+    ops[0].key = &key;
+    ops[0].bit = bit;
+    ops[0].width = width;
+    ops[0].is_signed = is_signed;
+    ops[0].value = value;
+    this->execute_batch(ops);
+    return ops[0].result;
+}
+
+bool Bitbox::incr_field(const std::string & key, int64_t bit, int width, bool is_signed, int64_t by, BitboxOverflow overflow, int64_t * result)
+{
+    if(!field_ok(bit, width, is_signed))
+    {
+        *result = 0;
+        return false;
+    }
+
+    std::vector<BitboxOp> ops(1);
+    ops[0].type = BITBOX_OP_INCR_FIELD;
+    ops[0].key = &key;
+    ops[0].bit = bit;
+    ops[0].width = width;
+    ops[0].is_signed = is_signed;
+    ops[0].value = by;
+    ops[0].overflow = overflow;
+    this->execute_batch(ops);
+    *result = ops[0].result;
+    return !ops[0].failed;
+}
+
+void Bitbox::set_range(const std::string & key, int64_t start_bit, int64_t end_bit)
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+    Change change(this);
+    Bitarray * b = this->find_or_create_array(key);
+    b->set_range(start_bit, end_bit);
+    this->mark_modified(b);
+    if(this->listener)
+        this->listener->range_set(key, start_bit, end_bit);
+    this->downsize_if_angry();
+}
+
+bool Bitbox::or_bitmap(const std::string & key, int64_t start_bit, const uint8_t * bitmap, int64_t nbytes)
+{
+    // the bitmap's last bit, start_bit + nbytes*8 - 1, has to fit.
+    if(start_bit < 0 || nbytes < 0 || nbytes > (INT64_MAX - start_bit) / 8)
+        return false;
+
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+    Change change(this);
+    Bitarray * b = this->find_or_create_array(key);
+    b->or_bits(start_bit, bitmap, nbytes);
+    this->mark_modified(b);
+    if(this->listener)
+        this->listener->bitmap_ored(key, start_bit, bitmap, nbytes);
+    this->downsize_if_angry();
+    return true;
+}
+
+int Bitbox::get_bit(const std::string & key, int64_t bit)
+{
+    int value;
+    if(this->read_unlocked(key, [&value, bit](const BitarrayLayout & b) { value = b.get_bit(bit); }))
+        return value;
+
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+    Bitarray * b = this->find_array(key);
+
+    if(!b)
+        return 0;
+
+    this->touch(b);
+    return b->get_bit(bit);
+}
+
+int Bitbox::change_bit(const std::string & key, int64_t bit, int value)
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+
+    Bitarray * b = value ? this->find_or_create_array(key) : this->find_array(key);
+    if(!b)
+        return 0;
+
+    int old_value = b->get_bit(bit);
+    if(old_value == value)
+    {
+        this->touch(b);
+        return old_value;
+    }
+
+    Change change(this);
+    if(value)
+        b->set_bit(bit);
+    else
+        b->clear_bit(bit);
+    this->mark_modified(b);
+    if(this->listener && value)
+        this->listener->bits_set(key, &bit, 1);
+    else if(this->listener)
+        this->listener->bit_cleared(key, bit);
+    this->downsize_if_angry();
+    return old_value;
+}
+
+int64_t Bitbox::count_bits(const std::string & key, int64_t start_bit, int64_t end_bit)
+{
+    int64_t count;
+    if(this->read_unlocked(key, [&count, start_bit, end_bit](const BitarrayLayout & b) { count = b.count_range(start_bit, end_bit); }))
+        return count;
+
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+
+    Bitarray * b = this->find_array(key);
+    if(!b)
+        return 0;
+
+    this->touch(b);
+    return b->count_range(start_bit, end_bit);
+}
+
+int64_t Bitbox::find_bit(const std::string & key, int value, int64_t start_bit, int64_t end_bit)
+{
+    int64_t found;
+    if(this->read_unlocked(key, [&found, value, start_bit, end_bit](const BitarrayLayout & b) { found = b.find_bit(value, start_bit, end_bit); }))
+        return found;
+
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+
+    Bitarray * b = this->find_array(key);
+    if(!b)
+        return value || start_bit >= end_bit ? -1 : start_bit;
+
+    this->touch(b);
+    return b->find_bit(value, start_bit, end_bit);
+}
+
+int64_t Bitbox::byte_length(const std::string & key)
 {
-    // ok, that's it.  even if really busy, bring memory usage down below the
-    // "angry" limit before proceeding.  we'll never be very far past the
-    // limit, so the while loop isn't as scary as it might look.
-    while(this->hash.size() >= BITBOX_ITEM_PEAK_LIMIT && this->lru.size())
-        this->downsize_single_step(BITBOX_ITEM_PEAK_LIMIT);
+    int64_t first_byte, nbytes;
+    if(this->read_unlocked(key, [&first_byte, &nbytes](const BitarrayLayout & b) { b.used_range(&first_byte, &nbytes); }))
+        return nbytes ? first_byte + nbytes : 0;
+
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+
+    Bitarray * b = this->find_array(key);
+    if(!b)
+        return 0;
+
+    b->used_range(&first_byte, &nbytes);
+    this->touch(b);
+    return nbytes ? first_byte + nbytes : 0;
 }
 
-void Bitbox::set_bit_nolookup(Bitarray * b, int64_t bit)
+void Bitbox::get_range(const std::string & key, int64_t start_bit, int64_t end_bit, uint8_t * range)
 {
-    assert(b);
-    int64_t old_timestamp = b->last_access;
+    int64_t nbits;
+    for(int64_t bit = start_bit; bit < end_bit; bit += nbits)
+    {
+        nbits = MIN(end_bit - bit, (int64_t)BITBOX_RANGE_CHUNK_BYTES * 8);
+        uint8_t * dest = range + (bit - start_bit) / 8;
+        if(this->read_unlocked(key, [dest, bit, nbits](const BitarrayLayout & b) { b.copy_bits(dest, bit, nbits); }))
+            continue;
 
-    b->set_bit(bit);
+        std::unique_lock<std::mutex> lock(this->mu);
+        this->load_unlocked(lock, key);
+        this->clock++;
 
-    this->update_key_in_lru(b->key, old_timestamp, b->last_access);
+        Bitarray * b = this->find_array(key);
+        if(!b)
+        {
+            memset(dest, 0, (nbits + 7) / 8);
+            continue;
+        }
+        b->copy_bits(dest, bit, nbits);
+        this->touch(b);
+    }
+}
 
-    this->need_disk_write.insert(b);
+int64_t Bitbox::bitop(BitboxBitop op, const std::string & dest, const std::vector<std::string> & sources)
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    for(size_t i = 0; i < sources.size(); i++)
+        this->load_unlocked(lock, sources[i]);
+    this->clock++;
+
+    // nothing gets evicted until downsize_if_angry() at the end, so these
+    // pointers stay good while we work.
+    std::vector<Bitarray *> arrays;
+    int64_t begin = INT64_MAX, end = 0;
+    bool missing = false;
+
+    for(size_t i = 0; i < sources.size(); i++)
+    {
+        Bitarray * b = this->find_array(sources[i]);
+        int64_t first_byte = 0, nbytes = 0;
+        if(b)
+        {
+            this->touch(b);
+            b->used_range(&first_byte, &nbytes);
+        }
+        if(!nbytes)
+        {
+            missing = true;
+            continue;
+        }
+        arrays.push_back(b);
+        begin = MIN(begin, first_byte);
+        end = MAX(end, first_byte + nbytes);
+    }
+
+    // NOT flips the zeroes in front of the array's offset too.
+    if(op == BITBOX_BITOP_NOT)
+        begin = 0;
+
+    Bitarray result(dest.data(), dest.size(), -1);
+
+    if(!(op == BITBOX_BITOP_AND && missing) && !(op == BITBOX_BITOP_NOT && arrays.empty()))
+    {
+        uint8_t * acc = (uint8_t *)malloc(BITOP_CHUNK_SIZE);
+        uint8_t * tmp = (uint8_t *)malloc(BITOP_CHUNK_SIZE);
+        assert(acc && tmp);
+
+        for(int64_t pos = begin; pos < end; pos += BITOP_CHUNK_SIZE)
+        {
+            int64_t n = MIN(BITOP_CHUNK_SIZE, end - pos);
+            arrays[0]->copy_out(acc, pos, n);
+            if(op == BITBOX_BITOP_NOT)
+                for(int64_t j = 0; j < n; j++)
+                    acc[j] = ~acc[j];
+
+            for(size_t i = 1; i < arrays.size() && op != BITBOX_BITOP_NOT; i++)
+            {
+                arrays[i]->copy_out(tmp, pos, n);
+                for(int64_t j = 0; j < n; j++)
+                {
+                    if(op == BITBOX_BITOP_AND)      acc[j] &= tmp[j];
+                    else if(op == BITBOX_BITOP_OR)  acc[j] |= tmp[j];
+                    else                            acc[j] ^= tmp[j];
+                }
+            }
+
+            if(!all_zero(acc, n))
+                result.or_bytes(pos, acc, n);
+        }
+
+        free(acc);
+        free(tmp);
+    }
+
+    Change change(this);
+    Bitarray * b = this->find_or_create_array(dest);
+    b->take_data(&result);
+    this->mark_modified(b);
+    if(this->listener)
+        this->listener->array_replaced(dest, b);
+    this->downsize_if_angry();
+
+    return end;
 }
 
-void Bitbox::set_bit(const char * key, int64_t bit)
+static bool batch_key_less(const BitboxOp * a, const BitboxOp * b)
 {
-    Bitarray * b = Bitbox::find_or_create_array(key);
-    this->set_bit_nolookup(b, bit);
+    return *a->key < *b->key;
+}
+
+// an operation that fails without touching the key: one on a key that isn't
+// ok, a write to a negative bit, or a field operation whose field isn't ok.
+// reads of negative bits are fine, and find nothing.
+static bool bad_op(const BitboxOp * op)
+{
+    if(!Bitbox::key_ok(*op->key))
+        return true;
+
+    switch(op->type)
+    {
+        case BITBOX_OP_SET_BIT:
+        case BITBOX_OP_SET_RANGE:
+            return op->bit < 0;
+        case BITBOX_OP_SET_BITS:
+            return !op->bits->empty() && *op->bits->begin() < 0;
+        case BITBOX_OP_GET_FIELD:
+        case BITBOX_OP_SET_FIELD:
+        case BITBOX_OP_INCR_FIELD:
+            return !Bitbox::field_ok(op->bit, op->width, op->is_signed);
+        default:
+            return false;
+    }
+}
+
+// runs a list of operations on any number of keys.  they're grouped by key,
+// so each array is looked up, moved in the LRU and marked dirty once no
+// matter how many operations touch it.  operations on the same key still
+// run in the order given.
+void Bitbox::execute_batch(std::vector<BitboxOp> & ops)
+{
+    std::vector<BitboxOp *> sorted;
+    sorted.reserve(ops.size());
+    for(size_t i = 0; i < ops.size(); i++)
+        sorted.push_back(&ops[i]);
+    std::stable_sort(sorted.begin(), sorted.end(), batch_key_less);
+
+    // every key is brought in before anything runs, so the batch still runs
+    // all at once.
+    std::unique_lock<std::mutex> lock(this->mu);
+    for(size_t i = 0; i < sorted.size(); i++)
+        if(i == 0 || *sorted[i]->key != *sorted[i - 1]->key)
+            this->load_unlocked(lock, *sorted[i]->key);
+    this->clock++;
+
+    for(size_t begin = 0, end; begin < sorted.size(); begin = end)
+    {
+        const std::string & key = *sorted[begin]->key;
+        bool writes = false;
+        for(end = begin; end < sorted.size() && *sorted[end]->key == key; end++)
+            if(bitbox_op_writes(sorted[end]->type) && !bad_op(sorted[end]))
+                writes = true;
+
+        // a key that isn't ok names one of the box's own files, so it isn't
+        // looked up at all.
+        Change change(this);
+        Bitarray * b = NULL;
+        if(writes)
+            b = this->find_or_create_array(key);
+        else if(Bitbox::key_ok(key))
+            b = this->find_array(key);
+
+        for(size_t i = begin; i < end; i++)
+        {
+            BitboxOp * op = sorted[i];
+            op->result = 0;
+            op->failed = bad_op(op);
+            if(!b || op->failed)
+                continue;
+
+            switch(op->type)
+            {
+                case BITBOX_OP_GET_BIT:
+                    op->result = b->get_bit(op->bit);
+                    break;
+                case BITBOX_OP_SET_BIT:
+                    b->set_bit(op->bit);
+                    if(this->listener)
+                        this->listener->bits_set(key, &op->bit, 1);
+                    break;
+                case BITBOX_OP_SET_BITS:
+                    for(std::set<int64_t>::const_iterator it = op->bits->begin(); it != op->bits->end(); ++it)
+                        b->set_bit(*it);
+                    if(this->listener)
+                    {
+                        std::vector<int64_t> bits(op->bits->begin(), op->bits->end());
+                        this->listener->bits_set(key, bits.data(), bits.size());
+                    }
+                    break;
+                case BITBOX_OP_SET_RANGE:
+                    b->set_range(op->bit, op->end_bit);
+                    if(this->listener)
+                        this->listener->range_set(key, op->bit, op->end_bit);
+                    break;
+                case BITBOX_OP_COUNT_RANGE:
+                    op->result = b->count_range(op->bit, op->end_bit);
+                    break;
+                case BITBOX_OP_GET_FIELD:
+                case BITBOX_OP_SET_FIELD:
+                case BITBOX_OP_INCR_FIELD:
+                    this->run_field_op(b, key, op);
+                    break;
+            }
+        }
+
+        if(b && writes)
+            this->mark_modified(b);
+        else if(b)
+            this->touch(b);
+    }
+
+    this->downsize_if_angry();
+}
+
+void Bitbox::replace(const std::string & key, Bitarray * data)
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+    Change change(this);
+    Bitarray * b = this->find_or_create_array(key);
+    b->take_data(data);
+    this->mark_modified(b);
+    if(this->listener)
+        this->listener->array_replaced(key, b);
     this->downsize_if_angry();
 }
 
-int Bitbox::get_bit(const char * key, int64_t bit)
+bool Bitbox::dump(const std::string & key, std::string & frozen)
 {
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+
     Bitarray * b = this->find_array(key);
+    if(!b)
+        return false;
+
+    this->touch(b);
+    SerializedBitarray ser(b);
+    Bitarray::freeze(ser, frozen);
+    return true;
+}
+
+bool Bitbox::dump_from_disk(const std::string & key, std::string & frozen)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    return Bitarray::read_frozen(key.c_str(), frozen);
+}
+
+void Bitbox::merge(const std::string & key, Bitarray * data)
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->load_unlocked(lock, key);
+    this->clock++;
+    Change change(this);
+    Bitarray * b = this->find_or_create_array(key);
+    b->or_array(data);
+    this->mark_modified(b);
+    if(this->listener)
+        this->listener->array_replaced(key, b);
+    this->downsize_if_angry();
+}
+
+bool Bitbox::key_exists(const std::string & key)
+{
+    return this->key_index.contains(key);
+}
+
+// takes a key out of memory, the LRU, the dirty set, the expiries and the
+// disk.
+bool Bitbox::remove_key(const std::string & key)
+{
+    bool found = this->key_index.erase(key);
+    Bitarray * b;
+    {
+        Change change(this);
+        b = this->hash.erase(key.data(), key.size());
+    }
+    this->tier.remove(key);
+    if(b)
+    {
+        this->eviction->removed(b);
+        this->need_disk_write.erase(b);
+        Bitbox::retire(b);
+    }
+
+    if(this->exporting && this->export_pending.erase(key))
+    {
+        std::string frozen;
+        if(Bitarray::read_frozen(key.c_str(), frozen))
+            this->export_captured.push_back(std::make_pair(key, frozen));
+    }
+    Bitarray::delete_from_disk(key.c_str());
+    this->flushing.erase(key);
+
+    if(this->expiries.erase(key))
+        this->log_expiry(key, 0);
+
+    if(found && this->listener)
+        this->listener->key_deleted(key);
+    return found;
+}
+
+bool Bitbox::delete_key(const std::string & key)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->clock++;
+    return this->remove_key(key);
+}
+
+bool Bitbox::expire(const std::string & key, int64_t seconds)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->clock++;
+
+    if(!this->key_exists(key))
+        return false;
+
+    if(seconds <= 0)
+    {
+        this->remove_key(key);
+        return true;
+    }
+
+    int64_t when = time(NULL) + seconds;
+    this->expiries[key] = when;
+    this->expiry_wheel.add(key, when);
+    this->log_expiry(key, when);
+    return true;
+}
+
+int64_t Bitbox::ttl(const std::string & key)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->clock++;
+
+    if(!this->key_exists(key))
+        return -2;
+
+    Bitbox::expiry_map_t::iterator it = this->expiries.find(key);
+    if(it == this->expiries.end())
+        return -1;
+    return MAX(0, it->second - time(NULL));
+}
+
+int64_t Bitbox::expire_keys()
+{
+    std::vector<std::pair<std::string, int64_t> > due;
+    int64_t now = time(NULL);
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->expiry_wheel.advance(now, due);
+    }
+
+    int64_t expired = 0;
+    for(size_t begin = 0; begin < due.size(); begin += BITBOX_DELETE_BATCH)
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        for(size_t i = begin; i < due.size() && i < begin + BITBOX_DELETE_BATCH; i++)
+        {
+            // the wheel can't forget a timer, so check that the key hasn't
+            // been given a new time, or stopped expiring, since.
+            Bitbox::expiry_map_t::iterator it = this->expiries.find(due[i].first);
+            if(it == this->expiries.end() || it->second > now)
+                continue;
+            this->remove_key(due[i].first);
+            this->keys_expired++;
+            expired++;
+        }
+    }
+    return expired;
+}
+
+// a batch at a time, so other requests get a turn.
+int64_t Bitbox::delete_prefix(const std::string & prefix)
+{
+    int64_t deleted = 0;
+    std::string after;
+    for(;;)
+    {
+        std::vector<std::string> batch;
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->key_index.scan(prefix, after, BITBOX_DELETE_BATCH, batch);
+        if(batch.empty())
+            break;
+
+        this->clock++;
+        for(size_t i = 0; i < batch.size(); i++)
+            deleted += this->remove_key(batch[i]);
+        after = batch.back();
+    }
+    return deleted;
+}
+
+void Bitbox::scan_keys(const std::string & prefix, const std::string & after, size_t count, std::vector<std::string> & keys)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->key_index.scan(prefix, after, count, keys);
+}
+
+void Bitbox::clear()
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+
+    {
+        Change change(this);
+        Bitbox::hash_t::iterator it = this->hash.begin();
+        for(; it != this->hash.end(); ++it)
+        {
+            Bitbox::retire(*it);
+            this->hash.erase_at(it);
+        }
+    }
+
+    this->eviction->clear();
+    this->tier.clear();
+    this->key_index.clear();
+    this->need_disk_write.clear();
+    this->flushing.clear();
+    if(this->exporting)
+    {
+        this->export_spoiled = true;
+        this->export_pending.clear();
+        this->export_captured.clear();
+    }
+
+    this->expiries.clear();
+    this->expiry_wheel.clear();
+    if(this->expiry_log)
+        fclose(this->expiry_log);
+    this->expiry_log = fopen(this->expiry_path.c_str(), "wb");
+
+    std::vector<std::string> keys;
+    Bitarray::list_on_disk(keys);
+    for(size_t i = 0; i < keys.size(); i++)
+        if(this->owns(keys[i]))
+            Bitarray::delete_from_disk(keys[i].c_str());
+}
 
+// the arrays are only copied out with the box locked, as a flush copies
+// them, and compressed once it's unlocked again.
+void Bitbox::snapshot(std::vector<std::pair<std::string, std::string> > & frozen, const std::function<void()> & at_snapshot)
+{
+    size_t first = frozen.size(), narrays;
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+
+        frozen.reserve(frozen.size() + this->hash.size() + this->tier.size());
+        for(Bitbox::hash_t::iterator it = this->hash.begin(); it != this->hash.end(); ++it)
+        {
+            Bitarray * b = *it;
+            frozen.push_back(std::make_pair(std::string(b->key, b->keylen), std::string()));
+            b->flatten(frozen.back().second);
+        }
+        narrays = frozen.size() - first;
+        this->tier.copy_all(frozen);
+
+        at_snapshot();
+    }
+
+    std::string flat;
+    for(size_t i = first; i < first + narrays; i++)
+    {
+        flat.swap(frozen[i].second);
+        Bitarray::freeze_flat(flat, frozen[i].second);
+    }
+}
+
+// one key into an export, from its Bitarray::freeze() form.
+static void export_frozen(ExportWriter & writer, const std::string & key, const std::string & frozen)
+{
+    Bitarray * b = Bitarray::thaw(key.data(), key.size(), (const uint8_t *)frozen.data(), frozen.size());
     if(!b)
-        return 0;
+        return;
+
+    int64_t first_byte, nbytes;
+    b->used_range(&first_byte, &nbytes);
+    writer.add_key(key, first_byte, nbytes);
 
-    int64_t old_timestamp = b->last_access;
-    int retval = b->get_bit(bit);
+    uint8_t * chunk = (uint8_t *)malloc(EXPORT_CHUNK_SIZE);
+    assert(chunk);
+    for(int64_t pos = first_byte; pos < first_byte + nbytes; pos += EXPORT_CHUNK_SIZE)
+    {
+        int64_t n = MIN(EXPORT_CHUNK_SIZE, first_byte + nbytes - pos);
+        b->copy_out(chunk, pos, n);
+        if(!all_zero(chunk, n))
+            writer.add_chunk(pos, chunk, n);
+    }
+    free(chunk);
+    delete b;
+}
+
+// the arrays in memory are frozen all at once, as for a replica, and the
+// keys only on disk are read one at a time after that, with the box locked
+// for each so that nothing can change one halfway through.
+bool Bitbox::export_to_file(const std::string & filename, const std::function<void(bool)> & started)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        if(this->exporting)
+        {
+            if(started)
+                started(false);
+            return false;
+        }
+        this->exporting = true;
+        this->export_spoiled = false;
+        this->export_keys = 0;
+    }
+
+    ExportWriter writer;
+    bool ok = writer.open(filename);
+    if(started && !ok)
+        started(false);
+    if(ok)
+    {
+        std::vector<std::pair<std::string, std::string> > frozen;
+        this->snapshot(frozen, [this, &frozen]() {
+            std::vector<std::string> keys;
+            this->key_index.scan("", "", this->key_index.size(), keys);
+            this->export_pending.insert(keys.begin(), keys.end());
+            for(size_t i = 0; i < frozen.size(); i++)
+                this->export_pending.erase(frozen[i].first);
+        });
+        if(started)
+            started(true);
+
+        for(size_t i = 0; i < frozen.size(); i++)
+        {
+            export_frozen(writer, frozen[i].first, frozen[i].second);
+            std::string().swap(frozen[i].second);
+        }
+        std::vector<std::pair<std::string, std::string> >().swap(frozen);
+
+        bool more = true;
+        while(more)
+        {
+            std::vector<std::pair<std::string, std::string> > batch;
+            {
+                std::lock_guard<std::mutex> lock(this->mu);
+                this->export_keys = writer.key_count();
+                batch.swap(this->export_captured);
+                if(!this->export_pending.empty())
+                {
+                    std::string key = *this->export_pending.begin();
+                    this->export_pending.erase(this->export_pending.begin());
+                    batch.push_back(std::make_pair(key, std::string()));
+                    if(!Bitarray::read_frozen(key.c_str(), batch.back().second))
+                        batch.pop_back();
+                }
+                more = !this->export_pending.empty();
+            }
+
+            for(size_t i = 0; i < batch.size(); i++)
+                export_frozen(writer, batch[i].first, batch[i].second);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(this->mu);
+    ok = ok && !this->export_spoiled && writer.close();
+    this->export_keys = writer.key_count();
+    this->exporting = false;
+    this->export_pending.clear();
+    this->export_captured.clear();
+    return ok;
+}
+
+bool Bitbox::set_eviction_policy(const std::string & name)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+
+    EvictionPolicy * policy = EvictionPolicy::create(name);
+    if(!policy)
+        return false;
+
+    for(Bitbox::hash_t::iterator it = this->hash.begin(); it != this->hash.end(); ++it)
+        policy->added(*it, (*it)->memory_size());
+    delete this->eviction;
+    this->eviction = policy;
+    return true;
+}
 
-    this->update_key_in_lru(key, old_timestamp, b->last_access);
+void Bitbox::set_listener(BitboxListener * listener)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->listener = listener;
+}
 
-    return retval;
+void Bitbox::get_stats(std::map<std::string, int64_t> & stats)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    stats["keys"] = this->key_index.size();
+    stats["keys_in_memory"] = this->hash.size();
+    stats["keys_dirty"] = this->need_disk_write.size();
+    stats["keys_with_ttl"] = this->expiries.size();
+    stats["keys_expired"] = this->keys_expired;
+    stats["cache_hits"] = this->cache_hits;
+    stats["cache_tier_hits"] = this->cache_tier_hits;
+    stats["cache_misses"] = this->cache_misses;
+    stats["cache_evictions"] = this->cache_evictions;
+    stats["cache_loads_waited"] = this->loads_waited;
+    stats["prefetch_queued"] = this->prefetch_queue.size();
+    stats["prefetch_loaded"] = this->prefetch_loaded;
+    stats["prefetch_skipped"] = this->prefetch_skipped;
+    stats["memory_bytes"] = this->eviction->memory_bytes();
+    stats["tier_keys"] = this->tier.size();
+    stats["tier_keys_dirty"] = this->tier.dirty_count();
+    stats["tier_bytes"] = this->tier.memory_bytes();
+    stats["key_index_bytes"] = this->key_index.memory_size();
+    huge_stats(stats);
+    stats["flush_batches"] = this->flush_batches;
+    stats["flush_arrays"] = this->flush_arrays;
+    stats["flush_bytes"] = this->flush_bytes;
+    stats["export_running"] = this->exporting;
+    stats["export_keys"] = this->export_keys;
+    stats[std::string("eviction_policy_") + this->eviction->name()] = 1;
 }
 
-void Bitbox::banish_oldest_item_to_disk()
+// one of several partitions gets its share of each limit.
+bool Bitbox::over_limit(size_t item_limit, int64_t memory_limit) const
 {
-    assert(this->hash.size() == this->lru.size());
-    Bitbox::lru_map_t::iterator it = this->lru.begin();
+    size_t n = this->npartitions;
+    return this->hash.size() >= (item_limit + n - 1) / n ||
+        (memory_limit && this->eviction->memory_bytes() > memory_limit / (int64_t)n);
+}
 
-    if(it == this->lru.end())
+void Bitbox::evict_one()
+{
+    assert(this->hash.size() == this->eviction->size());
+    Bitarray * b = this->eviction->victim();
+    if(!b)
         return;
 
-    char * key = it->second;
-    this->lru.erase(it);
+    this->eviction->removed(b);
+    {
+        Change change(this);
+        this->hash.erase(b->key, b->keylen);
+    }
+    this->cache_evictions++;
+
+    // an array that hasn't changed since it was loaded or saved is already
+    // on disk, unless a flush has yet to write it.  one that's saved a page
+    // at a time might as well be saved now, while that's cheap.
+    std::string key(b->key, b->keylen);
+    bool dirty = this->need_disk_write.erase(b);
+    if(this->flushing.erase(key))
+        dirty = true;
+    if(dirty && b->disk)
+    {
+        b->save_to_disk();
+        dirty = false;
+    }
 
-    Bitarray * b = this->find_array_in_memory(key);
-    assert(b);
-    b->save_to_disk();
-    this->hash.erase(key);
-    this->need_disk_write.erase(b);
+    if(BITBOX_COMPRESSED_LIMIT > 0)
+    {
+        std::string frozen;
+        {
+            SerializedBitarray ser(b);
+            Bitarray::freeze(ser, frozen);
+        }
+        if(!this->tier.put(key, frozen, dirty) && dirty)
+            Bitarray::save_frozen(b->key, frozen);
+        this->age_out_of_tier();
+    }
+    else if(dirty)
+        b->save_to_disk();
 
-    delete b;
-    free(key);
+    Bitbox::retire(b);
+}
+
+void Bitbox::age_out_of_tier()
+{
+    std::string key, frozen;
+    bool dirty;
+    while(this->tier.pop_overflow(key, frozen, &dirty))
+        if(this->flushing.erase(key) || dirty)
+            Bitarray::save_frozen(key.c_str(), frozen);
+}
+
+void Bitbox::downsize_single_step(size_t item_limit, int64_t memory_limit)
+{
+    if(this->over_limit(item_limit, memory_limit))
+        this->evict_one();
+}
+
+size_t Bitbox::arrays_to_write()
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    return this->need_disk_write.size() + this->tier.dirty_count();
 }
 
-void Bitbox::downsize_single_step(int64_t item_limit)
+static void compress_flush_job(BitboxFlushJob * job)
 {
-    //DEBUG("************ box too big? %d\n", g_hash_table_size(box->hash) >= item_limit);
-    //DEBUG("************ lru size? %d\n", box->lru.size());
-    //DEBUG("************ hash size? %d\n", g_hash_table_size(box->hash));
-    if(this->hash.size() >= (Bitbox::hash_t::size_type)item_limit)
-        this->banish_oldest_item_to_disk();
+    Bitarray::freeze_flat(job->flat, job->frozen);
+    std::string().swap(job->flat);
+    if(job->paged)
+        job->base_hash = hash_contents((const uint8_t *)job->frozen.data(), job->frozen.size());
 }
 
-void Bitbox::write_one_to_disk()
+// one trip through the flush pipeline: copy out a batch of dirty arrays and
+// dirty tier entries, compress the arrays and write them under data/.flush
+// on the pool with the box unlocked, then lock it again just long enough to
+// move the files into place.  call with flush_mu held.
+int64_t Bitbox::flush_batch(size_t max_arrays, int64_t * bytes_written)
 {
-    Bitbox::need_disk_write_set_t::iterator it = this->need_disk_write.begin();
-    if(it != this->need_disk_write.end())
+    std::vector<BitboxFlushJob> jobs;
+    int64_t written = 0, bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+
+        std::vector<Bitarray *> batch;
+        int64_t flat_bytes = 0;
+        Bitbox::need_disk_write_set_t::iterator it = this->need_disk_write.begin();
+        for(; it != this->need_disk_write.end() && batch.size() < max_arrays && flat_bytes < BITBOX_FLUSH_BATCH_BYTES; ++it)
+        {
+            int64_t first_byte, nbytes;
+            (*it)->used_range(&first_byte, &nbytes);
+            batch.push_back(*it);
+            flat_bytes += nbytes;
+        }
+
+        for(size_t i = 0; i < batch.size(); i++)
+        {
+            Bitarray * b = batch[i];
+            this->need_disk_write.erase(b);
+
+            // saving a page at a time is cheap enough to do right here.
+            if(b->disk)
+            {
+                b->save_to_disk();
+                written++;
+                continue;
+            }
+
+            jobs.push_back(BitboxFlushJob());
+            BitboxFlushJob & job = jobs.back();
+            job.key.assign(b->key, b->keylen);
+            b->flatten(job.flat);
+            job.paged = b->is_paged();
+            this->flushing.insert(job.key);
+        }
+
+        std::string key, frozen;
+        while(jobs.size() < max_arrays && this->tier.clean_one(key, frozen))
+        {
+            jobs.push_back(BitboxFlushJob());
+            jobs.back().key = key;
+            jobs.back().frozen.swap(frozen);
+            jobs.back().paged = false;
+            this->flushing.insert(key);
+        }
+    }
+
+    if(!jobs.empty() && !this->flush_pool)
+    {
+        int threads = BITBOX_FLUSH_THREADS ? BITBOX_FLUSH_THREADS : (int)std::thread::hardware_concurrency();
+        this->flush_pool = new WorkerPool(MAX(1, threads / this->npartitions));
+    }
+
+    std::vector<std::function<void()> > tasks;
+    for(size_t i = 0; i < jobs.size(); i++)
+        if(!jobs[i].flat.empty())
+            tasks.push_back(std::bind(compress_flush_job, &jobs[i]));
+    if(!tasks.empty())
+        this->flush_pool->run(tasks);
+
+    // anything that saves or deletes a key while it's being written takes it
+    // out of flushing, so a key is only checked for here, and the file only
+    // goes into place if it's still there once the box is locked again.
+    tasks.clear();
     {
-        (*it)->save_to_disk();
-        this->need_disk_write.erase(it);
-        DEBUG("wrote one to disk. %lu left\n", this->need_disk_write.size());
+        std::lock_guard<std::mutex> lock(this->mu);
+        for(size_t i = 0; i < jobs.size(); i++)
+        {
+            jobs[i].staged = false;
+            if(this->flushing.count(jobs[i].key))
+                tasks.push_back(std::bind(Bitarray::stage_frozen, jobs[i].key.c_str(), std::cref(jobs[i].frozen), &jobs[i].staged));
+        }
+    }
+    if(!tasks.empty())
+        this->flush_pool->run(tasks);
+
+    std::lock_guard<std::mutex> lock(this->mu);
+    for(size_t i = 0; i < jobs.size(); i++)
+    {
+        BitboxFlushJob & job = jobs[i];
+        if(!this->flushing.erase(job.key) || !job.staged)
+        {
+            // saved or deleted while it was being written, or the write
+            // failed.
+            if(job.staged)
+                Bitarray::discard_staged(job.key.c_str());
+            continue;
+        }
+
+        Bitarray::commit_staged(job.key.c_str());
+        written++;
+        bytes += job.frozen.size();
+
+        Bitarray * b = this->hash.find(job.key.data(), job.key.size());
+        if(job.paged && b && b->is_paged() && !this->need_disk_write.count(b))
+            b->saved_in_full(job.base_hash, job.frozen.size());
     }
+    if(!written)
+        return 0;
+
+    this->flush_batches++;
+    this->flush_arrays += written;
+    this->flush_bytes += bytes;
+    if(bytes_written)
+        *bytes_written += bytes;
+    DEBUG("flushed %" PRId64 " to disk. %lu left\n", written, this->need_disk_write.size() + this->tier.dirty_count());
+    return written;
+}
+
+int64_t Bitbox::flush(size_t max_arrays)
+{
+    std::unique_lock<std::mutex> turn(this->flush_mu, std::try_to_lock);
+    if(!turn.owns_lock())
+        return 0;
+    return this->flush_batch(max_arrays, NULL);
 }
 
 bool Bitbox::run_maintenance_step()
 {
-    this->downsize_single_step(BITBOX_ITEM_LIMIT);
-    this->write_one_to_disk();
-    return this->hash.size() >= BITBOX_ITEM_LIMIT || !this->need_disk_write.empty();
+    epoch_reclaim();
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->downsize_single_step(BITBOX_ITEM_LIMIT, BITBOX_MEMORY_LIMIT);
+    }
+    this->flush(BITBOX_FLUSH_MAINTENANCE_BATCH);
+
+    std::lock_guard<std::mutex> lock(this->mu);
+    return this->over_limit(BITBOX_ITEM_LIMIT, BITBOX_MEMORY_LIMIT) ||
+        !this->need_disk_write.empty() || this->tier.dirty_count();
+}
+
+static double seconds_since(const struct timeval & start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
 }
 
-void Bitbox::shutdown()
+bool Bitbox::shutdown(int64_t seconds, const flush_progress_t & progress)
 {
-    while(!this->need_disk_write.empty())
-        this->write_one_to_disk();
+    std::lock_guard<std::mutex> turn(this->flush_mu);
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    BitboxFlushProgress p;
+    memset(&p, 0, sizeof(p));
+    p.arrays_left = this->arrays_to_write();
+    while(p.arrays_left)
+    {
+        if(seconds > 0 && seconds_since(start) >= seconds)
+            return false;
+
+        p.arrays_written += this->flush_batch(BITBOX_FLUSH_BATCH, &p.bytes_written);
+        p.arrays_left = this->arrays_to_write();
+        p.seconds = seconds_since(start);
+        if(progress)
+            progress(p);
+    }
+    return true;
 }
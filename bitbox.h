@@ -6,15 +6,111 @@
 #include <inttypes.h>
 #include <sys/time.h>
 #include <string.h>
+#include <stdio.h>
 #include <glib.h>
-#include <google/sparse_hash_map>
 #include <google/sparse_hash_set>
 #include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "compressedtier.h"
+#include "epoch.h"
+#include "eviction.h"
+#include "exportfile.h"
+#include "keytable.h"
+#include "keyindex.h"
+#include "timerwheel.h"
+#include "workerpool.h"
 
 #define BITBOX_ITEM_LIMIT       1500
 #define BITBOX_ITEM_PEAK_LIMIT  2000
 
+// arrays are also written out of memory while they take up more than this
+// many bytes in all, and requests wait while they take up more than the peak.
+// 0 for no limit.
+#ifndef BITBOX_MEMORY_LIMIT
+#define BITBOX_MEMORY_LIMIT       0
+#endif
+#define BITBOX_MEMORY_PEAK_LIMIT  (BITBOX_MEMORY_LIMIT / 3 * 4)
+
+// bytes of compressed arrays kept in a CompressedTier after they're evicted,
+// before they go to disk.  0 to send them straight to disk.
+#ifndef BITBOX_COMPRESSED_LIMIT
+#define BITBOX_COMPRESSED_LIMIT   (64*1024*1024)
+#endif
+
+// dirty arrays are written to disk in batches: copied out with the box
+// locked, compressed on BITBOX_FLUSH_THREADS threads (0 for one per core)
+// with it unlocked, then written together.  a batch stops at
+// BITBOX_FLUSH_BATCH arrays or BITBOX_FLUSH_BATCH_BYTES bytes of copies.
+// maintenance writes BITBOX_FLUSH_MAINTENANCE_BATCH at a time, between
+// requests.
+#ifndef BITBOX_FLUSH_THREADS
+#define BITBOX_FLUSH_THREADS            0
+#endif
+#define BITBOX_FLUSH_BATCH              256
+#define BITBOX_FLUSH_BATCH_BYTES        (64*1024*1024)
+#define BITBOX_FLUSH_MAINTENANCE_BATCH  16
+
+// prefetch() reads keys from disk on this many threads, started with the
+// first prefetch.
+#ifndef BITBOX_PREFETCH_THREADS
+#define BITBOX_PREFETCH_THREADS 4
+#endif
+
+// expired and prefix-deleted keys are removed this many at a time, letting
+// requests in between.
+#define BITBOX_DELETE_BATCH     100
+
+// get_bit(), count_bits(), find_bit() and byte_length() read arrays that are
+// in memory without taking the lock, trying this many times before they give
+// up on writers and take it after all.  every BITBOX_UNLOCKED_TOUCH_EVERY-th
+// such read from a thread takes the lock if it's free, to move its array
+// up in the eviction order and count the reads since as cache hits.
+#define BITBOX_UNLOCKED_READ_TRIES    4
+#define BITBOX_UNLOCKED_TOUCH_EVERY   16
+
+// get_range() reads this many bytes at a time, each as a read of its own,
+// so that a big range doesn't keep writers waiting.  the thrift server
+// hands out at most BITBOX_RANGE_MAX_BYTES per call.
+#define BITBOX_RANGE_CHUNK_BYTES  (1024*1024)
+#define BITBOX_RANGE_MAX_BYTES    (64*1024*1024)
+
+// arrays up to this many bytes are stored inside the Bitarray itself rather
+// than in a separate heap allocation.  most keys never outgrow it.
+#define BITARRAY_INLINE_SIZE    32
+
+// arrays that would grow past BITARRAY_PAGED_THRESHOLD bytes switch to a
+// paged layout: a two-level directory of BITARRAY_PAGE_SIZE pages, each
+// allocated the first time anything in it is set.  growing then only adds
+// directory entries instead of copying the array, and bits that are far
+// apart don't pay for the zeroes between them.  define the threshold as 0 to
+// keep every array flat.
+#ifndef BITARRAY_PAGED_THRESHOLD
+#define BITARRAY_PAGED_THRESHOLD  (1024*1024)
+#endif
+#define BITARRAY_PAGE_SIZE        (64*1024)
+#define BITARRAY_PAGES_PER_TABLE  512
+#define BITARRAY_TABLE_SPAN       ((int64_t)BITARRAY_PAGE_SIZE * BITARRAY_PAGES_PER_TABLE)
+
+// array buffers and pages of at least this many bytes come from
+// hugepages.h's 2 MB regions instead of the heap, so random reads over big
+// arrays stay within a few TLB entries.  define it as 0 to use the heap for
+// everything.
+#ifndef BITARRAY_HUGE_THRESHOLD
+#define BITARRAY_HUGE_THRESHOLD   BITARRAY_PAGE_SIZE
+#endif
+
 #if __WORDSIZE == 64
 uint64_t MurmurHash64A(const void * key, int len, unsigned int seed);
 #define MurmurHash MurmurHash64A
@@ -23,59 +119,131 @@ unsigned int MurmurHash2(const void * key, int len, unsigned int seed);
 #define MurmurHash MurmurHash2
 #endif
 
-struct bitbox_str_hasher
-{
-    size_t operator()(const char * key) const
-    {
-        return MurmurHash(key, strlen(key), 0);
-    }
-};
-
-struct eqstr
-{
-    bool operator()(const char* s1, const char* s2) const
-    {
-        return (s1 == s2) || (s1 && s2 && strcmp(s1, s2) == 0);
-    }
-};
-
 // bitarray
 
 struct SerializedBitarray;
 
-struct Bitarray {
+// how a paged array stands on disk, so that saving it only has to write the
+// pages changed since.  data/<key> holds the array as of its last full save
+// and data/.delta/<key> holds pages changed after that, each record
+// replacing a whole page.  the delta file starts with a hash of the file it
+// applies to, so one left behind by a crash during a full save is ignored.
+// once the deltas would outgrow the full file, the next save rewrites it.
+struct BitarrayDiskState {
+    std::set<int64_t> dirty_pages; // byte / BITARRAY_PAGE_SIZE
+    uint64_t base_hash;
+    int64_t base_bytes;
+    int64_t delta_bytes;
+};
+
+// where an array's bits are, and the reads that only need to know that.  it
+// can be copied, so that a reader that doesn't hold Bitbox's lock can take a
+// copy, check that it's current, and read from that (see
+// Bitbox::read_unlocked()).  the memory it points to is freed through
+// epoch_free(), so a copy never points at freed memory while its reader
+// holds an EpochGuard.
+struct BitarrayLayout {
     uint8_t * array;
-    int64_t size; // actual number of bytes allocated in array
+    int64_t size; // actual number of bytes allocated in array (or covered by pages)
 
     // an optimization to prevent a bunch of unused zeroes at the beginning of
     // an array that doesn't use them.
     int64_t offset;
 
-    // so we can flush less-used data to disk.
+    // the paged layout, or NULL while the array is flat.  pages[t][p] holds
+    // the bytes from offset + (t*BITARRAY_PAGES_PER_TABLE + p)*BITARRAY_PAGE_SIZE
+    // on, and either level may be NULL if nothing under it has been set.  in
+    // this layout offset and size are multiples of BITARRAY_TABLE_SPAN.
+    uint8_t *** pages;
+
+    BitarrayLayout() : array(NULL), size(0), offset(0), pages(NULL) {}
+
+    bool is_paged() const { return this->pages != NULL; }
+    const uint8_t * page_for_read(int64_t byte) const;
+    void used_range(int64_t * first_byte, int64_t * nbytes) const;
+    void copy_out(uint8_t * dest, int64_t first_byte, int64_t nbytes) const;
+    void copy_bits(uint8_t * dest, int64_t start_bit, int64_t nbits) const;
+    const uint8_t * byte_for_read(int64_t byte) const;
+    int64_t run_length(int64_t byte) const;
+    int get_bit(int64_t index) const;
+    uint64_t get_field(int64_t bit, int width) const;
+    int64_t count_range(int64_t start_bit, int64_t end_bit) const;
+    int64_t find_bit(int value, int64_t start_bit, int64_t end_bit) const;
+};
+
+struct Bitarray : BitarrayLayout {
+    // so we can flush less-used data to disk.  this is a reading of
+    // Bitbox::clock, not a wall clock time.
     int64_t last_access;
     char * key;
+    size_t keylen;
+
+    // storage for small arrays; array points here until it outgrows it.
+    uint8_t inline_array[BITARRAY_INLINE_SIZE];
 
-    Bitarray(const char * key, int64_t start_bit);
+    int64_t npages; // allocated
+    int64_t bits;   // set, kept up to date by everything that changes them
+
+    // NULL unless the array is paged and what's on disk is known to match
+    // it apart from disk->dirty_pages.  otherwise the next save is a full
+    // one.
+    BitarrayDiskState * disk;
+
+    Bitarray(const char * key, size_t keylen, int64_t start_bit);
     ~Bitarray();
 
+    bool is_inline() const { return this->array == this->inline_array; }
+    uint8_t * alloc_array(int64_t size);
+    void replace_array(uint8_t * new_array, int64_t new_size);
     void init_data(int64_t start_bit);
+
+    int64_t memory_size() const;
+
+    void make_paged(const uint8_t * data, int64_t data_offset, int64_t data_size);
+    void convert_to_paged();
+    void free_pages();
+    void grow_pages_to_reach(int64_t byte);
+    uint8_t * page_for_write(int64_t byte);
+    void copy_in(int64_t first_byte, const uint8_t * data, int64_t nbytes);
+    uint8_t * byte_for_write(int64_t byte);
+
     void dump();
-    void save_frozen(const char * key, SerializedBitarray& ser);
-    static SerializedBitarray load_frozen(const char * key);
+    void flatten(std::string & flat) const;
+    static void freeze_flat(const std::string & flat, std::string & contents);
+    static void save_frozen(const char * key, const std::string & contents);
+    static void stage_frozen(const char * key, const std::string & contents, bool * staged);
+    static void commit_staged(const char * key);
+    static void discard_staged(const char * key);
+    static bool read_frozen(const char * key, std::string & contents);
+    static void freeze(const SerializedBitarray & ser, std::string & contents);
+    static Bitarray * thaw(const char * key, size_t keylen, const uint8_t * contents, int64_t size);
+    static void list_on_disk(std::vector<std::string> & keys);
+    static void delete_from_disk(const char * key);
+    static int64_t disk_bytes(const char * key);
     void save_to_disk();
+    bool save_dirty_pages();
+    void saved_in_full(uint64_t base_hash, int64_t base_bytes);
+    void apply_deltas(const uint8_t * contents, int64_t size, uint64_t base_hash);
     void grow_up(int64_t size);
     void grow_down(int64_t new_size);
     void adjust_size_to_reach(int64_t new_index);
-    int get_bit(int64_t index);
     void set_bit(int64_t index);
+    void clear_bit(int64_t index);
+    uint64_t set_field(int64_t bit, int width, uint64_t value);
+    void set_range(int64_t start_bit, int64_t end_bit);
+    void or_bytes(int64_t first_byte, const uint8_t * data, int64_t nbytes);
+    void or_bits(int64_t start_bit, const uint8_t * data, int64_t nbytes);
+    void or_array(const Bitarray * other);
+    void take_data(Bitarray * other);
 
-    static Bitarray * find_on_disk(const char * key);
+    static Bitarray * find_on_disk(const char * key, size_t keylen);
 };
 
 struct SerializedBitarray {
     Bitarray * b;
 
     const char * key;
+    size_t keylen;
     uint8_t * buffer;
     int64_t bufsize;
     int64_t uncompressed_size;
@@ -83,69 +251,498 @@ struct SerializedBitarray {
 
     ~SerializedBitarray();
     SerializedBitarray(Bitarray * b);
-    SerializedBitarray(const char * key, uint8_t * buffer, int64_t bufsize, int64_t uncompressed_size, uint8_t is_compressed);
+    SerializedBitarray(const char * key, size_t keylen, uint8_t * buffer, int64_t bufsize, int64_t uncompressed_size, uint8_t is_compressed);
 };
 
 // bitbox
 
+// what Bitbox::incr_field() does when the sum doesn't fit in the field:
+// wrap around, stick at the smallest or biggest value it holds, or leave the
+// field alone and fail.
+enum BitboxOverflow {
+    BITBOX_OVERFLOW_WRAP,
+    BITBOX_OVERFLOW_SAT,
+    BITBOX_OVERFLOW_FAIL
+};
+
+// one operation in a Bitbox::execute_batch() call.  ranges are
+// [bit, end_bit).  the result of a read goes in result.  field operations
+// work as Bitbox::get_field() and the rest do, with the field's old value as
+// the result of a set and its new one as the result of an increment by
+// value.  overflow applies to sets as well as increments, as it does in
+// redis's BITFIELD.
+enum BitboxOpType {
+    BITBOX_OP_GET_BIT,
+    BITBOX_OP_SET_BIT,
+    BITBOX_OP_SET_BITS,
+    BITBOX_OP_SET_RANGE,
+    BITBOX_OP_COUNT_RANGE,
+    BITBOX_OP_GET_FIELD,
+    BITBOX_OP_SET_FIELD,
+    BITBOX_OP_INCR_FIELD
+};
+
+inline bool bitbox_op_writes(BitboxOpType type)
+{
+    return type != BITBOX_OP_GET_BIT && type != BITBOX_OP_COUNT_RANGE && type != BITBOX_OP_GET_FIELD;
+}
+
+struct BitboxOp {
+    BitboxOpType type;
+    const std::string * key;
+    int64_t bit;
+    int64_t end_bit;
+    const std::set<int64_t> * bits; // for BITBOX_OP_SET_BITS
+
+    // for the field operations
+    int width;
+    bool is_signed;
+    int64_t value;
+    BitboxOverflow overflow;
+
+    int64_t result;
+    bool failed; // a key that isn't ok, a write to a negative bit, a field
+                 // operation on a field that isn't ok, or a set or increment
+                 // that overflowed with BITBOX_OVERFLOW_FAIL
+};
+
+// what Bitbox::key_info() and memory_top() report.  size, offset, bits and
+// idle are -1 unless the key is in memory.
+enum BitboxKeyState {
+    BITBOX_KEY_MISSING,
+    BITBOX_KEY_IN_MEMORY,
+    BITBOX_KEY_IN_TIER,
+    BITBOX_KEY_ON_DISK
+};
+
+struct BitboxKeyInfo {
+    std::string key;
+    BitboxKeyState state;
+    int64_t size;
+    int64_t offset;
+    int64_t bits;         // set
+    int64_t memory_bytes; // in memory, or compressed in the tier
+    int64_t disk_bytes;   // its file and deltas in data/
+    int64_t idle;         // how far clock has moved since it was last used
+};
+
+// reads a packed list of bit positions for Bitbox::set_bits(), as a forward
+// iterator over them.  each position is an unsigned LEB128 varint giving its
+// distance from the one before, or from 0 for the first, so a sorted list
+// of positions near each other takes a byte or two apiece.  the list ends
+// early at a varint that's cut short or that would go past INT64_MAX.  a
+// default-constructed reader is the end.
+class BitboxPositionReader {
+private:
+    const uint8_t * p;     // past the current position's varint, or NULL at the end
+    const uint8_t * limit;
+    int64_t position;
+
+    void next()
+    {
+        uint64_t delta = 0;
+        for(int shift = 0; ; shift += 7)
+        {
+            if(this->p == this->limit || shift > 63)
+            {
+                this->p = NULL;
+                return;
+            }
+            uint8_t byte = *this->p++;
+            delta |= (uint64_t)(byte & 0x7f) << shift;
+            if(!(byte & 0x80))
+                break;
+        }
+        if(delta > (uint64_t)(INT64_MAX - this->position))
+        {
+            this->p = NULL;
+            return;
+        }
+        this->position += delta;
+    }
+
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef int64_t value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const int64_t * pointer;
+    typedef const int64_t & reference;
+
+    BitboxPositionReader() : p(NULL), limit(NULL), position(0) {}
+    BitboxPositionReader(const uint8_t * data, size_t len)
+        : p(data), limit(data + len), position(0)
+    {
+        this->next();
+    }
+
+    const int64_t & operator*() const { return this->position; }
+    BitboxPositionReader & operator++() { this->next(); return *this; }
+    BitboxPositionReader operator++(int) { BitboxPositionReader before = *this; this->next(); return before; }
+    bool operator==(const BitboxPositionReader & other) const { return this->p == other.p; }
+    bool operator!=(const BitboxPositionReader & other) const { return this->p != other.p; }
+};
+
+enum BitboxBitop {
+    BITBOX_BITOP_AND,
+    BITBOX_BITOP_OR,
+    BITBOX_BITOP_XOR,
+    BITBOX_BITOP_NOT
+};
+
+// something that wants to hear about every change made to a Bitbox, such as
+// a replication primary.  it's called with the box locked, in the order the
+// changes happened, so it should be quick about it.
+class BitboxListener {
+public:
+    virtual ~BitboxListener() {}
+    virtual void bits_set(const std::string & key, const int64_t * bits, size_t nbits) = 0;
+    virtual void range_set(const std::string & key, int64_t start_bit, int64_t end_bit) = 0;
+    virtual void bitmap_ored(const std::string & key, int64_t start_bit, const uint8_t * bitmap, int64_t nbytes) = 0;
+    virtual void bit_cleared(const std::string & key, int64_t bit) = 0;
+    virtual void field_set(const std::string & key, int64_t bit, int width, uint64_t value) = 0;
+    virtual void array_replaced(const std::string & key, Bitarray * b) = 0;
+    virtual void key_deleted(const std::string & key) = 0;
+};
+
+// an array on its way to disk in a flush batch.  flat is what
+// Bitarray::flatten() made of it, or empty if it came from the tier already
+// frozen.
+struct BitboxFlushJob {
+    std::string key;
+    std::string flat;
+    std::string frozen;
+    bool paged;
+    uint64_t base_hash; // of frozen, if paged
+    bool staged;        // written under data/.flush, waiting to be moved into place
+};
+
+// how far along Bitbox::shutdown() is, for its progress callback.
+struct BitboxFlushProgress {
+    int64_t arrays_written;
+    int64_t bytes_written; // not counting deltas
+    int64_t arrays_left;
+    double seconds;
+};
+typedef std::function<void(const BitboxFlushProgress &)> flush_progress_t;
+
 class Bitbox {
 private:
-    typedef google::sparse_hash_map<const char *, Bitarray *, bitbox_str_hasher, eqstr> hash_t;
-    typedef std::multimap<const int64_t, char *> lru_map_t;
+    typedef KeyTable hash_t;
     typedef google::sparse_hash_set<Bitarray *> need_disk_write_set_t;
 
+    // every public method holds this for its duration, so a Bitbox can be
+    // shared by several front ends running in their own threads.  the
+    // exceptions are reads of arrays that are in memory; see read_unlocked().
     std::mutex mu;
 
+    // a seqlock for those reads.  a Change makes it odd while something
+    // changes the hash or an array in it, and even again afterwards, so a
+    // reader that saw the same even version before and after knows that what
+    // it read held still.  changes nest; only the outermost one counts.
+    // arrays and the storage they let go of are freed through the epoch
+    // functions, so a reader never sees freed memory in the meantime.
+    std::atomic<uint64_t> version;
+    int changing;
+
+    struct Change {
+        Bitbox * box;
+        Change(Bitbox * box);
+        ~Change();
+    };
+
+    // a box can be one of several partitions sharing data/, each owning the
+    // keys that partition_for() gives it and ignoring the rest.  a lone box
+    // is partition 0 of 1 and owns everything.
+    int partition;
+    int npartitions;
+    std::string expiry_path;
+
     // the main way we access data.  the key is an arbitrary string and the
     // value is a Bitarray.
     hash_t hash;
 
-    // we use this to implement efficient dump-to-disk behavior to keep memory
-    // usage reasonable.  the key is a timestamp and the value corresponds to a
-    // key in the hash.
-    lru_map_t lru;
+    // every key, wherever it is, in order.  it's read from data/ when the
+    // box is created and kept up to date as keys come and go, so listing
+    // keys never looks at an array or at the disk.
+    KeyIndex key_index;
+
+    // a logical clock that ticks once per request.  arrays are stamped with
+    // it when they're used, so the eviction policy hears about each array at
+    // most once per request.
+    int64_t clock;
+
+    // picks the arrays to write out of memory, to keep memory usage
+    // reasonable.  it knows every array in the hash.
+    EvictionPolicy * eviction;
+    int64_t cache_hits;      // lookups of arrays already in memory
+    int64_t cache_tier_hits; // of arrays in the compressed tier
+    int64_t cache_misses;    // and of arrays that had to be loaded from disk
+    int64_t cache_evictions;
+
+    // keys being read from disk with the box unlocked.  a request for one of
+    // them waits on `loaded` for that read instead of starting its own.
+    std::unordered_set<std::string> loading;
+    std::condition_variable loaded;
+    int64_t loads_waited; // requests that waited on another's read
+
+    // keys waiting for a prefetch thread.  they stop being loaded once
+    // memory reaches the limits maintenance keeps it under, and the rest of
+    // the queue is dropped, so a prefetch never pushes anything else out.
+    std::deque<std::string> prefetch_queue;
+    std::condition_variable prefetch_ready;
+    std::vector<std::thread> prefetch_threads;
+    bool prefetch_stopping;
+    int64_t prefetch_loaded;
+    int64_t prefetch_skipped;
+
+    // evicted arrays, still compressed in memory.  a key is in at most one
+    // of the hash, the tier and need_disk_write's arrays; it may be on disk
+    // as well as any of them.
+    CompressedTier tier;
 
     // this is to prevent having memory get too out of sync with the disk,
     // causing lots of data loss in case of an unclean shutdown.  it stores
     // a set of items of the type Bitarray*
     need_disk_write_set_t need_disk_write;
 
+    // flushes take turns on flush_mu, and a key is in flushing from when a
+    // flush copies it until the flush writes it.  anything else that saves
+    // or deletes the key in between takes it out, so the flush won't write
+    // over it, and an array evicted in between counts as dirty, since the
+    // disk doesn't have it yet.  the pool starts with the first flush.
+    std::mutex flush_mu;
+    std::unordered_set<std::string> flushing;
+    WorkerPool * flush_pool;
+    int64_t flush_batches;
+    int64_t flush_arrays;
+    int64_t flush_bytes;
+
+    // keys with a time to live, and the unix time each one expires at.  the
+    // wheel says when to look at them.  changes are appended to
+    // expiry_path, which is read back and compacted at startup.
+    typedef std::unordered_map<std::string, int64_t> expiry_map_t;
+    expiry_map_t expiries;
+    TimingWheel expiry_wheel;
+    FILE * expiry_log;
+    int64_t keys_expired;
+
+    // while an export runs, the keys that were only on disk when it began
+    // and that it hasn't read yet.  anything about to load or delete one of
+    // them sets its contents aside in export_captured first, so the export
+    // sees every key as it was when it began.  a clear() spoils it.
+    bool exporting;
+    bool export_spoiled;
+    std::set<std::string> export_pending;
+    std::vector<std::pair<std::string, std::string> > export_captured;
+    int64_t export_keys; // written by the running or last export
+
+    BitboxListener * listener;
+
 public:
-    Bitbox();
+    Bitbox(int partition = 0, int npartitions = 1);
     ~Bitbox();
-    void shutdown();
 
-    int  get_bit (const char * key, int64_t bit);
-    void set_bit (const char * key, int64_t bit);
+    // which of npartitions boxes a key belongs to.
+    static int partition_for(const std::string & key, int npartitions);
+    bool owns(const std::string & key) const;
+
+    // keys are file names in data/, and the names there starting with a dot
+    // are the box's own (.delta, .expiries and the rest), so keys can't start
+    // with one.  the box itself doesn't check; whatever takes keys from
+    // clients turns away the ones that aren't ok.
+    static bool key_ok(const std::string & key);
+
+    // a partition of several starts appending expiries only once this is
+    // called, which has to wait until every partition has been created.
+    // after that, remove_stale_expiry_logs() deletes the logs none of them
+    // use.  a lone box does both itself.
+    void open_expiry_log();
+    static void remove_stale_expiry_logs(int npartitions);
+
+    // writes every dirty array to disk, giving up if it's still at it after
+    // `seconds` (0 for no deadline).  progress, if given, is called after
+    // each batch.  returns false if it gave up.
+    bool shutdown(int64_t seconds = 0, const flush_progress_t & progress = flush_progress_t());
+
+    int  get_bit (const std::string & key, int64_t bit);
+    void set_bit (const std::string & key, int64_t bit);
 
     template<typename ConstIterator>
-    void set_bits(const char * key, ConstIterator begin, ConstIterator end)
+    void set_bits(const std::string & key, ConstIterator begin, ConstIterator end)
     {
+        std::unique_lock<std::mutex> lock(this->mu);
+        this->load_unlocked(lock, key);
+        this->clock++;
+        Change change(this);
         Bitarray * b = this->find_or_create_array(key);
         for(ConstIterator it = begin; it != end; ++it)
-            this->set_bit_nolookup(b, *it);
+            b->set_bit(*it);
+        this->mark_modified(b);
+        if(this->listener)
+        {
+            std::vector<int64_t> bits(begin, end);
+            this->listener->bits_set(key, bits.data(), bits.size());
+        }
         this->downsize_if_angry();
     }
 
-private:
-    void downsize_single_step(int64_t memory_limit);
-    void diskwrite_single_step();
+    void set_range(const std::string & key, int64_t start_bit, int64_t end_bit);
 
-public:
-    Bitarray * find_array          (const char * key);
-    Bitarray * find_or_create_array(const char * key);
+    // ORs nbytes bytes of bitmap, packed as get_range() packs them, into key
+    // so that its first bit lands on start_bit.  returns false, changing
+    // nothing, if start_bit is negative or the bitmap would run past INT64_MAX.
+    bool or_bitmap(const std::string & key, int64_t start_bit, const uint8_t * bitmap, int64_t nbytes);
+
+    void execute_batch(std::vector<BitboxOp> & ops);
+
+    // sets or clears a bit, returning its previous value.
+    int change_bit(const std::string & key, int64_t bit, int value);
+
+    // small counters packed into a key.  a field is the width bits from bit
+    // on, read as a number whose lowest bit is bit, either unsigned or two's
+    // complement.  widths go up to 64 for signed fields and 63 for unsigned
+    // ones, so that every value fits in an int64_t.  field_ok() says whether
+    // a field is one of these; the bit mustn't be negative either.  fields
+    // that aren't ok read as 0 and are never written, and are failed in a
+    // batch.
+    //
+    // set_field() stores the low width bits of value and returns the old
+    // value.  incr_field() adds by, handling overflow as overflow says, and
+    // puts the new value in *result; it returns false, changing nothing, if
+    // the field isn't ok or the sum doesn't fit and overflow is
+    // BITBOX_OVERFLOW_FAIL.
+    static bool field_ok(int64_t bit, int width, bool is_signed);
+    int64_t get_field (const std::string & key, int64_t bit, int width, bool is_signed);
+    int64_t set_field (const std::string & key, int64_t bit, int width, bool is_signed, int64_t value);
+    bool    incr_field(const std::string & key, int64_t bit, int width, bool is_signed, int64_t by, BitboxOverflow overflow, int64_t * result);
+
+    // ranges are [start_bit, end_bit).  find_bit() returns -1 if there's no
+    // such bit.  byte_length() is how far into the key data extends.
+    int64_t count_bits (const std::string & key, int64_t start_bit, int64_t end_bit);
+    int64_t find_bit   (const std::string & key, int value, int64_t start_bit, int64_t end_bit);
+    int64_t byte_length(const std::string & key);
+
+    // the bits in [start_bit, end_bit), packed as arrays pack them, so that
+    // bit start_bit + i lands in byte i / 8 of range, at MASK(i).  bits the
+    // key doesn't have, and any past end_bit in the last byte, are zero.
+    // range must have room for (end_bit - start_bit + 7) / 8 bytes.  a range
+    // longer than BITBOX_RANGE_CHUNK_BYTES is read a chunk at a time, so
+    // writes may land between chunks.
+    void get_range(const std::string & key, int64_t start_bit, int64_t end_bit, uint8_t * range);
+
+    // replaces dest with the combination of the source keys, and returns the
+    // byte length of the longest source.
+    int64_t bitop(BitboxBitop op, const std::string & dest, const std::vector<std::string> & sources);
+
+    // replaces key's contents with data's, leaving data empty.
+    void replace(const std::string & key, Bitarray * data);
+
+    // for moving keys between servers.  dump() gets the Bitarray::freeze()
+    // form of a key, returning false if there's no such key, and merge() ORs
+    // data into one.  delete_key() returns false if there was no such key.
+    bool dump(const std::string & key, std::string & frozen);
+
+    // the same, for the copy of a key in data/, without loading it.  the
+    // box is locked while the file and its deltas are read, so a save can't
+    // come between them.
+    bool dump_from_disk(const std::string & key, std::string & frozen);
+    void merge(const std::string & key, Bitarray * data);
+    bool delete_key(const std::string & key);
+
+    // expire() deletes a key `seconds` from now, returning false if there's
+    // no such key.  ttl() is the seconds it has left: -1 if it doesn't
+    // expire, and -2 if there's no such key.
+    bool expire(const std::string & key, int64_t seconds);
+    int64_t ttl(const std::string & key);
+
+    // deletes the keys whose time is up, returning how many.  call it every
+    // second or so.
+    int64_t expire_keys();
+
+    // deletes every key that starts with prefix, returning how many.
+    int64_t delete_prefix(const std::string & prefix);
+
+    // up to count keys starting with prefix that sort after `after`, in
+    // order.  the last key returned is the `after` for the next call.
+    void scan_keys(const std::string & prefix, const std::string & after, size_t count, std::vector<std::string> & keys);
+
+    // reads keys that are only on disk into memory on background threads,
+    // as far as the memory limits allow, and returns right away.
+    // resident() is how many of keys are in memory now.
+    void prefetch(const std::vector<std::string> & keys);
+    int64_t resident(const std::vector<std::string> & keys);
+
+    // what's using the memory.  key_info() describes a key without loading
+    // it or counting as a use, and memory_top() the count biggest arrays in
+    // memory, biggest first, from the order the eviction policy keeps them
+    // in by size.  neither looks at any other key.
+    void key_info(const std::string & key, BitboxKeyInfo & info);
+    void memory_top(size_t count, std::vector<BitboxKeyInfo> & top);
+
+    // forgets every key, in memory and on disk.
+    void clear();
+
+    // freezes every array in memory, as (key, Bitarray::freeze() contents)
+    // pairs, calling at_snapshot before anything else can change.  keys that
+    // are only on disk are left to the caller.  the box is only locked while
+    // the arrays are copied, not while they're compressed.
+    void snapshot(std::vector<std::pair<std::string, std::string> > & frozen, const std::function<void()> & at_snapshot);
+
+    // writes every key, as it was when this was called, to filename in the
+    // format described in exportfile.h.  requests carry on while it runs.
+    // returns false if it couldn't, or if another export is running.
+    // started, if given, is called as soon as the export's contents are
+    // settled (true) or it has failed to begin (false), so that a caller
+    // running it in a thread of its own knows when to carry on.
+    bool export_to_file(const std::string & filename, const std::function<void(bool)> & started = std::function<void(bool)>());
+
+    void set_listener(BitboxListener * listener);
+
+    // switches to the named EvictionPolicy, returning false if there's no
+    // such policy.
+    bool set_eviction_policy(const std::string & name);
+    void get_stats(std::map<std::string, int64_t> & stats);
 
     bool run_maintenance_step();
 
+    // writes a batch of up to max_arrays dirty arrays, returning how many.
+    // returns 0 straight away if another flush is under way.
+    int64_t flush(size_t max_arrays);
+
 private:
-    void update_key_in_lru(const char * key, int64_t old_timestamp, int64_t new_timestamp);
-    void add_array_to_hash(Bitarray * b);
+    void downsize_single_step(size_t item_limit, int64_t memory_limit);
+    bool key_exists(const std::string & key);
+    bool remove_key(const std::string & key);
+    void load_expiries();
+    static std::string expiry_log_path(int partition, int npartitions);
+    static void expiry_logs(std::vector<std::string> & paths);
+    void log_expiry(const std::string & key, int64_t when);
+    void diskwrite_single_step();
+
+    Bitarray * find_array          (const std::string & key);
+    Bitarray * find_or_create_array(const std::string & key);
+    bool load_unlocked(std::unique_lock<std::mutex> & lock, const std::string & key);
+    template<typename Read>
+    bool read_unlocked(const std::string & key, const Read & read);
+    bool unchanged_since(uint64_t version);
+    void note_unlocked_read(const std::string & key);
+    static void retire(Bitarray * b);
+    void describe(Bitarray * b, BitboxKeyInfo & info) const;
+    void run_field_op(Bitarray * b, const std::string & key, BitboxOp * op);
+    void prefetch_loop();
+    void add_loaded_array(Bitarray * b, const std::string & key, uint64_t hash);
+
+    bool over_limit(size_t item_limit, int64_t memory_limit) const;
+    void age_out_of_tier();
+    void add_array_to_hash(Bitarray * b, uint64_t hash);
     void downsize_if_angry();
-    void set_bit_nolookup(Bitarray * b, int64_t bit);
-    void banish_oldest_item_to_disk();
-    void write_one_to_disk();
+    void touch(Bitarray * b);
+    void mark_modified(Bitarray * b);
+    void evict_one();
+    size_t arrays_to_write();
+    int64_t flush_batch(size_t max_arrays, int64_t * bytes_written);
 
-    Bitarray * find_array_in_memory(const char * key);
+    Bitarray * find_array(const std::string & key, uint64_t hash);
 };
 
 #endif
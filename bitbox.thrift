@@ -1,5 +1,172 @@
+enum OpType {
+    GET_BIT     = 1,
+    SET_BIT     = 2,
+    SET_BITS    = 3,
+    SET_RANGE   = 4, // sets every bit in [bit, end_bit)
+    COUNT_RANGE = 5, // counts the set bits in [bit, end_bit)
+    GET_FIELD   = 6, // these three work as get_field() and the rest do,
+    SET_FIELD   = 7, // with the field at bit, and value as what to set
+    INCR_FIELD  = 8  // it to or add to it.  overflow applies to both.
+}
+
+// what incr_field() does when the sum doesn't fit in the field: wrap
+// around, stick at the smallest or biggest value the field holds, or leave
+// the field alone and fail.
+enum Overflow {
+    WRAP = 0,
+    SAT  = 1,
+    FAIL = 2
+}
+
+struct Op {
+    1: OpType type,
+    2: string key,
+    3: i64 bit,
+    4: i64 end_bit,
+    5: set<i64> bits,
+    6: i32 width,
+    7: bool is_signed,
+    8: i64 value,
+    9: Overflow overflow
+}
+
+// where a key is, for key_info() and memory_top().
+enum KeyState {
+    MISSING   = 0,
+    IN_MEMORY = 1,
+    IN_TIER   = 2, // evicted, but still in memory compressed
+    ON_DISK   = 3
+}
+
+// size, offset and bits_set are -1 unless the key is in memory.  idle is how
+// many requests the server has handled since the key was last used, and is
+// also -1 unless it's in memory.
+struct KeyInfo {
+    1: string key,
+    2: KeyState state,
+    3: i64 size,         // bytes the array covers, starting at byte offset
+    4: i64 offset,
+    5: i64 bits_set,
+    6: i64 memory_bytes, // in memory, or compressed in the tier
+    7: i64 disk_bytes,   // its file in data/ and any deltas, 0 if not written yet
+    8: i64 idle
+}
+
+struct OpResult {
+    1: bool bit,    // GET_BIT
+    2: i64 count,   // COUNT_RANGE
+    3: i64 value,   // the field operations
+    4: bool failed  // a key starting with a dot, a write to a negative bit, a
+                    // field operation whose field wasn't valid, or SET_FIELD or
+                    // INCR_FIELD overflowing with FAIL; either way nothing
+                    // changed
+}
+
+// writes to a replica are refused.
+exception ReadOnly {
+    1: string message
+}
+
+// arguments that are out of range.
+exception InvalidArgument {
+    1: string message
+}
+
+exception FieldOverflow {
+    1: string message
+}
+
 service Bitbox {
-    bool get_bit(1:string key, 2:i64 bit),
-    void set_bit(1:string key, 2:i64 bit)
-    void set_bits(1:string key, 2:set<i64> bits)
+    // keys become file names on the server, where names starting with a dot
+    // are its own, so a key starting with one gets InvalidArgument, or fails
+    // its operations in a batch.
+    bool get_bit(1:string key, 2:i64 bit) throws (1:InvalidArgument ia)
+    void set_bit(1:string key, 2:i64 bit) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+    void set_bits(1:string key, 2:set<i64> bits) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+
+    // compact forms of set_bits() for big uploads.  set_packed_bits() takes
+    // the positions sorted and delta-encoded: each is an unsigned LEB128
+    // varint (7 bits per byte, low bits first, high bit set on all but the
+    // last byte) giving its distance from the one before, or from 0 for the
+    // first.  or_bitmap() ORs in a bitmap packed the way get_range() packs
+    // one, with its first bit landing on start_bit, which mustn't be
+    // negative; nor may the bitmap run past bit 2^63 - 1.
+    void set_packed_bits(1:string key, 2:binary positions) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+    void or_bitmap(1:string key, 2:i64 start_bit, 3:binary bitmap) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+
+    // small counters packed into a key.  a field is the width bits from bit
+    // on, read as a number whose lowest bit is bit, either unsigned or two's
+    // complement.  widths go up to 64 for signed fields and 63 for unsigned
+    // ones, and bit mustn't be negative; other fields get InvalidArgument,
+    // or are failed in a batch.  set_field() returns the old value and
+    // incr_field() the new one.  fields that don't line up with bytes are
+    // fine, and an execute_batch() of field operations runs them all at once.
+    i64 get_field(1:string key, 2:i64 bit, 3:i32 width, 4:bool is_signed) throws (1:InvalidArgument ia)
+    i64 set_field(1:string key, 2:i64 bit, 3:i32 width, 4:bool is_signed, 5:i64 value) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+    i64 incr_field(1:string key, 2:i64 bit, 3:i32 width, 4:bool is_signed, 5:i64 by, 6:Overflow overflow) throws (1:ReadOnly ro, 2:FieldOverflow fo, 3:InvalidArgument ia)
+
+    // runs any mix of operations on any number of keys in one round trip.
+    // results come back in the same order as ops.
+    list<OpResult> execute_batch(1:list<Op> ops) throws (1:ReadOnly ro)
+
+    // the bits in [start_bit, end_bit) as packed bytes: bit start_bit + i is
+    // bit i % 8 (counting from the least significant) of byte i / 8, and
+    // bits the key doesn't have read as zero, and start_bit mustn't be
+    // negative.  at most 64 MB comes back at a time; if the result is shorter
+    // than asked for, ask again from where it stops.
+    binary get_range(1:string key, 2:i64 start_bit, 3:i64 end_bit) throws (1:InvalidArgument ia)
+
+    // counters, such as repl_lag_ms on a replica.
+    map<string, i64> stats()
+
+    // for listing keys and moving them between servers.  scan_keys() lists
+    // up to count keys that start with prefix and sort after `after`, in
+    // order; pass the last one back as `after` for the next page.  a key's
+    // data travels in the same form as its file in data/; dump_key() returns
+    // nothing for a missing key and merge_key() ORs the data into whatever
+    // the key already has, or throws InvalidArgument if it isn't an array.
+    list<string> scan_keys(1:string after, 2:i32 count, 3:string prefix)
+    binary dump_key(1:string key) throws (1:InvalidArgument ia)
+    void merge_key(1:string key, 2:binary data) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+    void drop_key(1:string key) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+
+    // expire() deletes a key after `seconds`, or now if that isn't positive,
+    // and returns false if there's no such key.  ttl() gives the seconds
+    // left, -1 for a key that doesn't expire and -2 for a missing one.
+    // delete_prefix() deletes every key starting with `prefix` and returns
+    // how many there were.
+    bool expire(1:string key, 2:i64 seconds) throws (1:ReadOnly ro, 2:InvalidArgument ia)
+    i64 ttl(1:string key) throws (1:InvalidArgument ia)
+    i64 delete_prefix(1:string prefix) throws (1:ReadOnly ro)
+
+    // starts writing every key, as it is now, to data/.exports/filename on
+    // the server in the format described in exportfile.h, and returns false
+    // if an export is already running.  filename is a plain name, with no /
+    // in it.  stats() has export_running and export_keys.  through
+    // bitbox-router, each server writes its own share to its own file.
+    bool export_data(1:string filename) throws (1:InvalidArgument ia)
+
+    // for warming up before a burst of requests.  prefetch() starts reading
+    // keys that are only on disk into memory in the background and returns
+    // right away.  it stops short of pushing anything else out of memory;
+    // stats() counts the keys it left out as prefetch_skipped.  resident()
+    // says how many of keys are in memory now.
+    void prefetch(1:list<string> keys)
+    i64 resident(1:list<string> keys)
+
+    // for finding out what's using the memory.  key_info() describes one
+    // key without loading it, and memory_top() the count biggest keys in
+    // memory, biggest first.  both are kept track of as keys change, so
+    // asking is cheap however many keys there are.  through bitbox-router,
+    // memory_top() is the biggest across every server.
+    KeyInfo key_info(1:string key) throws (1:InvalidArgument ia)
+    list<KeyInfo> memory_top(1:i32 count)
+}
+
+// bitbox-router speaks the same interface, spreading keys over several
+// servers, plus this.
+service BitboxRouter extends Bitbox {
+    // adds a server and starts moving its share of the keys to it.  returns
+    // false if the last one added is still being filled.
+    bool add_node(1:string host, 2:i32 port)
 }
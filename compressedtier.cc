@@ -0,0 +1,108 @@
+#include "compressedtier.h"
+
+CompressedTier::CompressedTier(int64_t limit)
+    : bytes(0), limit(limit)
+{
+}
+
+void CompressedTier::erase(entry_map_t::iterator it)
+{
+    this->bytes -= it->first.size() + it->second.frozen.size();
+    this->order.erase(it->second.position);
+    if(it->second.dirty)
+        this->dirty.erase(it->first);
+    this->entries.erase(it);
+}
+
+bool CompressedTier::put(const std::string & key, std::string & frozen, bool dirty)
+{
+    this->remove(key);
+
+    int64_t size = key.size() + frozen.size();
+    if(size > this->limit)
+        return false;
+
+    Entry & e = this->entries[key];
+    e.frozen.swap(frozen);
+    e.dirty = dirty;
+    e.position = this->order.insert(this->order.end(), key);
+    if(dirty)
+        this->dirty.insert(key);
+    this->bytes += size;
+    return true;
+}
+
+bool CompressedTier::take(const std::string & key, std::string & frozen, bool * dirty)
+{
+    CompressedTier::entry_map_t::iterator it = this->entries.find(key);
+    if(it == this->entries.end())
+        return false;
+
+    // frozen may hold an earlier entry's data, which mustn't be left behind
+    // for erase() to count.
+    frozen.clear();
+    frozen.swap(it->second.frozen);
+    *dirty = it->second.dirty;
+    this->bytes -= frozen.size(); // erase() takes off the key
+    this->erase(it);
+    return true;
+}
+
+int64_t CompressedTier::entry_bytes(const std::string & key) const
+{
+    CompressedTier::entry_map_t::const_iterator it = this->entries.find(key);
+    if(it == this->entries.end())
+        return -1;
+    return it->first.size() + it->second.frozen.size();
+}
+
+bool CompressedTier::remove(const std::string & key)
+{
+    CompressedTier::entry_map_t::iterator it = this->entries.find(key);
+    if(it == this->entries.end())
+        return false;
+    this->erase(it);
+    return true;
+}
+
+void CompressedTier::clear()
+{
+    this->entries.clear();
+    this->order.clear();
+    this->dirty.clear();
+    this->bytes = 0;
+}
+
+bool CompressedTier::pop_overflow(std::string & key, std::string & frozen, bool * dirty)
+{
+    if(this->bytes <= this->limit || this->order.empty())
+        return false;
+
+    key = this->order.front();
+    return this->take(key, frozen, dirty);
+}
+
+bool CompressedTier::clean_one(std::string & key, std::string & frozen)
+{
+    if(this->dirty.empty())
+        return false;
+
+    key = *this->dirty.begin();
+    this->dirty.erase(this->dirty.begin());
+    Entry & e = this->entries[key];
+    e.dirty = false;
+    frozen = e.frozen;
+    return true;
+}
+
+void CompressedTier::keys(std::vector<std::string> & keys) const
+{
+    for(CompressedTier::entry_map_t::const_iterator it = this->entries.begin(); it != this->entries.end(); ++it)
+        keys.push_back(it->first);
+}
+
+void CompressedTier::copy_all(std::vector<std::pair<std::string, std::string> > & frozen) const
+{
+    for(CompressedTier::entry_map_t::const_iterator it = this->entries.begin(); it != this->entries.end(); ++it)
+        frozen.push_back(std::make_pair(it->first, it->second.frozen));
+}
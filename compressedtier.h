@@ -0,0 +1,69 @@
+#ifndef __COMPRESSEDTIER_H__
+#define __COMPRESSEDTIER_H__
+
+#include <stdint.h>
+#include <list>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// arrays that have been evicted from memory but not yet from RAM: each is
+// kept in the Bitarray::freeze() form, compressed, until the tier goes over
+// its byte budget and the oldest ones age out.  getting one back is a
+// decompress instead of a file read.
+//
+// an array that changed before it was evicted is dirty here until it's
+// written to disk, which Bitbox does when it ages out, or sooner during
+// maintenance.  the tier itself never touches the disk.
+
+class CompressedTier {
+private:
+    struct Entry {
+        std::string frozen;
+        bool dirty;
+        std::list<std::string>::iterator position;
+    };
+    typedef std::unordered_map<std::string, Entry> entry_map_t;
+
+    entry_map_t entries;
+    std::list<std::string> order; // oldest first
+    std::set<std::string> dirty;
+    int64_t bytes;
+    int64_t limit;
+
+    void erase(entry_map_t::iterator it);
+
+public:
+    CompressedTier(int64_t limit);
+
+    // takes frozen (leaving it empty) and keeps it under key, as the newest
+    // entry.  returns false, keeping nothing, if it's bigger than the whole
+    // budget.
+    bool put(const std::string & key, std::string & frozen, bool dirty);
+
+    // takes key's entry back out, if there is one.
+    bool take(const std::string & key, std::string & frozen, bool * dirty);
+
+    bool contains(const std::string & key) const { return this->entries.count(key) != 0; }
+    // the size of key's entry, or -1 if there isn't one.
+    int64_t entry_bytes(const std::string & key) const;
+    bool remove(const std::string & key);
+    void clear();
+
+    // takes out the oldest entry if the tier is over budget.
+    bool pop_overflow(std::string & key, std::string & frozen, bool * dirty);
+
+    // copies out a dirty entry and marks it clean, for writing to disk.
+    bool clean_one(std::string & key, std::string & frozen);
+
+    void keys(std::vector<std::string> & keys) const;
+    void copy_all(std::vector<std::pair<std::string, std::string> > & frozen) const;
+
+    size_t size() const { return this->entries.size(); }
+    size_t dirty_count() const { return this->dirty.size(); }
+    int64_t memory_bytes() const { return this->bytes; }
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include <stdlib.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "epoch.h"
+
+// a reader's slot holds the epoch it entered at, or 0 when it's not reading.
+// each has a cache line to itself, so readers never share one.
+struct EpochSlot {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> taken;
+    char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+};
+
+struct EpochRetired {
+    void * p;
+    void (*destroy)(void *);
+    uint64_t epoch; // the global epoch when it was retired
+};
+
+static EpochSlot slots[EPOCH_MAX_READERS];
+static std::atomic<int> slots_used(0);  // no slot past this has been taken
+static std::atomic<bool> readers_seen(false);
+static std::atomic<uint64_t> global_epoch(1);
+
+static std::mutex retired_mu;
+static std::deque<EpochRetired> retired; // in order of epoch
+
+// a thread keeps its slot until it exits.
+struct EpochThread {
+    int slot;
+    int depth;
+
+    EpochThread() : slot(-1), depth(0) {}
+    ~EpochThread()
+    {
+        if(this->slot >= 0)
+            slots[this->slot].taken.store(false);
+    }
+};
+static thread_local EpochThread thread_epoch;
+
+static int take_slot()
+{
+    for(int i = 0; i < EPOCH_MAX_READERS; i++)
+    {
+        bool free = false;
+        if(!slots[i].taken.load(std::memory_order_relaxed) && slots[i].taken.compare_exchange_strong(free, true))
+        {
+            int used = slots_used.load();
+            while(used < i + 1 && !slots_used.compare_exchange_weak(used, i + 1))
+                ;
+            readers_seen.store(true);
+            return i;
+        }
+    }
+    return -1;
+}
+
+EpochGuard::EpochGuard()
+    : slot(-1)
+{
+    EpochThread & t = thread_epoch;
+    if(t.slot < 0 && (t.slot = take_slot()) < 0)
+        return;
+
+    this->slot = t.slot;
+    if(t.depth++)
+        return;
+
+    // anything retired before this is out of reach: the fence keeps the
+    // reads that follow from seeing memory as it was before the store.
+    slots[this->slot].epoch.store(global_epoch.load(), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+EpochGuard::~EpochGuard()
+{
+    if(this->slot >= 0 && --thread_epoch.depth == 0)
+        slots[this->slot].epoch.store(0, std::memory_order_release);
+}
+
+static void free_destroy(void * p)
+{
+    free(p);
+}
+
+// takes the retired entries that every current reader entered after.  call
+// with retired_mu held.
+static void collect(std::vector<EpochRetired> & freeable)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    int used = slots_used.load();
+    for(int i = 0; i < used; i++)
+    {
+        uint64_t e = slots[i].epoch.load();
+        if(e && e < oldest)
+            oldest = e;
+    }
+
+    while(!retired.empty() && retired.front().epoch < oldest)
+    {
+        freeable.push_back(retired.front());
+        retired.pop_front();
+    }
+}
+
+// destroying something may retire more, so it happens unlocked.
+static void destroy_all(const std::vector<EpochRetired> & freeable)
+{
+    for(size_t i = 0; i < freeable.size(); i++)
+        freeable[i].destroy(freeable[i].p);
+}
+
+void epoch_retire(void * p, void (*destroy)(void *))
+{
+    if(!p)
+        return;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!readers_seen.load(std::memory_order_relaxed))
+    {
+        destroy(p);
+        return;
+    }
+
+    std::vector<EpochRetired> freeable;
+    {
+        std::lock_guard<std::mutex> lock(retired_mu);
+        EpochRetired r = { p, destroy, global_epoch.fetch_add(1) };
+        retired.push_back(r);
+        if(retired.size() >= EPOCH_RECLAIM_BATCH)
+            collect(freeable);
+    }
+    destroy_all(freeable);
+}
+
+void epoch_free(void * p)
+{
+    epoch_retire(p, free_destroy);
+}
+
+void epoch_reclaim()
+{
+    std::vector<EpochRetired> freeable;
+    {
+        std::lock_guard<std::mutex> lock(retired_mu);
+        collect(freeable);
+    }
+    destroy_all(freeable);
+}
+
+int64_t epoch_pending()
+{
+    std::lock_guard<std::mutex> lock(retired_mu);
+    return retired.size();
+}
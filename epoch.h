@@ -0,0 +1,49 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stdint.h>
+
+// epoch-based reclamation, for memory that threads read without a lock.
+//
+// a reader holds an EpochGuard while it looks at shared memory.  anything
+// freed in the meantime by someone else (with epoch_free() or epoch_retire()
+// rather than free() or delete) is set aside until every reader that might
+// have seen it has let go, so a reader never touches freed memory, however
+// stale what it reads may be.  checking that what it read is current is up
+// to the reader.
+//
+// while no thread has ever held a guard, frees happen straight away, so code
+// that has no lock-free readers pays nothing for this.
+
+// readers past this many threads at once don't get a guard, and should take
+// the lock instead.
+#ifndef EPOCH_MAX_READERS
+#define EPOCH_MAX_READERS 256
+#endif
+
+// set-aside frees are looked at again once there are this many.
+#define EPOCH_RECLAIM_BATCH 64
+
+class EpochGuard {
+private:
+    int slot;
+
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+    // false if there was no slot for this thread.
+    bool entered() const { return this->slot >= 0; }
+};
+
+void epoch_retire(void * p, void (*destroy)(void *));
+void epoch_free(void * p);
+
+// frees whatever no reader can still see.  called every so often anyway, so
+// that a quiet moment doesn't leave big arrays waiting.
+void epoch_reclaim();
+
+// set aside, and not yet freed.
+int64_t epoch_pending();
+
+#endif
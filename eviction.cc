@@ -0,0 +1,187 @@
+#include <assert.h>
+
+#include "bitbox.h"
+#include "eviction.h"
+
+EvictionPolicy::EvictionPolicy()
+    : bytes(0)
+{
+}
+
+EvictionPolicy * EvictionPolicy::create(const std::string & name)
+{
+    if(name == "lru")
+        return new LruPolicy();
+    if(name == "tinylfu")
+        return new TinyLfuPolicy();
+    if(name == "gdsf")
+        return new GdsfPolicy();
+    return NULL;
+}
+
+// moves b to its place in the queue for the given priority.
+void EvictionPolicy::place(Bitarray * b, Entry & e, double priority)
+{
+    if(e.position != this->queue.end())
+        this->queue.erase(e.position);
+    e.position = this->queue.insert(std::make_pair(priority, b)).first;
+}
+
+void EvictionPolicy::set_size(Bitarray * b, Entry & e, int64_t size)
+{
+    if(e.size == size)
+        return;
+    this->by_size.erase(std::make_pair(e.size, b));
+    this->by_size.insert(std::make_pair(size, b));
+    this->bytes += size - e.size;
+    e.size = size;
+}
+
+void EvictionPolicy::added(Bitarray * b, int64_t size)
+{
+    assert(!this->entries.count(b));
+    Entry & e = this->entries[b];
+    e.position = this->queue.end();
+    e.size = size;
+    e.uses = 1;
+    this->bytes += size;
+    this->by_size.insert(std::make_pair(size, b));
+    this->place(b, e, this->priority(b, e));
+}
+
+void EvictionPolicy::accessed(Bitarray * b, int64_t size)
+{
+    EvictionPolicy::entry_map_t::iterator it = this->entries.find(b);
+    assert(it != this->entries.end());
+    Entry & e = it->second;
+    this->set_size(b, e, size);
+    e.uses++;
+    this->place(b, e, this->priority(b, e));
+}
+
+// a change in size isn't a use, so only a policy that cares about size
+// moves the array.
+void EvictionPolicy::resized(Bitarray * b, int64_t size)
+{
+    EvictionPolicy::entry_map_t::iterator it = this->entries.find(b);
+    assert(it != this->entries.end());
+    this->set_size(b, it->second, size);
+}
+
+void EvictionPolicy::removed(Bitarray * b)
+{
+    EvictionPolicy::entry_map_t::iterator it = this->entries.find(b);
+    if(it == this->entries.end())
+        return;
+    this->bytes -= it->second.size;
+    this->by_size.erase(std::make_pair(it->second.size, b));
+    this->queue.erase(it->second.position);
+    this->entries.erase(it);
+}
+
+void EvictionPolicy::clear()
+{
+    this->queue.clear();
+    this->entries.clear();
+    this->by_size.clear();
+    this->bytes = 0;
+}
+
+Bitarray * EvictionPolicy::victim()
+{
+    return this->queue.empty() ? NULL : this->queue.begin()->second;
+}
+
+void EvictionPolicy::largest(size_t count, std::vector<std::pair<Bitarray *, int64_t> > & arrays) const
+{
+    for(size_order_t::const_reverse_iterator it = this->by_size.rbegin(); it != this->by_size.rend() && count; ++it, count--)
+        arrays.push_back(std::make_pair(it->second, it->first));
+}
+
+// lru
+
+double LruPolicy::priority(Bitarray * b, const Entry & e)
+{
+    return ++this->tick;
+}
+
+// tinylfu
+
+TinyLfuPolicy::TinyLfuPolicy()
+    : sketch(EVICTION_SKETCH_ROWS << EVICTION_SKETCH_WIDTH_BITS), samples(0)
+{
+}
+
+// each row takes its own EVICTION_SKETCH_WIDTH_BITS bits of the key's hash.
+#define SKETCH_SLOT(hash, row) \
+    (((row) << EVICTION_SKETCH_WIDTH_BITS) + \
+     (((hash) >> ((row) * EVICTION_SKETCH_WIDTH_BITS)) & ((1 << EVICTION_SKETCH_WIDTH_BITS) - 1)))
+
+int TinyLfuPolicy::estimate(Bitarray * b) const
+{
+    uint64_t hash = KeyTable::hash_key(b->key, b->keylen);
+    int n = 255;
+    for(int row = 0; row < EVICTION_SKETCH_ROWS; row++)
+        n = MIN(n, this->sketch[SKETCH_SLOT(hash, row)]);
+    return n;
+}
+
+void TinyLfuPolicy::count(Bitarray * b)
+{
+    uint64_t hash = KeyTable::hash_key(b->key, b->keylen);
+    for(int row = 0; row < EVICTION_SKETCH_ROWS; row++)
+    {
+        uint8_t & n = this->sketch[SKETCH_SLOT(hash, row)];
+        if(n < 255)
+            n++;
+    }
+
+    if(++this->samples >= EVICTION_SKETCH_RESET_SAMPLES)
+    {
+        for(size_t i = 0; i < this->sketch.size(); i++)
+            this->sketch[i] >>= 1;
+        this->samples /= 2;
+    }
+}
+
+void TinyLfuPolicy::accessed(Bitarray * b, int64_t size)
+{
+    this->count(b);
+    LruPolicy::accessed(b, size);
+}
+
+void TinyLfuPolicy::added(Bitarray * b, int64_t size)
+{
+    Bitarray * front = this->queue.empty() ? NULL : this->queue.begin()->second;
+    this->count(b);
+    LruPolicy::added(b, size);
+
+    // not admitted: it goes first, unless it's used again before then.
+    if(front && this->estimate(b) <= this->estimate(front))
+        this->place(b, this->entries[b], this->queue.begin()->first - 1);
+}
+
+// gdsf
+
+double GdsfPolicy::priority(Bitarray * b, const Entry & e)
+{
+    double size = MAX(e.size, 1);
+    return this->inflation + e.uses * (size + EVICTION_GDSF_LOAD_OVERHEAD) / size;
+}
+
+void GdsfPolicy::resized(Bitarray * b, int64_t size)
+{
+    Entry & e = this->entries[b];
+    if(e.size == size)
+        return;
+    EvictionPolicy::resized(b, size);
+    this->place(b, e, this->priority(b, e));
+}
+
+Bitarray * GdsfPolicy::victim()
+{
+    if(this->queue.empty())
+        return NULL;
+    this->inflation = this->queue.begin()->first;
+    return this->queue.begin()->second;
+}
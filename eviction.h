@@ -0,0 +1,124 @@
+#ifndef __EVICTION_H__
+#define __EVICTION_H__
+
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct Bitarray;
+
+// decides which array Bitbox writes out of memory next.  Bitbox tells it
+// about each array that comes into memory, is used, changes size, or leaves,
+// along with how many bytes of memory the array takes up at the time.
+//
+// arrays are kept in order of a priority that the policy works out whenever
+// one arrives or is used, and the lowest goes first.  they're also kept in
+// order of size, for reporting the biggest.  the policies are:
+//
+//   lru      least recently used first.
+//   tinylfu  lru, but an array that arrives is put at the front of the line
+//            instead of the back unless it has been used more often, lately,
+//            than the array it would push out.  use counts are kept in a
+//            small count-min sketch, which remembers keys after they leave
+//            memory and is halved now and then so old history fades.
+//   gdsf     greedy dual size frequency: uses * cost / size, plus an
+//            inflation value that rises to each evicted array's priority so
+//            that arrays which stop being used eventually go.  the cost of
+//            reloading an array is taken as its size plus
+//            EVICTION_GDSF_LOAD_OVERHEAD bytes, so small arrays that are used
+//            often are the last to go and big cold ones the first.
+
+#define EVICTION_DEFAULT_POLICY        "lru"
+#define EVICTION_GDSF_LOAD_OVERHEAD    (64*1024)
+#define EVICTION_SKETCH_WIDTH_BITS     16
+#define EVICTION_SKETCH_ROWS           4
+#define EVICTION_SKETCH_RESET_SAMPLES  (10 << EVICTION_SKETCH_WIDTH_BITS)
+
+class EvictionPolicy {
+protected:
+    typedef std::set<std::pair<double, Bitarray *> > queue_t;
+    struct Entry {
+        queue_t::iterator position;
+        int64_t size;
+        int64_t uses; // since it came into memory
+    };
+    typedef std::unordered_map<Bitarray *, Entry> entry_map_t;
+    typedef std::set<std::pair<int64_t, Bitarray *> > size_order_t;
+
+    queue_t queue;
+    entry_map_t entries;
+    size_order_t by_size;
+    int64_t bytes;
+
+    virtual double priority(Bitarray * b, const Entry & e) = 0;
+    void place(Bitarray * b, Entry & e, double priority);
+    void set_size(Bitarray * b, Entry & e, int64_t size);
+
+public:
+    EvictionPolicy();
+    virtual ~EvictionPolicy() {}
+
+    // one of the policies above by name, or NULL if there's no such policy.
+    static EvictionPolicy * create(const std::string & name);
+    virtual const char * name() const = 0;
+
+    virtual void added(Bitarray * b, int64_t size);
+    virtual void accessed(Bitarray * b, int64_t size);
+    virtual void resized(Bitarray * b, int64_t size);
+    void removed(Bitarray * b);
+    void clear();
+
+    // the array to evict next, or NULL if there are none.  the caller
+    // should then say it's removed().
+    virtual Bitarray * victim();
+
+    // up to count of the biggest arrays, biggest first, with their sizes.
+    void largest(size_t count, std::vector<std::pair<Bitarray *, int64_t> > & arrays) const;
+
+    size_t size() const { return this->entries.size(); }
+    int64_t memory_bytes() const { return this->bytes; }
+};
+
+class LruPolicy : public EvictionPolicy {
+protected:
+    int64_t tick;
+    double priority(Bitarray * b, const Entry & e);
+
+public:
+    LruPolicy() : tick(0) {}
+    const char * name() const { return "lru"; }
+};
+
+class TinyLfuPolicy : public LruPolicy {
+private:
+    std::vector<uint8_t> sketch; // EVICTION_SKETCH_ROWS rows, one after another
+    int64_t samples;
+
+    int estimate(Bitarray * b) const;
+    void count(Bitarray * b);
+
+public:
+    TinyLfuPolicy();
+    const char * name() const { return "tinylfu"; }
+    void added(Bitarray * b, int64_t size);
+    void accessed(Bitarray * b, int64_t size);
+};
+
+class GdsfPolicy : public EvictionPolicy {
+private:
+    double inflation;
+
+protected:
+    double priority(Bitarray * b, const Entry & e);
+
+public:
+    GdsfPolicy() : inflation(0) {}
+    const char * name() const { return "gdsf"; }
+    void resized(Bitarray * b, int64_t size);
+    Bitarray * victim();
+};
+
+#endif
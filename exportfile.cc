@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+extern "C" {
+#include <lzf.h>
+}
+
+#include "exportfile.h"
+
+#define RECORD_KEY    'K'
+#define RECORD_CHUNK  'C'
+#define RECORD_END    'E'
+
+// writer
+
+ExportWriter::ExportWriter()
+    : f(NULL), keys(0)
+{
+    this->compressed = (uint8_t *)malloc(EXPORT_CHUNK_SIZE);
+    assert(this->compressed);
+}
+
+ExportWriter::~ExportWriter()
+{
+    if(this->f)
+    {
+        fclose(this->f);
+        unlink((this->filename + ".tmp").c_str());
+    }
+    free(this->compressed);
+}
+
+bool ExportWriter::open(const std::string & filename)
+{
+    this->filename = filename;
+    this->f = fopen((filename + ".tmp").c_str(), "wb");
+    if(!this->f)
+        return false;
+
+    uint32_t version = EXPORT_VERSION;
+    fwrite(EXPORT_MAGIC, 1, strlen(EXPORT_MAGIC), this->f);
+    fwrite(&version, sizeof(version), 1, this->f);
+    return true;
+}
+
+void ExportWriter::add_key(const std::string & key, int64_t first_byte, int64_t nbytes)
+{
+    uint8_t type = RECORD_KEY;
+    uint32_t keylen = key.size();
+    fwrite(&type, sizeof(type), 1, this->f);
+    fwrite(&keylen, sizeof(keylen), 1, this->f);
+    fwrite(key.data(), 1, keylen, this->f);
+    fwrite(&first_byte, sizeof(first_byte), 1, this->f);
+    fwrite(&nbytes, sizeof(nbytes), 1, this->f);
+    this->keys++;
+}
+
+void ExportWriter::add_chunk(int64_t byte, const uint8_t * data, int64_t size)
+{
+    assert(size > 0 && size <= EXPORT_CHUNK_SIZE);
+
+    uint32_t bufsize = lzf_compress(data, size, this->compressed, size);
+    uint8_t is_compressed = bufsize > 0;
+    if(!is_compressed)
+        bufsize = size;
+
+    uint8_t type = RECORD_CHUNK;
+    uint32_t size32 = size;
+    fwrite(&type, sizeof(type), 1, this->f);
+    fwrite(&byte, sizeof(byte), 1, this->f);
+    fwrite(&size32, sizeof(size32), 1, this->f);
+    fwrite(&is_compressed, sizeof(is_compressed), 1, this->f);
+    fwrite(&bufsize, sizeof(bufsize), 1, this->f);
+    fwrite(is_compressed ? this->compressed : data, 1, bufsize, this->f);
+}
+
+bool ExportWriter::close()
+{
+    uint8_t type = RECORD_END;
+    fwrite(&type, sizeof(type), 1, this->f);
+    fwrite(&this->keys, sizeof(this->keys), 1, this->f);
+
+    bool ok = !ferror(this->f);
+    ok = fclose(this->f) == 0 && ok;
+    this->f = NULL;
+
+    std::string tmp = this->filename + ".tmp";
+    if(ok)
+        ok = rename(tmp.c_str(), this->filename.c_str()) == 0;
+    if(!ok)
+        unlink(tmp.c_str());
+    return ok;
+}
+
+// reader
+
+ExportReader::ExportReader()
+    : f(NULL), peeked(-1), done(false), keys(0), err(NULL)
+{
+    this->compressed = (uint8_t *)malloc(EXPORT_CHUNK_SIZE);
+    this->chunk = (uint8_t *)malloc(EXPORT_CHUNK_SIZE);
+    assert(this->compressed && this->chunk);
+}
+
+ExportReader::~ExportReader()
+{
+    if(this->f)
+        fclose(this->f);
+    free(this->compressed);
+    free(this->chunk);
+}
+
+bool ExportReader::fail(const char * err)
+{
+    if(!this->err)
+        this->err = err;
+    return false;
+}
+
+bool ExportReader::open(const std::string & filename)
+{
+    this->f = fopen(filename.c_str(), "rb");
+    if(!this->f)
+        return this->fail("can't open the file");
+
+    char magic[sizeof(EXPORT_MAGIC) - 1];
+    uint32_t version;
+    if(fread(magic, 1, sizeof(magic), this->f) != sizeof(magic) || memcmp(magic, EXPORT_MAGIC, sizeof(magic)))
+        return this->fail("not an export file");
+    if(fread(&version, sizeof(version), 1, this->f) != 1 || version != EXPORT_VERSION)
+        return this->fail("unknown export version");
+    return true;
+}
+
+int ExportReader::next_type()
+{
+    if(this->peeked == -1)
+    {
+        uint8_t type;
+        if(!this->f || this->err || fread(&type, sizeof(type), 1, this->f) != 1)
+            type = 0;
+        this->peeked = type;
+    }
+    return this->peeked;
+}
+
+bool ExportReader::next_key(std::string & key, int64_t * first_byte, int64_t * nbytes)
+{
+    // skip whatever's left of the last key.
+    while(this->next_type() == RECORD_CHUNK)
+    {
+        int64_t byte;
+        const uint8_t * data;
+        int64_t size;
+        if(!this->next_chunk(&byte, &data, &size))
+            return false;
+    }
+
+    int type = this->next_type();
+    this->peeked = -1;
+    if(type == RECORD_END)
+    {
+        int64_t keys;
+        if(fread(&keys, sizeof(keys), 1, this->f) != 1 || keys != this->keys)
+            return this->fail("the trailer doesn't match the keys read");
+        this->done = true;
+        return false;
+    }
+    if(type != RECORD_KEY)
+        return this->fail(this->done ? "data after the trailer" : "cut short");
+
+    uint32_t keylen;
+    if(fread(&keylen, sizeof(keylen), 1, this->f) != 1)
+        return this->fail("cut short");
+    key.resize(keylen);
+    if((keylen && fread(&key[0], 1, keylen, this->f) != keylen) ||
+            fread(first_byte, sizeof(int64_t), 1, this->f) != 1 ||
+            fread(nbytes, sizeof(int64_t), 1, this->f) != 1)
+        return this->fail("cut short");
+
+    this->keys++;
+    return true;
+}
+
+bool ExportReader::next_chunk(int64_t * byte, const uint8_t ** data, int64_t * size)
+{
+    if(this->next_type() != RECORD_CHUNK)
+        return false;
+    this->peeked = -1;
+
+    uint32_t size32, bufsize;
+    uint8_t is_compressed;
+    if(fread(byte, sizeof(int64_t), 1, this->f) != 1 ||
+            fread(&size32, sizeof(size32), 1, this->f) != 1 ||
+            fread(&is_compressed, sizeof(is_compressed), 1, this->f) != 1 ||
+            fread(&bufsize, sizeof(bufsize), 1, this->f) != 1)
+        return this->fail("cut short");
+    if(size32 == 0 || size32 > EXPORT_CHUNK_SIZE || bufsize > EXPORT_CHUNK_SIZE || (!is_compressed && bufsize != size32))
+        return this->fail("bad chunk");
+
+    uint8_t * buffer = is_compressed ? this->compressed : this->chunk;
+    if(fread(buffer, 1, bufsize, this->f) != bufsize)
+        return this->fail("cut short");
+    if(is_compressed && lzf_decompress(this->compressed, bufsize, this->chunk, size32) != size32)
+        return this->fail("bad chunk");
+
+    *data = this->chunk;
+    *size = size32;
+    return true;
+}
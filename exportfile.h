@@ -0,0 +1,95 @@
+#ifndef __EXPORTFILE_H__
+#define __EXPORTFILE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// the export format: every key's bits, for reading without a server.  it
+// depends on nothing but lzf, so analytics jobs can build it on its own.
+// integers are in native byte order.
+//
+//     header   "BBEXPORT", uint32 version (EXPORT_VERSION)
+//
+//     then a record for each key, in no particular order:
+//
+//         'K', uint32 keylen, key, int64 first_byte, int64 nbytes
+//
+//     the key's bits are in bytes [first_byte, first_byte + nbytes), bit i
+//     being (byte[i / 8] >> (i % 8)) & 1.  its bytes follow in chunks of at
+//     most EXPORT_CHUNK_SIZE, in order, leaving out chunks that are all zero:
+//
+//         'C', int64 byte, uint32 size, uint8 is_compressed, uint32 bufsize, buffer
+//
+//     where the buffer is size bytes starting at byte, lzf-compressed if
+//     is_compressed.
+//
+//     trailer  'E', int64 number of keys
+//
+// a file without its trailer was cut short.  a key's bytes never reach past
+// first_byte + nbytes, and anything not in a chunk is zero.
+
+#define EXPORT_MAGIC       "BBEXPORT"
+#define EXPORT_VERSION     1
+#define EXPORT_CHUNK_SIZE  (64*1024)
+
+// writes an export to filename.  it's written as filename.tmp and renamed
+// into place by close(), so a file by that name is always complete.
+class ExportWriter {
+private:
+    FILE * f;
+    std::string filename;
+    int64_t keys;
+    uint8_t * compressed;
+
+public:
+    ExportWriter();
+    ~ExportWriter();
+
+    bool open(const std::string & filename);
+    void add_key(const std::string & key, int64_t first_byte, int64_t nbytes);
+    void add_chunk(int64_t byte, const uint8_t * data, int64_t size);
+    bool close();
+
+    int64_t key_count() const { return this->keys; }
+};
+
+// reads an export a chunk at a time, in constant memory:
+//
+//     ExportReader r;
+//     if(!r.open(filename)) ...
+//     while(r.next_key(key, &first_byte, &nbytes))
+//         while(r.next_chunk(&byte, &data, &size))
+//             ...
+//     if(!r.complete()) ...  // r.error() says why
+//
+// chunks that next_key() passes over unread are skipped.
+class ExportReader {
+private:
+    FILE * f;
+    int peeked; // the type of the next record, once it's been read, or -1
+    bool done;
+    int64_t keys;
+    const char * err;
+    uint8_t * compressed;
+    uint8_t * chunk;
+
+    int next_type();
+    bool fail(const char * err);
+
+public:
+    ExportReader();
+    ~ExportReader();
+
+    bool open(const std::string & filename);
+    bool next_key(std::string & key, int64_t * first_byte, int64_t * nbytes);
+
+    // data is good until the next call.
+    bool next_chunk(int64_t * byte, const uint8_t ** data, int64_t * size);
+
+    // true once the trailer's been read and matched the keys seen.
+    bool complete() const { return this->done && !this->err; }
+    const char * error() const { return this->err; }
+};
+
+#endif
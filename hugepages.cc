@@ -0,0 +1,233 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <map>
+#include <mutex>
+#include <set>
+
+#include "hugepages.h"
+
+#define BLOCKS_PER_REGION (HUGE_REGION_SIZE / HUGE_BLOCK_SIZE)
+#define ALL_BLOCKS ((uint32_t)((1ULL << BLOCKS_PER_REGION) - 1))
+
+static_assert(BLOCKS_PER_REGION <= 32, "a region's blocks must fit in a uint32_t mask");
+
+struct HugeRegion {
+    uint8_t * base;
+    size_t size;
+    bool shared;    // split into blocks, rather than a single big allocation
+    uint32_t used;  // blocks handed out
+    uint32_t dirty; // blocks written to since the region was mapped or released
+    uint8_t runs[BLOCKS_PER_REGION]; // at each allocation's first block, how many blocks it has
+};
+
+static std::mutex mu;
+static std::map<uintptr_t, HugeRegion *> regions; // by base address
+static std::set<HugeRegion *> open;               // shared regions with a free block
+static int spare = 0;                             // shared regions with no blocks in use
+static int64_t mapped_bytes = 0;
+static int64_t used_bytes = 0;
+
+size_t huge_rounded(size_t size)
+{
+    if(size > HUGE_REGION_SIZE)
+        return (size + HUGE_REGION_SIZE - 1) / HUGE_REGION_SIZE * HUGE_REGION_SIZE;
+    return ((size ? size : 1) + HUGE_BLOCK_SIZE - 1) / HUGE_BLOCK_SIZE * HUGE_BLOCK_SIZE;
+}
+
+// mmap() only promises page alignment, so this maps a region's worth more
+// than it needs and trims off either end.
+static uint8_t * map_aligned(size_t size)
+{
+    size_t len = size + HUGE_REGION_SIZE;
+    uint8_t * p = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+
+    uint8_t * base = (uint8_t *)(((uintptr_t)p + HUGE_REGION_SIZE - 1) & ~(uintptr_t)(HUGE_REGION_SIZE - 1));
+    if(base > p)
+        munmap(p, base - p);
+    if(p + len > base + size)
+        munmap(base + size, p + len - (base + size));
+
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    return base;
+}
+
+static HugeRegion * add_region(uint8_t * base, size_t size, bool shared)
+{
+    HugeRegion * r = new HugeRegion();
+    r->base = base;
+    r->size = size;
+    r->shared = shared;
+    r->used = 0;
+    r->dirty = 0;
+    memset(r->runs, 0, sizeof(r->runs));
+    regions[(uintptr_t)base] = r;
+    mapped_bytes += size;
+    return r;
+}
+
+static void remove_region(HugeRegion * r)
+{
+    regions.erase((uintptr_t)r->base);
+    open.erase(r);
+    mapped_bytes -= r->size;
+}
+
+static uint32_t run_mask(int start, int n)
+{
+    return (uint32_t)(((1ULL << n) - 1) << start);
+}
+
+static int find_run(uint32_t used, int n)
+{
+    for(int start = 0; start + n <= BLOCKS_PER_REGION; start++)
+        if(!(used & run_mask(start, n)))
+            return start;
+    return -1;
+}
+
+void * huge_alloc(size_t size)
+{
+    size_t rounded = huge_rounded(size);
+    std::unique_lock<std::mutex> lock(mu);
+
+    if(rounded > HUGE_REGION_SIZE)
+    {
+        uint8_t * base = map_aligned(rounded);
+        if(!base)
+            return calloc(size, 1);
+        add_region(base, rounded, false)->used = ALL_BLOCKS;
+        used_bytes += rounded;
+        return base;
+    }
+
+    // partly used regions come first, so that empty ones can be released.
+    int n = rounded / HUGE_BLOCK_SIZE;
+    HugeRegion * r = NULL;
+    int start = -1;
+    for(std::set<HugeRegion *>::iterator it = open.begin(); it != open.end() && !r; ++it)
+        if((*it)->used && (start = find_run((*it)->used, n)) >= 0)
+            r = *it;
+    for(std::set<HugeRegion *>::iterator it = open.begin(); it != open.end() && !r; ++it)
+        if(!(*it)->used)
+        {
+            r = *it;
+            start = 0;
+            spare--;
+        }
+    if(!r)
+    {
+        uint8_t * base = map_aligned(HUGE_REGION_SIZE);
+        if(!base)
+            return calloc(size, 1);
+        r = add_region(base, HUGE_REGION_SIZE, true);
+        open.insert(r);
+        start = 0;
+    }
+
+    uint32_t mask = run_mask(start, n);
+    uint32_t stale = r->dirty & mask;
+    r->used |= mask;
+    r->dirty |= mask;
+    r->runs[start] = n;
+    if(r->used == ALL_BLOCKS)
+        open.erase(r);
+    used_bytes += rounded;
+
+    uint8_t * p = r->base + start * HUGE_BLOCK_SIZE;
+    lock.unlock();
+
+    // the blocks are ours now, so whatever an earlier allocation left in
+    // them can be cleared without the lock.
+    for(int i = start; i < start + n; i++)
+        if(stale & (1U << i))
+            memset(r->base + i * HUGE_BLOCK_SIZE, 0, HUGE_BLOCK_SIZE);
+    return p;
+}
+
+void huge_free(void * p)
+{
+    if(!p)
+        return;
+
+    std::unique_lock<std::mutex> lock(mu);
+    HugeRegion * r = NULL;
+    std::map<uintptr_t, HugeRegion *>::iterator it = regions.upper_bound((uintptr_t)p);
+    if(it != regions.begin())
+    {
+        --it;
+        if((uint8_t *)p < it->second->base + it->second->size)
+            r = it->second;
+    }
+    if(!r)
+    {
+        lock.unlock();
+        free(p);
+        return;
+    }
+
+    if(!r->shared)
+    {
+        remove_region(r);
+        used_bytes -= r->size;
+        lock.unlock();
+        munmap(r->base, r->size);
+        delete r;
+        return;
+    }
+
+    int start = ((uint8_t *)p - r->base) / HUGE_BLOCK_SIZE;
+    int n = r->runs[start];
+    assert(n && (uint8_t *)p == r->base + start * HUGE_BLOCK_SIZE);
+    r->runs[start] = 0;
+    r->used &= ~run_mask(start, n);
+    used_bytes -= n * HUGE_BLOCK_SIZE;
+    open.insert(r);
+    if(r->used)
+        return;
+
+    if(spare >= HUGE_SPARE_REGIONS)
+    {
+        remove_region(r);
+        lock.unlock();
+        munmap(r->base, r->size);
+        delete r;
+        return;
+    }
+
+    // the pages go back to the OS, but the mapping stays for reuse, and
+    // reads as zeros until it's written again.
+    madvise(r->base, r->size, MADV_DONTNEED);
+    r->dirty = 0;
+    spare++;
+}
+
+void huge_stats(std::map<std::string, int64_t> & stats)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stats["huge_regions"] = regions.size();
+        stats["huge_mapped_bytes"] = mapped_bytes;
+        stats["huge_used_bytes"] = used_bytes;
+    }
+
+    int64_t backed = 0;
+    FILE * f = fopen("/proc/self/smaps_rollup", "r");
+    if(f)
+    {
+        char line[256];
+        long long kb;
+        while(fgets(line, sizeof(line), f))
+            if(sscanf(line, "AnonHugePages: %lld kB", &kb) == 1)
+                backed = kb * 1024;
+        fclose(f);
+    }
+    stats["huge_backed_bytes"] = backed;
+}
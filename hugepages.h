@@ -0,0 +1,37 @@
+#ifndef __HUGEPAGES_H__
+#define __HUGEPAGES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+
+// storage for big array buffers, carved out of 2 MB-aligned regions that the
+// kernel is asked to back with transparent huge pages, so that random reads
+// across a big array don't miss the TLB on every one.
+//
+// a region is split into blocks, and each allocation takes a run of them.
+// anything bigger than a region gets a region of its own, unmapped when it's
+// freed.  a region is only handed back to the OS (with MADV_DONTNEED) once
+// all of its blocks are free: releasing part of one would break up its huge
+// page.  a few empty regions stay mapped, so that the next allocations don't
+// each have to map one.
+
+#define HUGE_REGION_SIZE    (2*1024*1024)
+#define HUGE_BLOCK_SIZE     (64*1024)
+#define HUGE_SPARE_REGIONS  4
+
+// zeroed, like calloc().  if a region can't be mapped it comes from calloc()
+// instead, which huge_free() copes with.
+void * huge_alloc(size_t size);
+void huge_free(void * p);
+
+// how much of a region an allocation of this size takes up.
+size_t huge_rounded(size_t size);
+
+// huge_regions, huge_mapped_bytes and huge_used_bytes for the allocator, and
+// huge_backed_bytes: how much of the process the kernel has actually put on
+// huge pages, from /proc/self/smaps_rollup.
+void huge_stats(std::map<std::string, int64_t> & stats);
+
+#endif
@@ -0,0 +1,572 @@
+// bitbox-import: loads bits straight into data/, without a server, for
+// backfills too big to send through set_bits.  run it where the server runs
+// (or give it -d) while the server is stopped.  bits for keys that are
+// already in data/ are added to what's there.
+//
+//     bitbox-import [-d dir] [-b] [-M megabytes] [-T tmpdir] [-t threads] file ...
+//
+// text input is a line per key: the key, then any number of bit positions,
+// separated by whitespace.  with -b, the input is binary records of
+//
+//     uint32 keylen, key, uint32 nbits, nbits * int64 bit
+//
+// in native byte order.  "-" reads stdin.  the input doesn't need to be
+// sorted or grouped by key, and a key can turn up any number of times.
+//
+// bits are gathered in memory up to -M megabytes, then sorted and spilled to
+// a run file in tmpdir (default data/.import) as delta-encoded varints.  at
+// the end the runs and whatever is still in memory are merged a key at a
+// time, each key's Bitarray is built with room for all of its bits up
+// front, and the finished arrays are compressed and written by a pool of
+// threads in the server's own file format.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bitbox.h"
+#include "workerpool.h"
+
+#define IMPORT_DEFAULT_MEGABYTES  1024
+#define IMPORT_KEY_OVERHEAD       64   // bytes of bookkeeping per key in a SortBuffer
+#define IMPORT_WRITE_BATCH        256  // finished arrays handed to the pool at a time
+#define IMPORT_IO_BUFFER          (1024*1024)
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// a key the server could store: it becomes a file name in data/, and names
+// starting with a dot are the server's own.
+static bool valid_key(const char * key, size_t keylen)
+{
+    return keylen > 0 && key[0] != '.' && !memchr(key, '/', keylen) && !memchr(key, '\0', keylen);
+}
+
+// bits gathered in memory.  each key is stored once and bits refer to it by
+// number; sort() renumbers the keys in name order and sorts the bits by key
+// and position, after which nothing more can be added.
+struct PendingBit {
+    uint32_t key;
+    int64_t bit;
+
+    bool operator<(const PendingBit & other) const
+    {
+        return this->key != other.key ? this->key < other.key : this->bit < other.bit;
+    }
+    bool operator==(const PendingBit & other) const
+    {
+        return this->key == other.key && this->bit == other.bit;
+    }
+};
+
+struct SortBuffer {
+    std::vector<std::string> keys;
+    std::unordered_map<std::string, uint32_t> key_ids;
+    std::vector<PendingBit> bits;
+    int64_t bytes;
+
+    SortBuffer() : bytes(0) {}
+
+    void add(const std::string & key, int64_t bit)
+    {
+        std::unordered_map<std::string, uint32_t>::iterator it = this->key_ids.find(key);
+        if(it == this->key_ids.end())
+        {
+            it = this->key_ids.insert(std::make_pair(key, (uint32_t)this->keys.size())).first;
+            this->keys.push_back(key);
+            this->bytes += 2 * key.size() + IMPORT_KEY_OVERHEAD;
+        }
+        PendingBit p = { it->second, bit };
+        this->bits.push_back(p);
+        this->bytes += sizeof(PendingBit);
+    }
+
+    void sort()
+    {
+        std::vector<uint32_t> by_name(this->keys.size());
+        for(size_t i = 0; i < by_name.size(); i++)
+            by_name[i] = i;
+        std::sort(by_name.begin(), by_name.end(),
+                [this](uint32_t a, uint32_t b) { return this->keys[a] < this->keys[b]; });
+
+        std::vector<uint32_t> rank(this->keys.size());
+        std::vector<std::string> sorted_keys(this->keys.size());
+        for(size_t i = 0; i < by_name.size(); i++)
+        {
+            rank[by_name[i]] = i;
+            sorted_keys[i].swap(this->keys[by_name[i]]);
+        }
+        this->keys.swap(sorted_keys);
+        this->key_ids.clear();
+
+        for(size_t i = 0; i < this->bits.size(); i++)
+            this->bits[i].key = rank[this->bits[i].key];
+        std::sort(this->bits.begin(), this->bits.end());
+        this->bits.erase(std::unique(this->bits.begin(), this->bits.end()), this->bits.end());
+    }
+
+    void clear()
+    {
+        std::vector<std::string>().swap(this->keys);
+        this->key_ids.clear();
+        std::vector<PendingBit>().swap(this->bits);
+        this->bytes = 0;
+    }
+};
+
+// a sorted run of bits, read a key at a time in key order.  after
+// next_key() says there's another key, it's in key, with its lowest and
+// highest bits in first and last, and read_bits() sets its bits in an array.
+class Run {
+public:
+    std::string key;
+    int64_t first;
+    int64_t last;
+
+    virtual ~Run() {}
+    virtual bool next_key() = 0;
+    virtual void read_bits(Bitarray * b) = 0;
+};
+
+// the bits left in memory at the end, which don't need to be spilled.
+class MemoryRun : public Run {
+private:
+    SortBuffer & buf;
+    size_t begin;
+    size_t end;
+
+public:
+    MemoryRun(SortBuffer & buf) : buf(buf), begin(0), end(0) {}
+
+    bool next_key()
+    {
+        this->begin = this->end;
+        if(this->begin == this->buf.bits.size())
+            return false;
+
+        uint32_t id = this->buf.bits[this->begin].key;
+        while(this->end < this->buf.bits.size() && this->buf.bits[this->end].key == id)
+            this->end++;
+        this->key = this->buf.keys[id];
+        this->first = this->buf.bits[this->begin].bit;
+        this->last = this->buf.bits[this->end - 1].bit;
+        return true;
+    }
+
+    void read_bits(Bitarray * b)
+    {
+        for(size_t i = this->begin; i < this->end; i++)
+            b->set_bit(this->buf.bits[i].bit);
+    }
+};
+
+// a run spilled to disk, as a record per key of
+//
+//     uint32 keylen, key, int64 nbits, int64 first, int64 last
+//
+// followed by nbits-1 varints, each the distance from the bit before.
+static void put_varint(uint64_t n, FILE * f)
+{
+    while(n >= 0x80)
+    {
+        putc_unlocked((n & 0x7f) | 0x80, f);
+        n >>= 7;
+    }
+    putc_unlocked(n, f);
+}
+
+static uint64_t get_varint(FILE * f)
+{
+    uint64_t n = 0;
+    for(int shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc_unlocked(f);
+        if(c == EOF)
+            break;
+        n |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            break;
+    }
+    return n;
+}
+
+static bool write_run(SortBuffer & buf, const std::string & filename)
+{
+    FILE * f = fopen(filename.c_str(), "wb");
+    if(!f)
+        return false;
+    setvbuf(f, NULL, _IOFBF, IMPORT_IO_BUFFER);
+
+    for(size_t begin = 0, end; begin < buf.bits.size(); begin = end)
+    {
+        uint32_t id = buf.bits[begin].key;
+        for(end = begin; end < buf.bits.size() && buf.bits[end].key == id; end++)
+            ;
+
+        const std::string & key = buf.keys[id];
+        uint32_t keylen = key.size();
+        int64_t header[3] = { (int64_t)(end - begin), buf.bits[begin].bit, buf.bits[end - 1].bit };
+        fwrite(&keylen, sizeof(keylen), 1, f);
+        fwrite(key.data(), 1, keylen, f);
+        fwrite(header, sizeof(header), 1, f);
+        for(size_t i = begin + 1; i < end; i++)
+            put_varint(buf.bits[i].bit - buf.bits[i - 1].bit, f);
+    }
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+class FileRun : public Run {
+private:
+    FILE * f;
+    int64_t nbits;
+
+public:
+    FileRun(FILE * f) : f(f), nbits(0) {}
+    ~FileRun() { fclose(this->f); }
+
+    bool next_key()
+    {
+        uint32_t keylen;
+        int64_t header[3];
+        if(fread(&keylen, sizeof(keylen), 1, this->f) != 1)
+            return false;
+        this->key.resize(keylen);
+        if(fread(&this->key[0], 1, keylen, this->f) != keylen ||
+                fread(header, sizeof(header), 1, this->f) != 1)
+            return false;
+        this->nbits = header[0];
+        this->first = header[1];
+        this->last = header[2];
+        return true;
+    }
+
+    void read_bits(Bitarray * b)
+    {
+        int64_t bit = this->first;
+        b->set_bit(bit);
+        for(int64_t i = 1; i < this->nbits; i++)
+        {
+            bit += get_varint(this->f);
+            b->set_bit(bit);
+        }
+    }
+};
+
+class Importer {
+private:
+    std::string tmpdir;
+    int64_t budget;
+    SortBuffer buf;
+    std::vector<Run *> runs;
+    WorkerPool pool;
+    std::vector<Bitarray *> finished;
+    int64_t finished_bytes;
+
+    void spill();
+    void write_finished();
+
+public:
+    int64_t bits_read;
+    int64_t keys_skipped;
+    int64_t keys_written;
+
+    Importer(const std::string & tmpdir, int64_t budget, int threads)
+        : tmpdir(tmpdir), budget(budget), pool(threads), finished_bytes(0),
+          bits_read(0), keys_skipped(0), keys_written(0) {}
+
+    void add(const std::string & key, int64_t bit)
+    {
+        this->buf.add(key, bit);
+        this->bits_read++;
+        if(this->buf.bytes >= this->budget)
+            this->spill();
+    }
+
+    bool read_text(FILE * f);
+    bool read_binary(FILE * f);
+    void finish();
+};
+
+// sorts what's in memory out to a run file.  the file is unlinked as soon as
+// it's opened again for reading, so nothing is left behind if we die.
+void Importer::spill()
+{
+    this->buf.sort();
+
+    char name[64];
+    snprintf(name, sizeof(name), "/run-%d-%zu", (int)getpid(), this->runs.size());
+    std::string filename = this->tmpdir + name;
+    FILE * f = NULL;
+    if(write_run(this->buf, filename))
+        f = fopen(filename.c_str(), "rb");
+    if(!f)
+    {
+        perror(filename.c_str());
+        exit(1);
+    }
+    unlink(filename.c_str());
+    setvbuf(f, NULL, _IOFBF, IMPORT_IO_BUFFER);
+    this->runs.push_back(new FileRun(f));
+
+    fprintf(stderr, "spilled run %zu: %zu keys, %zu bits.\n", this->runs.size(), this->buf.keys.size(), this->buf.bits.size());
+    this->buf.clear();
+}
+
+bool Importer::read_text(FILE * f)
+{
+    char * line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while((len = getline(&line, &cap, f)) != -1)
+    {
+        char * p = line;
+        char * end = line + len;
+        while(p < end && isspace(*p))
+            p++;
+        char * key = p;
+        while(p < end && !isspace(*p))
+            p++;
+        if(p == key)
+            continue;
+        std::string k(key, p - key);
+        if(!valid_key(k.data(), k.size()))
+        {
+            this->keys_skipped++;
+            continue;
+        }
+
+        while(true)
+        {
+            char * next;
+            errno = 0;
+            long long bit = strtoll(p, &next, 10);
+            if(next == p)
+                break;
+            if(!errno && bit >= 0)
+                this->add(k, bit);
+            p = next;
+        }
+    }
+    free(line);
+    return !ferror(f);
+}
+
+bool Importer::read_binary(FILE * f)
+{
+    std::vector<int64_t> bits;
+    std::string key;
+    uint32_t keylen, nbits;
+    while(fread(&keylen, sizeof(keylen), 1, f) == 1)
+    {
+        key.resize(keylen);
+        if(fread(&key[0], 1, keylen, f) != keylen || fread(&nbits, sizeof(nbits), 1, f) != 1)
+            return false;
+        bits.resize(nbits);
+        if(fread(bits.data(), sizeof(int64_t), nbits, f) != nbits)
+            return false;
+
+        if(!valid_key(key.data(), key.size()))
+        {
+            this->keys_skipped++;
+            continue;
+        }
+        for(uint32_t i = 0; i < nbits; i++)
+            if(bits[i] >= 0)
+                this->add(key, bits[i]);
+    }
+    return !ferror(f);
+}
+
+// adds each finished array to what's on disk for its key, if anything, and
+// writes it out.
+static void save_array(Bitarray * b)
+{
+    Bitarray * existing = Bitarray::find_on_disk(b->key, b->keylen);
+    if(existing)
+    {
+        existing->or_array(b);
+        delete b;
+        b = existing;
+    }
+    b->save_to_disk();
+    delete b;
+}
+
+void Importer::write_finished()
+{
+    std::vector<std::function<void()> > tasks;
+    for(size_t i = 0; i < this->finished.size(); i++)
+        tasks.push_back(std::bind(save_array, this->finished[i]));
+    this->pool.run(tasks);
+
+    this->keys_written += this->finished.size();
+    this->finished.clear();
+    this->finished_bytes = 0;
+}
+
+// merges the runs a key at a time.  a key's bits may be spread over any of
+// them, so its array is sized to cover them all before any are set.
+void Importer::finish()
+{
+    std::vector<Run *> live;
+    MemoryRun memory(this->buf);
+    if(!this->buf.bits.empty())
+    {
+        this->buf.sort();
+        live.push_back(&memory);
+    }
+    for(size_t i = 0; i < this->runs.size(); i++)
+        live.push_back(this->runs[i]);
+    for(size_t i = 0; i < live.size(); )
+        if(live[i]->next_key())
+            i++;
+        else
+            live.erase(live.begin() + i);
+
+    while(!live.empty())
+    {
+        std::string key = live[0]->key;
+        int64_t first = live[0]->first, last = live[0]->last;
+        for(size_t i = 1; i < live.size(); i++)
+        {
+            if(live[i]->key < key)
+            {
+                key = live[i]->key;
+                first = live[i]->first;
+                last = live[i]->last;
+            }
+            else if(live[i]->key == key)
+            {
+                first = MIN(first, live[i]->first);
+                last = MAX(last, live[i]->last);
+            }
+        }
+
+        Bitarray * b = new Bitarray(key.data(), key.size(), first);
+        b->adjust_size_to_reach(last);
+        for(size_t i = 0; i < live.size(); )
+        {
+            if(live[i]->key != key)
+            {
+                i++;
+                continue;
+            }
+            live[i]->read_bits(b);
+            if(live[i]->next_key())
+                i++;
+            else
+                live.erase(live.begin() + i);
+        }
+
+        this->finished.push_back(b);
+        this->finished_bytes += b->memory_size();
+        if(this->finished.size() >= IMPORT_WRITE_BATCH || this->finished_bytes >= this->budget / 2)
+            this->write_finished();
+    }
+    this->write_finished();
+
+    for(size_t i = 0; i < this->runs.size(); i++)
+        delete this->runs[i];
+    this->runs.clear();
+    this->buf.clear();
+}
+
+static void usage(const char * argv0)
+{
+  fprintf(stderr, "usage: %s [-d dir] [-b] [-M megabytes] [-T tmpdir] [-t threads] file ...\n", argv0);
+  fprintf(stderr, "  -d  import into dir/data (default: the current directory)\n");
+  fprintf(stderr, "  -b  the files are binary records, not text\n");
+  fprintf(stderr, "  -M  memory for sorting, in megabytes (default %d)\n", IMPORT_DEFAULT_MEGABYTES);
+  fprintf(stderr, "  -T  where to spill sorted runs (default data/.import)\n");
+  fprintf(stderr, "  -t  threads for writing arrays (default: one per core)\n");
+}
+
+int main(int argc, char **argv) {
+  const char * dir = NULL;
+  const char * tmpdir = "data/.import";
+  bool binary = false;
+  int64_t megabytes = IMPORT_DEFAULT_MEGABYTES;
+  int threads = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "d:bM:T:t:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'd': dir = optarg; break;
+      case 'b': binary = true; break;
+      case 'M': megabytes = atoll(optarg); break;
+      case 'T': tmpdir = optarg; break;
+      case 't': threads = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if(optind == argc || megabytes < 1)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(dir && chdir(dir) == -1)
+  {
+    perror(dir);
+    return 1;
+  }
+  mkdir("data", 0755);
+  if(mkdir(tmpdir, 0755) == -1 && errno != EEXIST)
+  {
+    perror(tmpdir);
+    return 1;
+  }
+
+  double start = now();
+  Importer importer(tmpdir, megabytes * 1024 * 1024, threads);
+  for(int i = optind; i < argc; i++)
+  {
+    bool from_stdin = !strcmp(argv[i], "-");
+    FILE * f = from_stdin ? stdin : fopen(argv[i], "rb");
+    if(!f)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+    setvbuf(f, NULL, _IOFBF, IMPORT_IO_BUFFER);
+    bool ok = binary ? importer.read_binary(f) : importer.read_text(f);
+    if(!from_stdin)
+      fclose(f);
+    if(!ok)
+    {
+      fprintf(stderr, "%s: read error or truncated record\n", argv[i]);
+      return 1;
+    }
+  }
+  fprintf(stderr, "read %" PRId64 " bits in %.1fs, merging.\n", importer.bits_read, now() - start);
+
+  importer.finish();
+  rmdir(tmpdir);
+
+  fprintf(stderr, "imported %" PRId64 " bits into %" PRId64 " keys in %.1fs", importer.bits_read, importer.keys_written, now() - start);
+  if(importer.keys_skipped)
+    fprintf(stderr, ", skipping %" PRId64 " keys that can't be file names", importer.keys_skipped);
+  fprintf(stderr, ".\n");
+
+  return 0;
+}
@@ -0,0 +1,338 @@
+#include <algorithm>
+
+#include "keyindex.h"
+
+static void put_varint(std::string & out, uint64_t v)
+{
+    while(v >= 0x80)
+    {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static uint64_t get_varint(const std::string & in, size_t * pos)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    uint8_t c;
+    do
+    {
+        c = in[(*pos)++];
+        v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+    return v;
+}
+
+// key, as it follows prev.
+static void put_entry(std::string & out, const std::string & prev, const std::string & key)
+{
+    size_t n = std::min(prev.size(), key.size());
+    size_t shared = 0;
+    while(shared < n && prev[shared] == key[shared])
+        shared++;
+
+    put_varint(out, shared);
+    put_varint(out, key.size() - shared);
+    out.append(key, shared, std::string::npos);
+}
+
+// turns key, the key before the entry at *pos, into that entry's key and
+// steps past it.  false at the end of the block.
+static bool next_entry(const std::string & rest, size_t * pos, std::string & key)
+{
+    if(*pos >= rest.size())
+        return false;
+
+    size_t shared = get_varint(rest, pos);
+    size_t len = get_varint(rest, pos);
+    key.resize(shared);
+    key.append(rest, *pos, len);
+    *pos += len;
+    return true;
+}
+
+KeyIndex::KeyIndex()
+    : count(0), encoded_bytes(0)
+{
+}
+
+// the block a key belongs in: the last one whose first key isn't after it, or
+// the first block if they all are.
+KeyIndex::block_map_t::iterator KeyIndex::block_for(const std::string & key)
+{
+    block_map_t::iterator it = this->blocks.upper_bound(key);
+    if(it != this->blocks.begin())
+        --it;
+    return it;
+}
+
+KeyIndex::block_map_t::const_iterator KeyIndex::block_for(const std::string & key) const
+{
+    block_map_t::const_iterator it = this->blocks.upper_bound(key);
+    if(it != this->blocks.begin())
+        --it;
+    return it;
+}
+
+void KeyIndex::decode(block_map_t::const_iterator it, std::vector<std::string> & keys)
+{
+    std::string key = it->first;
+    size_t pos = 0;
+    keys.clear();
+    do
+        keys.push_back(key);
+    while(next_entry(it->second.rest, &pos, key));
+}
+
+// sorted keys [begin, end), spread evenly over as few blocks as will hold
+// them.
+void KeyIndex::add_blocks(const std::vector<std::string> & keys, size_t begin, size_t end)
+{
+    size_t n = end - begin;
+    size_t nblocks = (n + KEYINDEX_BLOCK_KEYS - 1) / KEYINDEX_BLOCK_KEYS;
+    for(size_t i = 0; i < nblocks; i++)
+    {
+        size_t from = begin + n * i / nblocks;
+        size_t to = begin + n * (i + 1) / nblocks;
+
+        Block & b = this->blocks[keys[from]];
+        b.nkeys = to - from;
+        b.rest.clear();
+        for(size_t k = from + 1; k < to; k++)
+            put_entry(b.rest, keys[k - 1], keys[k]);
+        this->encoded_bytes += keys[from].size() + b.rest.size();
+    }
+}
+
+void KeyIndex::remove_block(block_map_t::iterator it)
+{
+    this->encoded_bytes -= it->first.size() + it->second.rest.size();
+    this->blocks.erase(it);
+}
+
+// moves a block whose first key has changed.  the entries are already
+// right for the new first key.
+KeyIndex::block_map_t::iterator KeyIndex::rekey_block(block_map_t::iterator it, const std::string & first)
+{
+    block_map_t::iterator moved = this->blocks.insert(std::make_pair(first, Block())).first;
+    moved->second.nkeys = it->second.nkeys;
+    moved->second.rest.swap(it->second.rest);
+    this->encoded_bytes += first.size();
+    this->encoded_bytes -= it->first.size();
+    this->blocks.erase(it);
+    return moved;
+}
+
+void KeyIndex::split_block(block_map_t::iterator it)
+{
+    std::vector<std::string> keys;
+    KeyIndex::decode(it, keys);
+    this->remove_block(it);
+    this->add_blocks(keys, 0, keys.size());
+}
+
+// folds the next block into this one if they fit together, so that deleting
+// a lot of keys doesn't leave a lot of tiny blocks behind.
+void KeyIndex::merge_next(block_map_t::iterator it)
+{
+    block_map_t::iterator next = it;
+    ++next;
+    if(next == this->blocks.end() || it->second.nkeys + next->second.nkeys > KEYINDEX_BLOCK_KEYS)
+        return;
+
+    std::string last = it->first;
+    size_t pos = 0;
+    while(next_entry(it->second.rest, &pos, last))
+        ;
+
+    Block & b = it->second;
+    size_t before = b.rest.size();
+    put_entry(b.rest, last, next->first);
+    b.rest += next->second.rest;
+    b.nkeys += next->second.nkeys;
+    this->encoded_bytes += b.rest.size() - before;
+    this->remove_block(next);
+}
+
+bool KeyIndex::insert(const std::string & key)
+{
+    block_map_t::iterator it = this->block_for(key);
+    if(it == this->blocks.end())
+    {
+        this->blocks[key].nkeys = 1;
+        this->encoded_bytes += key.size();
+        this->count++;
+        return true;
+    }
+    if(key == it->first)
+        return false;
+
+    Block & b = it->second;
+    size_t before = b.rest.size();
+    if(key < it->first)
+    {
+        // only ever the first block.  the old first key becomes an entry,
+        // and the one after it still follows it.
+        std::string entry;
+        put_entry(entry, key, it->first);
+        b.rest.insert(0, entry);
+        this->encoded_bytes += b.rest.size() - before;
+        it = this->rekey_block(it, key);
+    }
+    else
+    {
+        std::string prev, cur = it->first;
+        size_t pos = 0;
+        for(;;)
+        {
+            size_t at = pos;
+            prev = cur;
+            if(!next_entry(b.rest, &pos, cur))
+            {
+                put_entry(b.rest, prev, key);
+                break;
+            }
+            if(cur == key)
+                return false;
+            if(cur > key)
+            {
+                // key goes here, and the key that was here now follows it.
+                std::string entries;
+                put_entry(entries, prev, key);
+                put_entry(entries, key, cur);
+                b.rest.replace(at, pos - at, entries);
+                break;
+            }
+        }
+        this->encoded_bytes += b.rest.size() - before;
+    }
+
+    this->count++;
+    if(++it->second.nkeys > KEYINDEX_BLOCK_KEYS)
+        this->split_block(it);
+    return true;
+}
+
+bool KeyIndex::erase(const std::string & key)
+{
+    block_map_t::iterator it = this->block_for(key);
+    if(it == this->blocks.end())
+        return false;
+
+    Block & b = it->second;
+    size_t before = b.rest.size();
+    if(key == it->first)
+    {
+        if(b.nkeys == 1)
+        {
+            this->remove_block(it);
+            this->count--;
+            return true;
+        }
+
+        // the second key becomes the first, and the one after it still
+        // follows it.
+        std::string second = it->first;
+        size_t pos = 0;
+        next_entry(b.rest, &pos, second);
+        b.rest.erase(0, pos);
+        this->encoded_bytes -= before - b.rest.size();
+        it = this->rekey_block(it, second);
+    }
+    else
+    {
+        std::string prev, cur = it->first;
+        size_t pos = 0, at;
+        do
+        {
+            at = pos;
+            prev = cur;
+            if(!next_entry(b.rest, &pos, cur) || cur > key)
+                return false;
+        } while(cur != key);
+
+        // the key after it, if there is one, now follows prev.
+        size_t end = pos;
+        if(next_entry(b.rest, &end, cur))
+        {
+            std::string entry;
+            put_entry(entry, prev, cur);
+            b.rest.replace(at, end - at, entry);
+        }
+        else
+            b.rest.erase(at);
+        this->encoded_bytes -= before - b.rest.size();
+    }
+
+    this->count--;
+    if(--it->second.nkeys < KEYINDEX_BLOCK_KEYS / 4)
+        this->merge_next(it);
+    return true;
+}
+
+bool KeyIndex::contains(const std::string & key) const
+{
+    block_map_t::const_iterator it = this->block_for(key);
+    if(it == this->blocks.end())
+        return false;
+
+    std::string cur = it->first;
+    size_t pos = 0;
+    do
+    {
+        int cmp = cur.compare(key);
+        if(cmp >= 0)
+            return cmp == 0;
+    } while(next_entry(it->second.rest, &pos, cur));
+    return false;
+}
+
+void KeyIndex::rebuild(std::vector<std::string> & keys)
+{
+    this->clear();
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    this->count = keys.size();
+    this->add_blocks(keys, 0, keys.size());
+}
+
+void KeyIndex::clear()
+{
+    this->blocks.clear();
+    this->count = 0;
+    this->encoded_bytes = 0;
+}
+
+void KeyIndex::scan(const std::string & prefix, const std::string & after, size_t count, std::vector<std::string> & keys) const
+{
+    if(!count)
+        return;
+
+    block_map_t::const_iterator it = this->block_for(after < prefix ? prefix : after);
+    for(; it != this->blocks.end(); ++it)
+    {
+        std::string key = it->first;
+        size_t pos = 0;
+        do
+        {
+            if(key <= after || key < prefix)
+                continue;
+            // keys with the prefix all sort together, so this is past them.
+            if(key.compare(0, prefix.size(), prefix))
+                return;
+            keys.push_back(key);
+            if(--count == 0)
+                return;
+        } while(next_entry(it->second.rest, &pos, key));
+    }
+}
+
+int64_t KeyIndex::memory_size() const
+{
+    // a map node is the pair plus three pointers and a colour.
+    return this->encoded_bytes +
+        this->blocks.size() * (sizeof(block_map_t::value_type) + 4 * sizeof(void *));
+}
@@ -0,0 +1,69 @@
+#ifndef __KEYINDEX_H__
+#define __KEYINDEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// every key Bitbox has, in memory or on disk, in order, so that keys can be
+// listed by prefix without touching their arrays or reading data/.
+//
+// keys are kept sorted in blocks of up to KEYINDEX_BLOCK_KEYS.  a block is
+// found by its first key, and the rest are front coded: each is stored as the
+// length of the prefix it shares with the key before it, then the bytes that
+// differ.  neighbouring keys usually share most of their bytes, so this takes
+// a fraction of the space of the keys themselves.  lookups and changes walk
+// one block's bytes, rebuilding each key in turn, and a change splices in
+// only the entries it touches.
+
+#ifndef KEYINDEX_BLOCK_KEYS
+#define KEYINDEX_BLOCK_KEYS 64
+#endif
+
+class KeyIndex {
+private:
+    struct Block {
+        uint32_t nkeys;   // the first key included
+        std::string rest; // the keys after the first, front coded
+    };
+    // first key -> block
+    typedef std::map<std::string, Block> block_map_t;
+
+    block_map_t blocks;
+    size_t count;
+    size_t encoded_bytes; // of the blocks' keys, first keys included
+
+    block_map_t::iterator block_for(const std::string & key);
+    block_map_t::const_iterator block_for(const std::string & key) const;
+    static void decode(block_map_t::const_iterator it, std::vector<std::string> & keys);
+    void add_blocks(const std::vector<std::string> & keys, size_t begin, size_t end);
+    void remove_block(block_map_t::iterator it);
+    block_map_t::iterator rekey_block(block_map_t::iterator it, const std::string & first);
+    void split_block(block_map_t::iterator it);
+    void merge_next(block_map_t::iterator it);
+
+public:
+    KeyIndex();
+
+    // false if the key was already there, or not there, respectively.
+    bool insert(const std::string & key);
+    bool erase(const std::string & key);
+    bool contains(const std::string & key) const;
+
+    // replaces everything with keys, which needn't be sorted.
+    void rebuild(std::vector<std::string> & keys);
+    void clear();
+
+    // up to count keys starting with prefix that sort after `after`, in
+    // order.
+    void scan(const std::string & prefix, const std::string & after, size_t count, std::vector<std::string> & keys) const;
+
+    size_t size() const { return this->count; }
+
+    // roughly; map nodes are guessed at.
+    int64_t memory_size() const;
+};
+
+#endif
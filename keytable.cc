@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <atomic>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bitbox.h"
+#include "epoch.h"
+#include "keytable.h"
+
+#define CTRL_EMPTY   ((int8_t)-128) // 0b10000000
+#define CTRL_DELETED ((int8_t)-2)   // 0b11111110
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7f))
+
+#define KEYTABLE_MIN_CAPACITY KEYTABLE_GROUP_WIDTH
+
+// a bitmask with bit i set for each control byte i in the group that matches.
+
+#ifdef __SSE2__
+
+static inline uint32_t group_match(const int8_t * group, int8_t h)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl));
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t * group)
+{
+    // EMPTY and DELETED are the only control bytes with the high bit set.
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+
+#else
+
+static inline uint32_t group_match(const int8_t * group, int8_t h)
+{
+    uint32_t mask = 0;
+    for(int i = 0; i < KEYTABLE_GROUP_WIDTH; i++)
+        if(group[i] == h)
+            mask |= 1u << i;
+    return mask;
+}
+
+static inline uint32_t group_match_empty_or_deleted(const int8_t * group)
+{
+    uint32_t mask = 0;
+    for(int i = 0; i < KEYTABLE_GROUP_WIDTH; i++)
+        if(group[i] < 0)
+            mask |= 1u << i;
+    return mask;
+}
+
+#endif
+
+static inline uint32_t group_match_empty(const int8_t * group)
+{
+    return group_match(group, CTRL_EMPTY);
+}
+
+uint64_t KeyTable::hash_key(const char * key, size_t keylen)
+{
+    return MurmurHash(key, keylen, 0);
+}
+
+KeyTable::KeyTable()
+    : ctrl(NULL), slots(NULL), capacity(0), used(0), deleted(0)
+{
+    this->rehash(KEYTABLE_MIN_CAPACITY);
+}
+
+KeyTable::~KeyTable()
+{
+    free(this->ctrl);
+    free(this->slots);
+}
+
+// the first KEYTABLE_GROUP_WIDTH-1 control bytes are mirrored after the end,
+// so a group load starting near the end of the table wraps around without
+// any special casing.
+void KeyTable::set_ctrl(size_t i, int8_t h)
+{
+    this->ctrl[i] = h;
+    if(i < KEYTABLE_GROUP_WIDTH - 1)
+        this->ctrl[this->capacity + i] = h;
+}
+
+// probe group by group, with the group stride growing by one group width each
+// time.  with a power-of-two capacity this visits every group exactly once.
+
+size_t KeyTable::find_slot(const char * key, size_t keylen, uint64_t hash) const
+{
+    size_t mask = this->capacity - 1;
+    size_t pos = H1(hash) & mask;
+    int8_t h2 = H2(hash);
+
+    for(size_t step = KEYTABLE_GROUP_WIDTH; ; step += KEYTABLE_GROUP_WIDTH)
+    {
+        const int8_t * group = this->ctrl + pos;
+
+        for(uint32_t m = group_match(group, h2); m; m &= m - 1)
+        {
+            const Slot & s = this->slots[(pos + __builtin_ctz(m)) & mask];
+            if(s.hash == hash && s.keylen == keylen && !memcmp(s.value->key, key, keylen))
+                return (pos + __builtin_ctz(m)) & mask;
+        }
+
+        if(group_match_empty(group))
+            return this->capacity; // not found
+
+        pos = (pos + step) & mask;
+    }
+}
+
+size_t KeyTable::find_insert_slot(uint64_t hash) const
+{
+    size_t mask = this->capacity - 1;
+    size_t pos = H1(hash) & mask;
+
+    for(size_t step = KEYTABLE_GROUP_WIDTH; ; step += KEYTABLE_GROUP_WIDTH)
+    {
+        uint32_t m = group_match_empty_or_deleted(this->ctrl + pos);
+        if(m)
+            return (pos + __builtin_ctz(m)) & mask;
+        pos = (pos + step) & mask;
+    }
+}
+
+void KeyTable::rehash(size_t new_capacity)
+{
+    int8_t * old_ctrl = this->ctrl;
+    Slot * old_slots = this->slots;
+    size_t old_capacity = this->capacity;
+
+    this->capacity = new_capacity;
+    this->ctrl = (int8_t *)malloc(new_capacity + KEYTABLE_GROUP_WIDTH);
+    this->slots = (Slot *)malloc(new_capacity * sizeof(Slot));
+    assert(this->ctrl && this->slots);
+    memset(this->ctrl, (uint8_t)CTRL_EMPTY, new_capacity + KEYTABLE_GROUP_WIDTH);
+    this->deleted = 0;
+
+    for(size_t i = 0; i < old_capacity; i++)
+    {
+        if(old_ctrl[i] < 0)
+            continue;
+        size_t j = this->find_insert_slot(old_slots[i].hash);
+        this->set_ctrl(j, H2(old_slots[i].hash));
+        this->slots[j] = old_slots[i];
+    }
+
+    // lock-free readers may still be probing the old table.
+    epoch_free(old_ctrl);
+    epoch_free(old_slots);
+}
+
+Bitarray * KeyTable::find(const char * key, size_t keylen, uint64_t hash) const
+{
+    size_t i = this->find_slot(key, keylen, hash);
+    return i == this->capacity ? NULL : this->slots[i].value;
+}
+
+Bitarray * KeyTable::find_in(const Layout & l, const char * key, size_t keylen, uint64_t hash)
+{
+    size_t mask = l.capacity - 1;
+    size_t pos = H1(hash) & mask;
+    int8_t h2 = H2(hash);
+
+    for(size_t step = KEYTABLE_GROUP_WIDTH; step <= l.capacity; step += KEYTABLE_GROUP_WIDTH)
+    {
+        const int8_t * group = l.ctrl + pos;
+        uint32_t m = group_match(group, h2);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // the slot may be reused under us, so its key length is checked
+        // against the array's own, which never changes.
+        for(; m; m &= m - 1)
+        {
+            const Slot & s = l.slots[(pos + __builtin_ctz(m)) & mask];
+            Bitarray * b = s.value;
+            if(s.hash == hash && b->keylen == keylen && !memcmp(b->key, key, keylen))
+                return b;
+        }
+
+        if(group_match_empty(group))
+            return NULL;
+
+        pos = (pos + step) & mask;
+    }
+    return NULL;
+}
+
+void KeyTable::insert(Bitarray * b, uint64_t hash)
+{
+    size_t i = this->find_slot(b->key, b->keylen, hash);
+    if(i != this->capacity)
+    {
+        this->slots[i].value = b;
+        return;
+    }
+
+    // keep the load (including tombstones) at or under 7/8, so every probe
+    // sequence is guaranteed to hit an empty group.  if it's mostly
+    // tombstones, just clean up at the same size.
+    if((this->used + this->deleted + 1) * 8 > this->capacity * 7)
+        this->rehash((this->used + 1) * 16 > this->capacity * 7 ? this->capacity * 2 : this->capacity);
+
+    // the slot is filled in before its control byte says so, for find_in().
+    i = this->find_insert_slot(hash);
+    if(this->ctrl[i] == CTRL_DELETED)
+        this->deleted--;
+    this->slots[i].hash = hash;
+    this->slots[i].keylen = b->keylen;
+    this->slots[i].value = b;
+    std::atomic_thread_fence(std::memory_order_release);
+    this->set_ctrl(i, H2(hash));
+    this->used++;
+}
+
+Bitarray * KeyTable::erase(const char * key, size_t keylen)
+{
+    size_t i = this->find_slot(key, keylen, KeyTable::hash_key(key, keylen));
+    if(i == this->capacity)
+        return NULL;
+    Bitarray * b = this->slots[i].value;
+    this->erase_at(iterator(this, i));
+    return b;
+}
+
+void KeyTable::erase_at(const iterator & it)
+{
+    assert(this->ctrl[it.i] >= 0);
+    this->set_ctrl(it.i, CTRL_DELETED);
+    this->used--;
+    this->deleted++;
+}
+
+KeyTable::iterator::iterator(const KeyTable * table, size_t i)
+    : table(table), i(i)
+{
+    this->skip_empty();
+}
+
+void KeyTable::iterator::skip_empty()
+{
+    while(this->i < this->table->capacity && this->table->ctrl[this->i] < 0)
+        ++this->i;
+}
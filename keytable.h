@@ -0,0 +1,100 @@
+#ifndef __KEYTABLE_H__
+#define __KEYTABLE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct Bitarray;
+
+// the key -> Bitarray index used by Bitbox.
+//
+// this is a flat open-addressing table laid out like a "swiss table": a
+// control byte per slot holds either EMPTY, DELETED, or the low 7 bits of the
+// key's hash, and slots are probed 16 at a time by comparing a whole group of
+// control bytes at once (with SSE2 where available).  each slot also caches
+// the full hash and the key length, so a lookup only touches the key bytes
+// (which live in the Bitarray) once both of those match.  callers pass key
+// lengths in, so nothing here ever calls strlen.
+
+#define KEYTABLE_GROUP_WIDTH 16
+
+class KeyTable {
+private:
+    struct Slot {
+        uint64_t hash;
+        uint32_t keylen;
+        Bitarray * value;
+    };
+
+    int8_t * ctrl;   // capacity + KEYTABLE_GROUP_WIDTH control bytes
+    Slot * slots;
+    size_t capacity; // always a power of two, at least KEYTABLE_GROUP_WIDTH
+    size_t used;     // live entries
+    size_t deleted;  // tombstones
+
+    void set_ctrl(size_t i, int8_t h);
+    size_t find_slot(const char * key, size_t keylen, uint64_t hash) const;
+    size_t find_insert_slot(uint64_t hash) const;
+    void rehash(size_t new_capacity);
+
+public:
+    KeyTable();
+    ~KeyTable();
+
+    static uint64_t hash_key(const char * key, size_t keylen);
+
+    Bitarray * find(const char * key, size_t keylen) const
+    {
+        return this->find(key, keylen, KeyTable::hash_key(key, keylen));
+    }
+    Bitarray * find(const char * key, size_t keylen, uint64_t hash) const;
+
+    // adds b under its key, replacing any existing entry for that key.  hash
+    // must be hash_key(b->key, b->keylen).
+    void insert(Bitarray * b, uint64_t hash);
+
+    // returns the removed array, or NULL if the key wasn't present.
+    Bitarray * erase(const char * key, size_t keylen);
+
+    // for readers that don't hold the lock.  layout() copies what a lookup
+    // needs, which is only good if nothing changed the table while it was
+    // copied; the reader checks that.  find_in() looks up in a copy, which
+    // stays readable while the reader holds an EpochGuard even if the table
+    // moves on, and gives up after one pass over the groups in case writers
+    // are filling them meanwhile.
+    struct Layout {
+        const int8_t * ctrl;
+        const Slot * slots;
+        size_t capacity;
+    };
+    Layout layout() const
+    {
+        Layout l = { this->ctrl, this->slots, this->capacity };
+        return l;
+    }
+    static Bitarray * find_in(const Layout & l, const char * key, size_t keylen, uint64_t hash);
+
+    size_t size() const { return this->used; }
+    bool empty() const { return this->used == 0; }
+
+    // walks every live entry.  the table must not be modified meanwhile,
+    // except through erase_at() on the current position.
+    class iterator {
+        friend class KeyTable;
+        const KeyTable * table;
+        size_t i;
+        iterator(const KeyTable * table, size_t i);
+        void skip_empty();
+    public:
+        Bitarray * operator*() const { return this->table->slots[this->i].value; }
+        iterator & operator++() { ++this->i; this->skip_empty(); return *this; }
+        bool operator==(const iterator & o) const { return this->i == o.i; }
+        bool operator!=(const iterator & o) const { return this->i != o.i; }
+    };
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, this->capacity); }
+    void erase_at(const iterator & it);
+};
+
+#endif
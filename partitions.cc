@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <thread>
+
+#include "partitions.h"
+
+BitboxPartitions::BitboxPartitions(int npartitions)
+    : owned(true)
+{
+    for(int p = 0; p < npartitions; p++)
+        this->boxes.push_back(new Bitbox(p, npartitions));
+
+    // every box has read every expiry log by now, so they can be rewritten.
+    if(npartitions > 1)
+    {
+        for(int p = 0; p < npartitions; p++)
+            this->boxes[p]->open_expiry_log();
+        Bitbox::remove_stale_expiry_logs(npartitions);
+    }
+}
+
+BitboxPartitions::BitboxPartitions(Bitbox & box)
+    : owned(false)
+{
+    this->boxes.push_back(&box);
+}
+
+BitboxPartitions::~BitboxPartitions()
+{
+    if(this->owned)
+        for(size_t p = 0; p < this->boxes.size(); p++)
+            delete this->boxes[p];
+}
+
+void BitboxPartitions::execute_batch(std::vector<BitboxOp> & ops)
+{
+    int n = this->boxes.size();
+    if(n == 1)
+    {
+        this->boxes[0]->execute_batch(ops);
+        return;
+    }
+
+    std::vector<std::vector<BitboxOp> > split(n);
+    std::vector<std::vector<size_t> > from(n);
+    for(size_t i = 0; i < ops.size(); i++)
+    {
+        int p = Bitbox::partition_for(*ops[i].key, n);
+        split[p].push_back(ops[i]);
+        from[p].push_back(i);
+    }
+
+    for(int p = 0; p < n; p++)
+    {
+        if(split[p].empty())
+            continue;
+        this->boxes[p]->execute_batch(split[p]);
+        for(size_t i = 0; i < split[p].size(); i++)
+        {
+            ops[from[p][i]].result = split[p][i].result;
+            ops[from[p][i]].failed = split[p][i].failed;
+        }
+    }
+}
+
+bool BitboxPartitions::shutdown(int64_t seconds, const flush_progress_t & progress)
+{
+    bool ok = true;
+    for(size_t p = 0; p < this->boxes.size(); p++)
+        ok = this->boxes[p]->shutdown(seconds, progress) && ok;
+    return ok;
+}
+
+int64_t BitboxPartitions::expire_keys()
+{
+    int64_t expired = 0;
+    for(size_t p = 0; p < this->boxes.size(); p++)
+        expired += this->boxes[p]->expire_keys();
+    return expired;
+}
+
+int64_t BitboxPartitions::delete_prefix(const std::string & prefix)
+{
+    int64_t deleted = 0;
+    for(size_t p = 0; p < this->boxes.size(); p++)
+        deleted += this->boxes[p]->delete_prefix(prefix);
+    return deleted;
+}
+
+// the first count keys overall are among the first count from each box.
+void BitboxPartitions::scan_keys(const std::string & prefix, const std::string & after, size_t count, std::vector<std::string> & keys)
+{
+    if(this->boxes.size() == 1)
+    {
+        this->boxes[0]->scan_keys(prefix, after, count, keys);
+        return;
+    }
+
+    std::vector<std::string> found;
+    for(size_t p = 0; p < this->boxes.size(); p++)
+        this->boxes[p]->scan_keys(prefix, after, count, found);
+    std::sort(found.begin(), found.end());
+    if(found.size() > count)
+        found.resize(count);
+    keys.insert(keys.end(), found.begin(), found.end());
+}
+
+void BitboxPartitions::prefetch(const std::vector<std::string> & keys)
+{
+    int n = this->boxes.size();
+    if(n == 1)
+    {
+        this->boxes[0]->prefetch(keys);
+        return;
+    }
+
+    std::vector<std::vector<std::string> > split(n);
+    for(size_t i = 0; i < keys.size(); i++)
+        split[Bitbox::partition_for(keys[i], n)].push_back(keys[i]);
+    for(int p = 0; p < n; p++)
+        if(!split[p].empty())
+            this->boxes[p]->prefetch(split[p]);
+}
+
+int64_t BitboxPartitions::resident(const std::vector<std::string> & keys)
+{
+    int n = this->boxes.size();
+    if(n == 1)
+        return this->boxes[0]->resident(keys);
+
+    std::vector<std::vector<std::string> > split(n);
+    for(size_t i = 0; i < keys.size(); i++)
+        split[Bitbox::partition_for(keys[i], n)].push_back(keys[i]);
+    int64_t count = 0;
+    for(int p = 0; p < n; p++)
+        if(!split[p].empty())
+            count += this->boxes[p]->resident(split[p]);
+    return count;
+}
+
+static bool bigger(const BitboxKeyInfo & a, const BitboxKeyInfo & b)
+{
+    return a.memory_bytes > b.memory_bytes;
+}
+
+// the biggest count overall are among the biggest count from each box.
+void BitboxPartitions::memory_top(size_t count, std::vector<BitboxKeyInfo> & top)
+{
+    if(this->boxes.size() == 1)
+    {
+        this->boxes[0]->memory_top(count, top);
+        return;
+    }
+
+    std::vector<BitboxKeyInfo> found;
+    for(size_t p = 0; p < this->boxes.size(); p++)
+        this->boxes[p]->memory_top(count, found);
+    std::stable_sort(found.begin(), found.end(), bigger);
+    if(found.size() > count)
+        found.resize(count);
+    top.insert(top.end(), found.begin(), found.end());
+}
+
+bool BitboxPartitions::set_eviction_policy(const std::string & name)
+{
+    for(size_t p = 0; p < this->boxes.size(); p++)
+        if(!this->boxes[p]->set_eviction_policy(name))
+            return false;
+    return true;
+}
+
+void BitboxPartitions::get_stats(std::map<std::string, int64_t> & stats)
+{
+    if(this->boxes.size() == 1)
+    {
+        this->boxes[0]->get_stats(stats);
+        return;
+    }
+
+    std::map<std::string, int64_t> total;
+    for(size_t p = 0; p < this->boxes.size(); p++)
+    {
+        std::map<std::string, int64_t> one;
+        this->boxes[p]->get_stats(one);
+        for(std::map<std::string, int64_t>::iterator it = one.begin(); it != one.end(); ++it)
+        {
+            int64_t & value = total[it->first];
+            if(it->first == "export_running" || !it->first.compare(0, strlen("eviction_policy_"), "eviction_policy_"))
+                value = std::max(value, it->second);
+            else if(!it->first.compare(0, strlen("huge_"), "huge_"))
+                value = it->second; // the allocator is shared, so every box reports the same
+            else
+                value += it->second;
+        }
+    }
+    total["partitions"] = this->boxes.size();
+    stats.insert(total.begin(), total.end());
+}
+
+// the boxes export side by side, so that each settles its contents at about
+// the same time as the others rather than once the one before it has
+// finished.
+bool BitboxPartitions::export_to_file(const std::string & filename, const std::function<void(bool)> & started)
+{
+    int n = this->boxes.size();
+    if(n == 1)
+        return this->boxes[0]->export_to_file(filename, started);
+
+    std::vector<std::shared_ptr<std::promise<bool> > > settled;
+    std::vector<std::future<bool> > done;
+    std::vector<std::thread> threads;
+    for(int p = 0; p < n; p++)
+    {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".%d", p);
+        std::string name = filename + suffix;
+        Bitbox * box = this->boxes[p];
+
+        std::shared_ptr<std::promise<bool> > began(new std::promise<bool>());
+        std::shared_ptr<std::promise<bool> > finished(new std::promise<bool>());
+        settled.push_back(began);
+        done.push_back(finished->get_future());
+        threads.push_back(std::thread([box, name, began, finished]() {
+            finished->set_value(box->export_to_file(name, [began](bool ok) {
+                began->set_value(ok);
+            }));
+        }));
+    }
+
+    bool ok = true;
+    for(int p = 0; p < n; p++)
+        ok = settled[p]->get_future().get() && ok;
+    if(started)
+        started(ok);
+
+    for(int p = 0; p < n; p++)
+    {
+        ok = done[p].get() && ok;
+        threads[p].join();
+    }
+    return ok;
+}
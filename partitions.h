@@ -0,0 +1,59 @@
+#ifndef __PARTITIONS_H__
+#define __PARTITIONS_H__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bitbox.h"
+
+// several Bitboxes sharing data/, each owning the keys that
+// Bitbox::partition_for() gives it, so that requests for different keys
+// rarely meet on the same lock.  a request for one key goes straight to its
+// box; the rest are split up or run on every box and their results put
+// together.  each box has its own share of the memory limits and its own
+// expiry log.
+//
+// with one partition this is just a box, and data/ looks as it always has.
+
+class BitboxPartitions {
+private:
+    std::vector<Bitbox *> boxes;
+    bool owned;
+
+public:
+    BitboxPartitions(int npartitions);
+    // wraps an existing box, as its only partition.
+    BitboxPartitions(Bitbox & box);
+    ~BitboxPartitions();
+
+    int size() const { return this->boxes.size(); }
+    Bitbox & operator[](int partition) { return *this->boxes[partition]; }
+    Bitbox & for_key(const std::string & key)
+    {
+        return *this->boxes[Bitbox::partition_for(key, this->boxes.size())];
+    }
+
+    // each box runs its share of the ops as a batch of its own.
+    void execute_batch(std::vector<BitboxOp> & ops);
+
+    // the same as Bitbox's, across every box.  stats are summed, except for
+    // flags, which are set if they are on any box, and the huge page
+    // allocator's, which all the boxes share.
+    bool shutdown(int64_t seconds = 0, const flush_progress_t & progress = flush_progress_t());
+    int64_t expire_keys();
+    int64_t delete_prefix(const std::string & prefix);
+    void scan_keys(const std::string & prefix, const std::string & after, size_t count, std::vector<std::string> & keys);
+    void prefetch(const std::vector<std::string> & keys);
+    int64_t resident(const std::vector<std::string> & keys);
+    bool set_eviction_policy(const std::string & name);
+    void memory_top(size_t count, std::vector<BitboxKeyInfo> & top);
+    void get_stats(std::map<std::string, int64_t> & stats);
+
+    // with several boxes, each exports to filename.N, all of them settled at
+    // about the same moment, and started is called once they all are.
+    bool export_to_file(const std::string & filename, const std::function<void(bool)> & started = std::function<void(bool)>());
+};
+
+#endif
@@ -0,0 +1,740 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <set>
+
+#include "replication.h"
+
+// a replica this far behind is dropped, and gets a fresh copy when it
+// reconnects, rather than letting its backlog eat the primary's memory.
+#define REPL_MAX_BACKLOG        (256*1024*1024)
+
+// how often an idle primary tells its replicas it's still there.  this bounds
+// the lag an idle replica reports.
+#define REPL_HEARTBEAT_MS       100
+
+// records are gathered into writes of about this size.
+#define REPL_WRITE_SIZE         (64*1024)
+#define REPL_READ_SIZE          (64*1024)
+
+#define REPL_HEADER_SIZE        (sizeof(uint8_t) + sizeof(uint64_t) + sizeof(int64_t))
+
+enum {
+    REPL_SNAPSHOT_BEGIN = 1, // (no body) the replica drops everything it has
+    REPL_SNAPSHOT_ARRAY = 2, // key, frozen array
+    REPL_SNAPSHOT_END   = 3, // (no body)
+    REPL_SET_BITS       = 4, // key, uint64 count, int64 bits...
+    REPL_SET_RANGE      = 5, // key, int64 start_bit, int64 end_bit
+    REPL_CLEAR_BIT      = 6, // key, int64 bit
+    REPL_REPLACE        = 7, // key, frozen array
+    REPL_HEARTBEAT      = 8, // (no body)
+    REPL_DELETE         = 9, // key
+    REPL_OR_BITMAP      = 10, // key, int64 start_bit, bitmap bytes
+    REPL_SET_FIELD      = 11  // key, int64 bit, int32 width, uint64 value
+};
+
+// strings are a uint32 length and then the bytes.  a frozen array is the
+// rest of the record, in the Bitarray::freeze() format.
+
+static int64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+template<typename T>
+static void put(std::string & out, T value)
+{
+    out.append((const char *)&value, sizeof(value));
+}
+
+static void put_string(std::string & out, const std::string & s)
+{
+    put<uint32_t>(out, s.size());
+    out.append(s);
+}
+
+static std::string make_record(uint8_t type, uint64_t seq, int64_t usec, const std::string & body)
+{
+    std::string record;
+    record.reserve(sizeof(uint32_t) + REPL_HEADER_SIZE + body.size());
+    put<uint32_t>(record, REPL_HEADER_SIZE + body.size());
+    put<uint8_t>(record, type);
+    put<uint64_t>(record, seq);
+    put<int64_t>(record, usec);
+    record.append(body);
+    return record;
+}
+
+struct ReplReader {
+    const uint8_t * p;
+    const uint8_t * end;
+    bool ok;
+
+    ReplReader(const uint8_t * p, size_t len) : p(p), end(p + len), ok(true) {}
+
+    size_t remaining() const { return this->end - this->p; }
+
+    template<typename T>
+    T get()
+    {
+        T value = 0;
+        if(this->remaining() < sizeof(T))
+            this->ok = false;
+        else
+        {
+            memcpy(&value, this->p, sizeof(T));
+            this->p += sizeof(T);
+        }
+        return value;
+    }
+
+    std::string get_string()
+    {
+        uint32_t len = this->get<uint32_t>();
+        if(!this->ok || this->remaining() < len)
+        {
+            this->ok = false;
+            return std::string();
+        }
+        std::string s((const char *)this->p, len);
+        this->p += len;
+        return s;
+    }
+};
+
+static bool send_all(int fd, const char * data, size_t len)
+{
+    while(len)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// sends out once it's grown big enough, or whatever's in it if force is set.
+static bool flush_records(int fd, std::string & out, bool force)
+{
+    if(out.empty() || (!force && out.size() < REPL_WRITE_SIZE))
+        return true;
+    bool ok = send_all(fd, out.data(), out.size());
+    out.clear();
+    return ok;
+}
+
+// primary
+
+struct ReplicaLink {
+    int fd;
+    std::thread thread;
+    bool following;     // changes are being queued for it
+    bool dead;          // give up on it as soon as possible
+    bool done;          // its thread has finished
+    std::deque<std::string> backlog;
+    size_t backlog_bytes;
+    std::condition_variable cv;
+
+    ReplicaLink(int fd)
+        : fd(fd), following(false), dead(false), done(false), backlog_bytes(0)
+    {}
+};
+
+ReplicationPrimary::ReplicationPrimary(Bitbox & box, int port)
+    : box(box), port(port), listen_fd(-1), stopping(false), seq(0)
+{
+}
+
+ReplicationPrimary::~ReplicationPrimary()
+{
+    if(this->listen_fd != -1)
+        close(this->listen_fd);
+}
+
+bool ReplicationPrimary::listen()
+{
+    this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(this->listen_fd == -1)
+        return false;
+
+    int one = 1;
+    setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(this->port);
+
+    return bind(this->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != -1 &&
+        ::listen(this->listen_fd, 16) != -1;
+}
+
+void ReplicationPrimary::start()
+{
+    this->box.set_listener(this);
+    this->accept_thread = std::thread(&ReplicationPrimary::accept_loop, this);
+}
+
+void ReplicationPrimary::stop()
+{
+    this->box.set_listener(NULL);
+    this->stopping = true;
+
+    // wakes up accept()
+    shutdown(this->listen_fd, SHUT_RDWR);
+    this->accept_thread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        for(std::list<ReplicaLink *>::iterator it = this->links.begin(); it != this->links.end(); ++it)
+        {
+            (*it)->dead = true;
+            shutdown((*it)->fd, SHUT_RDWR);
+            (*it)->cv.notify_one();
+        }
+    }
+    this->reap_links(true);
+}
+
+void ReplicationPrimary::accept_loop()
+{
+    while(!this->stopping)
+    {
+        int fd = accept(this->listen_fd, NULL, NULL);
+        if(fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(!this->stopping)
+                perror("replication: accept");
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        this->reap_links(false);
+
+        ReplicaLink * link = new ReplicaLink(fd);
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->links.push_back(link);
+        link->thread = std::thread(&ReplicationPrimary::serve_replica, this, link);
+        fprintf(stderr, "replication: replica connected.\n");
+    }
+}
+
+// joins and frees links whose threads have finished, or all of them.
+void ReplicationPrimary::reap_links(bool all)
+{
+    std::list<ReplicaLink *> finished;
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        std::list<ReplicaLink *>::iterator it = this->links.begin();
+        while(it != this->links.end())
+        {
+            if(all || (*it)->done)
+            {
+                finished.push_back(*it);
+                it = this->links.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    for(std::list<ReplicaLink *>::iterator it = finished.begin(); it != finished.end(); ++it)
+    {
+        (*it)->thread.join();
+        close((*it)->fd);
+        delete *it;
+    }
+}
+
+// XXX: like Bitbox's own loads, this could pick up one of
+// g_file_set_contents()'s temp files if it catches one mid-write.
+bool ReplicationPrimary::send_snapshot(ReplicaLink * link)
+{
+    std::vector<std::pair<std::string, std::string> > frozen;
+    uint64_t start_seq = 0;
+
+    // from here on, every change gets queued for this replica.
+    this->box.snapshot(frozen, [&]() {
+        std::lock_guard<std::mutex> lock(this->mu);
+        link->following = true;
+        start_seq = this->seq;
+    });
+
+    int64_t usec = now_usec();
+    std::string out = make_record(REPL_SNAPSHOT_BEGIN, start_seq, usec, std::string());
+    std::set<std::string> sent;
+
+    for(size_t i = 0; i < frozen.size() && !this->stopping; i++)
+    {
+        std::string body;
+        put_string(body, frozen[i].first);
+        body.append(frozen[i].second);
+        std::string().swap(frozen[i].second);
+
+        out += make_record(REPL_SNAPSHOT_ARRAY, start_seq, usec, body);
+        sent.insert(frozen[i].first);
+        if(!flush_records(link->fd, out, false))
+            return false;
+    }
+
+    // keys that weren't in memory.  they may have been loaded and changed
+    // since, but those changes are queued up behind us.
+    std::vector<std::string> keys;
+    Bitarray::list_on_disk(keys);
+    for(size_t i = 0; i < keys.size() && !this->stopping; i++)
+    {
+        if(sent.count(keys[i]))
+            continue;
+
+        std::string contents;
+        if(!this->box.dump_from_disk(keys[i], contents))
+            continue; // it went away
+
+        std::string body;
+        put_string(body, keys[i]);
+        body.append(contents);
+
+        out += make_record(REPL_SNAPSHOT_ARRAY, start_seq, usec, body);
+        if(!flush_records(link->fd, out, false))
+            return false;
+    }
+
+    out += make_record(REPL_SNAPSHOT_END, start_seq, usec, std::string());
+    return !this->stopping && flush_records(link->fd, out, true);
+}
+
+void ReplicationPrimary::serve_replica(ReplicaLink * link)
+{
+    bool ok = this->send_snapshot(link);
+
+    std::unique_lock<std::mutex> lock(this->mu);
+    while(ok && !this->stopping && !link->dead)
+    {
+        std::string out;
+        if(link->backlog.empty())
+        {
+            link->cv.wait_for(lock, std::chrono::milliseconds(REPL_HEARTBEAT_MS));
+            if(link->backlog.empty())
+                out = make_record(REPL_HEARTBEAT, this->seq, now_usec(), std::string());
+        }
+
+        std::deque<std::string> batch;
+        batch.swap(link->backlog);
+        link->backlog_bytes = 0;
+        lock.unlock();
+
+        for(size_t i = 0; i < batch.size() && ok; i++)
+        {
+            out += batch[i];
+            ok = flush_records(link->fd, out, false);
+        }
+        ok = ok && flush_records(link->fd, out, true);
+
+        lock.lock();
+    }
+
+    link->following = false;
+    link->backlog.clear();
+    link->done = true;
+    fprintf(stderr, "replication: replica disconnected.\n");
+}
+
+// called with the box locked.
+void ReplicationPrimary::queue(uint8_t type, const std::string & body)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    this->seq++;
+
+    std::string record;
+    for(std::list<ReplicaLink *>::iterator it = this->links.begin(); it != this->links.end(); ++it)
+    {
+        ReplicaLink * link = *it;
+        if(!link->following || link->dead)
+            continue;
+
+        if(record.empty())
+            record = make_record(type, this->seq, now_usec(), body);
+
+        if(link->backlog_bytes + record.size() > REPL_MAX_BACKLOG)
+        {
+            fprintf(stderr, "replication: replica fell too far behind, dropping it.\n");
+            link->dead = true;
+            link->backlog.clear();
+            link->backlog_bytes = 0;
+            shutdown(link->fd, SHUT_RDWR);
+        }
+        else
+        {
+            link->backlog.push_back(record);
+            link->backlog_bytes += record.size();
+        }
+        link->cv.notify_one();
+    }
+}
+
+void ReplicationPrimary::bits_set(const std::string & key, const int64_t * bits, size_t nbits)
+{
+    std::string body;
+    put_string(body, key);
+    put<uint64_t>(body, nbits);
+    body.append((const char *)bits, nbits * sizeof(int64_t));
+    this->queue(REPL_SET_BITS, body);
+}
+
+void ReplicationPrimary::range_set(const std::string & key, int64_t start_bit, int64_t end_bit)
+{
+    std::string body;
+    put_string(body, key);
+    put<int64_t>(body, start_bit);
+    put<int64_t>(body, end_bit);
+    this->queue(REPL_SET_RANGE, body);
+}
+
+void ReplicationPrimary::bitmap_ored(const std::string & key, int64_t start_bit, const uint8_t * bitmap, int64_t nbytes)
+{
+    std::string body;
+    put_string(body, key);
+    put<int64_t>(body, start_bit);
+    body.append((const char *)bitmap, nbytes);
+    this->queue(REPL_OR_BITMAP, body);
+}
+
+// increments go over as the value they left, so that they can't be applied
+// differently on a replica.
+void ReplicationPrimary::field_set(const std::string & key, int64_t bit, int width, uint64_t value)
+{
+    std::string body;
+    put_string(body, key);
+    put<int64_t>(body, bit);
+    put<int32_t>(body, width);
+    put<uint64_t>(body, value);
+    this->queue(REPL_SET_FIELD, body);
+}
+
+void ReplicationPrimary::bit_cleared(const std::string & key, int64_t bit)
+{
+    std::string body;
+    put_string(body, key);
+    put<int64_t>(body, bit);
+    this->queue(REPL_CLEAR_BIT, body);
+}
+
+void ReplicationPrimary::array_replaced(const std::string & key, Bitarray * b)
+{
+    SerializedBitarray ser(b);
+    std::string frozen;
+    Bitarray::freeze(ser, frozen);
+
+    std::string body;
+    put_string(body, key);
+    body.append(frozen);
+    this->queue(REPL_REPLACE, body);
+}
+
+void ReplicationPrimary::key_deleted(const std::string & key)
+{
+    std::string body;
+    put_string(body, key);
+    this->queue(REPL_DELETE, body);
+}
+
+void ReplicationPrimary::get_stats(std::map<std::string, int64_t> & stats)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    int64_t replicas = 0, backlog = 0;
+    for(std::list<ReplicaLink *>::iterator it = this->links.begin(); it != this->links.end(); ++it)
+    {
+        if(!(*it)->following)
+            continue;
+        replicas++;
+        backlog = MAX(backlog, (int64_t)(*it)->backlog_bytes);
+    }
+    stats["repl_seq"] = this->seq;
+    stats["repl_replicas"] = replicas;
+    stats["repl_max_backlog_bytes"] = backlog;
+}
+
+// replica
+
+ReplicationReplica::ReplicationReplica(Bitbox & box, const std::string & host, int port)
+    : box(box), host(host), port(port), stopping(false), fd(-1), connected(false),
+      synced(false), applied_seq(0), applied_usec(0)
+{
+}
+
+ReplicationReplica::~ReplicationReplica()
+{
+}
+
+void ReplicationReplica::start()
+{
+    this->thread = std::thread(&ReplicationReplica::run, this);
+}
+
+void ReplicationReplica::stop()
+{
+    this->stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        if(this->fd != -1)
+            shutdown(this->fd, SHUT_RDWR);
+    }
+    this->thread.join();
+}
+
+int ReplicationReplica::connect_to_primary()
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", this->port);
+
+    struct addrinfo hints, * addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(this->host.c_str(), port, &hints, &addrs) != 0)
+        return -1;
+
+    int fd = -1;
+    for(struct addrinfo * a = addrs; a && fd == -1; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if(fd != -1 && connect(fd, a->ai_addr, a->ai_addrlen) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+void ReplicationReplica::run()
+{
+    while(!this->stopping)
+    {
+        int fd = this->connect_to_primary();
+        if(fd != -1)
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->mu);
+                this->fd = fd;
+                this->connected = true;
+            }
+            // stop() may have missed the fd.
+            if(!this->stopping)
+            {
+                fprintf(stderr, "replication: following %s:%d.\n", this->host.c_str(), this->port);
+                this->follow(fd);
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->mu);
+                this->fd = -1;
+                this->connected = false;
+            }
+            close(fd);
+        }
+
+        for(int i = 0; i < 10 && !this->stopping; i++)
+            usleep(100000);
+    }
+}
+
+void ReplicationReplica::follow(int fd)
+{
+    std::string in;
+    size_t pos = 0;
+    char chunk[REPL_READ_SIZE];
+
+    for(;;)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return;
+        in.append(chunk, n);
+
+        bool changed = false;
+        while(in.size() - pos >= sizeof(uint32_t))
+        {
+            uint32_t len;
+            memcpy(&len, in.data() + pos, sizeof(len));
+            if(len < REPL_HEADER_SIZE)
+            {
+                fprintf(stderr, "replication: bad record from the primary.\n");
+                return;
+            }
+            if(in.size() - pos - sizeof(uint32_t) < len)
+                break;
+
+            ReplReader r((const uint8_t *)in.data() + pos + sizeof(uint32_t), len);
+            uint8_t type = r.get<uint8_t>();
+            uint64_t seq = r.get<uint64_t>();
+            int64_t usec = r.get<int64_t>();
+            if(!this->apply(type, seq, usec, r.p, r.remaining()))
+            {
+                fprintf(stderr, "replication: bad record from the primary.\n");
+                return;
+            }
+
+            changed = changed || type != REPL_HEARTBEAT;
+            pos += sizeof(uint32_t) + len;
+        }
+
+        in.erase(0, pos);
+        pos = 0;
+
+        // nobody else writes to a replica, so this is the only place its
+        // maintenance gets done.
+        if(changed)
+            this->box.run_maintenance_step();
+    }
+}
+
+bool ReplicationReplica::apply(uint8_t type, uint64_t seq, int64_t usec, const uint8_t * body, size_t len)
+{
+    ReplReader r(body, len);
+
+    switch(type)
+    {
+        case REPL_SNAPSHOT_BEGIN:
+            this->box.clear();
+            break;
+
+        case REPL_SNAPSHOT_ARRAY:
+        case REPL_REPLACE:
+        {
+            std::string key = r.get_string();
+            if(!r.ok)
+                return false;
+            Bitarray * b = Bitarray::thaw(key.data(), key.size(), r.p, r.remaining());
+            if(!b)
+                return false;
+            this->box.replace(key, b);
+            delete b;
+            break;
+        }
+
+        case REPL_SET_BITS:
+        {
+            std::string key = r.get_string();
+            uint64_t nbits = r.get<uint64_t>();
+            if(!r.ok || r.remaining() / sizeof(int64_t) < nbits)
+                return false;
+            std::vector<int64_t> bits(nbits);
+            memcpy(bits.data(), r.p, nbits * sizeof(int64_t));
+            this->box.set_bits(key, bits.begin(), bits.end());
+            break;
+        }
+
+        case REPL_SET_RANGE:
+        {
+            std::string key = r.get_string();
+            int64_t start_bit = r.get<int64_t>();
+            int64_t end_bit = r.get<int64_t>();
+            if(!r.ok)
+                return false;
+            this->box.set_range(key, start_bit, end_bit);
+            break;
+        }
+
+        case REPL_OR_BITMAP:
+        {
+            std::string key = r.get_string();
+            int64_t start_bit = r.get<int64_t>();
+            if(!r.ok)
+                return false;
+            if(!this->box.or_bitmap(key, start_bit, r.p, r.remaining()))
+                return false;
+            break;
+        }
+
+        case REPL_SET_FIELD:
+        {
+            std::string key = r.get_string();
+            int64_t bit = r.get<int64_t>();
+            int32_t width = r.get<int32_t>();
+            uint64_t value = r.get<uint64_t>();
+            if(!r.ok || !Bitbox::field_ok(bit, width, true))
+                return false;
+            // as a signed field, any width up to 64 takes the raw bits.
+            this->box.set_field(key, bit, width, true, (int64_t)value);
+            break;
+        }
+
+        case REPL_CLEAR_BIT:
+        {
+            std::string key = r.get_string();
+            int64_t bit = r.get<int64_t>();
+            if(!r.ok)
+                return false;
+            this->box.change_bit(key, bit, 0);
+            break;
+        }
+
+        case REPL_DELETE:
+        {
+            std::string key = r.get_string();
+            if(!r.ok)
+                return false;
+            this->box.delete_key(key);
+            break;
+        }
+
+        case REPL_SNAPSHOT_END:
+        case REPL_HEARTBEAT:
+            break;
+
+        default:
+            return false;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mu);
+    if(type == REPL_SNAPSHOT_BEGIN)
+        this->synced = false;
+    else if(type == REPL_SNAPSHOT_END)
+        this->synced = true;
+    this->applied_seq = seq;
+    this->applied_usec = usec;
+    return true;
+}
+
+// repl_lag_ms is how old the primary's state was when it produced the last
+// thing the replica applied.  an idle, caught up replica sees a heartbeat
+// every REPL_HEARTBEAT_MS, so that's about as low as it goes; one that's
+// behind, copying, or cut off keeps climbing.
+void ReplicationReplica::get_stats(std::map<std::string, int64_t> & stats)
+{
+    std::lock_guard<std::mutex> lock(this->mu);
+    stats["repl_connected"] = this->connected;
+    stats["repl_synced"] = this->synced;
+    stats["repl_applied_seq"] = this->applied_seq;
+    stats["repl_lag_ms"] = this->applied_usec ? MAX(0, (now_usec() - this->applied_usec) / 1000) : -1;
+}
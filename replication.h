@@ -0,0 +1,109 @@
+#ifndef __REPLICATION_H__
+#define __REPLICATION_H__
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+
+#include "bitbox.h"
+
+// asynchronous primary -> replica replication.
+//
+// a primary listens on its own port.  each replica that connects is sent a
+// copy of everything (the arrays in memory, then the rest of data/), then
+// every change made since the copy was started, then changes as they happen.
+// a change either sets or clears bits or replaces or deletes a whole key, so
+// replaying one on top of a key that already has it changes nothing.  that's
+// what lets the copy of a disk key be read after the fact, when it may
+// already include some of the changes queued behind it.
+//
+// the stream is a series of records, each
+//
+//     uint32 length of the rest, uint8 type, uint64 seq, int64 usec
+//
+// followed by a body that depends on the type.  seq counts changes on the
+// primary and usec is its wall clock when the record was made, which is what
+// the replica's lag is measured against.  integers are in host byte order,
+// like the data files, so primary and replicas must share an architecture.
+//
+// a replica that disconnects, or falls REPL_MAX_BACKLOG behind, starts over
+// with a fresh copy when it reconnects.
+
+struct ReplicaLink;
+
+class ReplicationPrimary : public BitboxListener {
+private:
+    Bitbox & box;
+    int port;
+    int listen_fd;
+    volatile bool stopping;
+    std::thread accept_thread;
+
+    std::mutex mu; // guards everything below
+    uint64_t seq;  // of the last change
+    std::list<ReplicaLink *> links;
+
+    void accept_loop();
+    void reap_links(bool all);
+    void serve_replica(ReplicaLink * link);
+    bool send_snapshot(ReplicaLink * link);
+    void queue(uint8_t type, const std::string & body);
+
+public:
+    ReplicationPrimary(Bitbox & box, int port);
+    ~ReplicationPrimary();
+
+    // binds the listening socket.  returns false (with errno set) on failure.
+    bool listen();
+
+    // accepts replicas in a background thread until stop() is called.
+    void start();
+    void stop();
+
+    void get_stats(std::map<std::string, int64_t> & stats);
+
+    void bits_set(const std::string & key, const int64_t * bits, size_t nbits);
+    void range_set(const std::string & key, int64_t start_bit, int64_t end_bit);
+    void bitmap_ored(const std::string & key, int64_t start_bit, const uint8_t * bitmap, int64_t nbytes);
+    void bit_cleared(const std::string & key, int64_t bit);
+    void field_set(const std::string & key, int64_t bit, int width, uint64_t value);
+    void array_replaced(const std::string & key, Bitarray * b);
+    void key_deleted(const std::string & key);
+};
+
+class ReplicationReplica {
+private:
+    Bitbox & box;
+    std::string host;
+    int port;
+    volatile bool stopping;
+    std::thread thread;
+
+    std::mutex mu; // guards everything below
+    int fd;
+    bool connected;
+    bool synced;          // has a complete copy, give or take lag
+    uint64_t applied_seq; // of the last change applied
+    int64_t applied_usec; // the primary's clock when it sent that record
+
+    void run();
+    int connect_to_primary();
+    void follow(int fd);
+    bool apply(uint8_t type, uint64_t seq, int64_t usec, const uint8_t * body, size_t len);
+
+public:
+    ReplicationReplica(Bitbox & box, const std::string & host, int port);
+    ~ReplicationReplica();
+
+    // follows the primary in a background thread, reconnecting as needed,
+    // until stop() is called.
+    void start();
+    void stop();
+
+    void get_stats(std::map<std::string, int64_t> & stats);
+};
+
+#endif
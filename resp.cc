@@ -0,0 +1,796 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+
+#include "resp.h"
+
+#define RESP_MAX_EVENTS         256
+#define RESP_READ_SIZE          (64*1024)
+#define RESP_MAX_BULK_LENGTH    (64*1024*1024)
+#define RESP_MAX_ARGS           (1024*1024)
+
+// the most of a connection's input we'll hold unparsed.  a command still
+// incomplete at this size can never arrive whole, so it's refused.  there's
+// room for one argument of the biggest size and the rest of its command.
+#define RESP_MAX_COMMAND        (RESP_MAX_BULK_LENGTH + 1024*1024)
+
+// stop reading and parsing a connection's input while this much output is
+// waiting for it to be read, so one client can't pipeline us out of memory.
+#define RESP_MAX_PENDING_OUTPUT (64*1024*1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct RespConnection {
+    int fd;
+    std::string in;
+    size_t in_pos;                // parsed up to here
+    std::vector<std::string> out; // replies waiting to be written
+    size_t out_sent;              // bytes of out[0] already written
+    size_t out_bytes;             // total unwritten bytes in out
+    bool readable;                // the socket may have unread input
+    bool writable;                // the socket may accept more output
+    bool eof;
+    bool closing;                 // close once out is written
+    bool blocked;                 // stopped parsing because of backed up output
+    bool active;                  // on the loop's active list
+
+    RespConnection(int fd)
+        : fd(fd), in_pos(0), out_sent(0), out_bytes(0), readable(false),
+          writable(true), eof(false), closing(false), blocked(false), active(false)
+    {}
+
+    void reply(const std::string & s)
+    {
+        this->out.push_back(s);
+        this->out_bytes += s.size();
+    }
+
+    void reply_integer(int64_t n)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), ":%" PRId64 "\r\n", n);
+        this->reply(buf);
+    }
+
+    void reply_error(const char * msg)
+    {
+        this->reply(std::string("-ERR ") + msg + "\r\n");
+    }
+
+    void reply_bulk(const std::string & s)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "$%zu\r\n", s.size());
+        this->reply(buf + s + "\r\n");
+    }
+};
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static bool parse_int64(const std::string & s, int64_t * out)
+{
+    if(s.empty())
+        return false;
+    char * end;
+    errno = 0;
+    long long n = strtoll(s.c_str(), &end, 10);
+    if(errno || *end)
+        return false;
+    *out = n;
+    return true;
+}
+
+// redis-style byte index normalization: negative indexes count back from
+// the end, and the result is clamped to [0, len-1].  returns false if the
+// range is empty.
+static bool normalize_byte_range(int64_t len, int64_t * start, int64_t * end)
+{
+    if(*start < 0) *start = MAX(0, len + *start);
+    if(*end < 0)   *end = len + *end;
+    if(*end >= len) *end = len - 1;
+    return *start <= *end && len > 0;
+}
+
+// a BITFIELD type: i or u and a width, such as i5 or u63.
+static bool parse_field_type(const std::string & s, int * width, bool * is_signed)
+{
+    int64_t n;
+    if(s.size() < 2 || (tolower(s[0]) != 'i' && tolower(s[0]) != 'u') || !parse_int64(s.substr(1), &n) || n < 1 || n > 64)
+        return false;
+    *width = n;
+    *is_signed = tolower(s[0]) == 'i';
+    return Bitbox::field_ok(0, *width, *is_signed);
+}
+
+// a BITFIELD offset: a bit, or #n for the nth field of this width.
+static bool parse_field_offset(const std::string & s, int width, int64_t * bit)
+{
+    bool fields = !s.empty() && s[0] == '#';
+    if(!parse_int64(fields ? s.substr(1) : s, bit) || *bit < 0)
+        return false;
+    if(fields)
+    {
+        if(*bit > INT64_MAX / width)
+            return false;
+        *bit *= width;
+    }
+    return true;
+}
+
+RespServer::RespServer(BitboxPartitions & boxes, int port)
+    : boxes(boxes), written(boxes.size(), false), port(port), listen_fd(-1), epoll_fd(-1), wake_fd(-1), stopping(false), read_only(false)
+{
+}
+
+RespServer::~RespServer()
+{
+    if(this->listen_fd != -1) close(this->listen_fd);
+    if(this->epoll_fd != -1)  close(this->epoll_fd);
+    if(this->wake_fd != -1)   close(this->wake_fd);
+}
+
+bool RespServer::listen(bool shared)
+{
+    this->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(this->listen_fd == -1)
+        return false;
+
+    int one = 1;
+    setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(shared && setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+        return false;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(this->port);
+
+    if(bind(this->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            ::listen(this->listen_fd, 511) == -1 ||
+            !set_nonblocking(this->listen_fd))
+        return false;
+
+    this->epoll_fd = epoll_create1(0);
+    this->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(this->epoll_fd == -1 || this->wake_fd == -1)
+        return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &this->listen_fd;
+    if(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->listen_fd, &ev) == -1)
+        return false;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &this->wake_fd;
+    return epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->wake_fd, &ev) != -1;
+}
+
+void RespServer::stop()
+{
+    this->stopping = true;
+    uint64_t one = 1;
+    if(write(this->wake_fd, &one, sizeof(one)) == -1)
+        perror("resp: stop");
+}
+
+void RespServer::accept_connections()
+{
+    for(;;)
+    {
+        int fd = accept(this->listen_fd, NULL, NULL);
+        if(fd == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("resp: accept");
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        set_nonblocking(fd);
+
+        RespConnection * c = new RespConnection(fd);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            perror("resp: epoll_ctl");
+            close(fd);
+            delete c;
+        }
+    }
+}
+
+void RespServer::close_connection(RespConnection * c)
+{
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    delete c;
+}
+
+// reads until the socket runs dry (as edge triggering requires), or until
+// we've buffered as much as we're willing to.  returns false on error.
+bool RespServer::read_from(RespConnection * c)
+{
+    char buf[RESP_READ_SIZE];
+
+    while(c->readable && c->in.size() - c->in_pos < RESP_MAX_COMMAND)
+    {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if(n > 0)
+            c->in.append(buf, n);
+        else if(n == 0)
+        {
+            c->eof = true;
+            c->readable = false;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+            c->readable = false;
+        else if(errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
+// sends as much pending output as possible with one writev().  returns false
+// on error.
+bool RespServer::flush(RespConnection * c)
+{
+    if(c->out.empty() || !c->writable)
+        return true;
+
+    struct iovec iov[IOV_MAX];
+    int n = 0;
+    for(size_t i = 0; i < c->out.size() && n < IOV_MAX; i++, n++)
+    {
+        size_t skip = i == 0 ? c->out_sent : 0;
+        iov[n].iov_base = (void *)(c->out[i].data() + skip);
+        iov[n].iov_len = c->out[i].size() - skip;
+    }
+
+    ssize_t written = writev(c->fd, iov, n);
+    if(written == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            c->writable = false;
+            return true;
+        }
+        return errno == EINTR;
+    }
+
+    c->out_bytes -= written;
+    size_t done = 0;
+    while(done < c->out.size() && (size_t)written >= c->out[done].size() - c->out_sent)
+    {
+        written -= c->out[done].size() - c->out_sent;
+        c->out_sent = 0;
+        done++;
+    }
+    c->out_sent += written;
+    c->out.erase(c->out.begin(), c->out.begin() + done);
+
+    // a short write means the socket buffer is full, and we'll hear about it
+    // when there's room again.
+    if(!c->out.empty() && done < (size_t)n)
+        c->writable = false;
+    return true;
+}
+
+// pulls one complete command out of the input buffer.  returns false if
+// there isn't a whole one yet, or if the input is malformed (in which case
+// the connection is marked for closing).
+bool RespServer::parse_command(RespConnection * c, std::vector<std::string> & argv)
+{
+    const std::string & in = c->in;
+    size_t pos = c->in_pos;
+    argv.clear();
+
+    if(pos >= in.size())
+        return false;
+
+    if(in[pos] != '*')
+    {
+        // an inline command, as typed into telnet.
+        size_t eol = in.find('\n', pos);
+        if(eol == std::string::npos)
+            return false;
+        size_t end = eol > pos && in[eol - 1] == '\r' ? eol - 1 : eol;
+        size_t i = pos;
+        while(i < end)
+        {
+            while(i < end && in[i] == ' ') i++;
+            size_t j = i;
+            while(j < end && in[j] != ' ') j++;
+            if(j > i)
+                argv.push_back(in.substr(i, j - i));
+            i = j;
+        }
+        c->in_pos = eol + 1;
+        return true;
+    }
+
+    size_t eol = in.find("\r\n", pos);
+    if(eol == std::string::npos)
+        return false;
+
+    int64_t argc;
+    if(!parse_int64(in.substr(pos + 1, eol - pos - 1), &argc) || argc > RESP_MAX_ARGS)
+    {
+        c->reply_error("Protocol error: invalid multibulk length");
+        c->closing = true;
+        return false;
+    }
+    pos = eol + 2;
+
+    for(int64_t i = 0; i < argc; i++)
+    {
+        eol = in.find("\r\n", pos);
+        if(eol == std::string::npos)
+            return false;
+
+        int64_t len;
+        if(in[pos] != '$' || !parse_int64(in.substr(pos + 1, eol - pos - 1), &len) ||
+                len < 0 || len > RESP_MAX_BULK_LENGTH)
+        {
+            c->reply_error("Protocol error: invalid bulk length");
+            c->closing = true;
+            return false;
+        }
+        pos = eol + 2;
+
+        if(in.size() < pos + len + 2)
+            return false;
+        argv.push_back(in.substr(pos, len));
+        pos += len + 2;
+    }
+
+    c->in_pos = pos;
+    return true;
+}
+
+// runs every complete command in the input buffer, unless too much output
+// backs up first.  returns true if any of them may have modified the box.
+bool RespServer::process_input(RespConnection * c)
+{
+    std::vector<std::string> argv;
+    bool wrote = false;
+
+    c->blocked = false;
+    while(!c->closing)
+    {
+        if(c->out_bytes >= RESP_MAX_PENDING_OUTPUT)
+        {
+            c->blocked = true;
+            break;
+        }
+        if(!this->parse_command(c, argv))
+        {
+            if(!c->closing && c->in.size() - c->in_pos >= RESP_MAX_COMMAND)
+            {
+                c->reply_error("Protocol error: command too big");
+                c->closing = true;
+            }
+            break;
+        }
+        if(!argv.empty() && this->execute(c, argv))
+            wrote = true;
+    }
+
+    // don't let the consumed part of the buffer pile up.
+    if(c->in_pos > 0 && c->in_pos * 2 >= c->in.size())
+    {
+        c->in.erase(0, c->in_pos);
+        c->in_pos = 0;
+    }
+
+    return wrote;
+}
+
+// the box that owns key, noted for maintenance if the command writes.
+Bitbox & RespServer::box_for(const std::string & key, bool writing)
+{
+    int p = Bitbox::partition_for(key, this->boxes.size());
+    if(writing)
+        this->written[p] = true;
+    return this->boxes[p];
+}
+
+// whether a command's keys are all ones the box can hold (see
+// Bitbox::key_ok()).  BITOP's start after the operation, DEL takes any number,
+// and the other commands on keys take one, first.
+static bool keys_ok(const std::string & cmd, const std::vector<std::string> & argv)
+{
+    size_t first = 1, end = argv.size();
+    if(cmd == "BITOP")
+        first = 2;
+    else if(cmd != "DEL")
+    {
+        if(cmd != "GETBIT" && cmd != "SETBIT" && cmd != "BITCOUNT" && cmd != "BITPOS" &&
+                cmd != "BITFIELD" && cmd != "BITFIELD_RO" && cmd != "EXPIRE" && cmd != "TTL")
+            return true;
+        end = argv.size() > 1 ? 2 : 1;
+    }
+
+    for(size_t i = first; i < end; i++)
+        if(!Bitbox::key_ok(argv[i]))
+            return false;
+    return true;
+}
+
+// runs one command and queues its reply.  returns true if it may have
+// modified the box.
+bool RespServer::execute(RespConnection * c, std::vector<std::string> & argv)
+{
+    std::string & cmd = argv[0];
+    for(size_t i = 0; i < cmd.size(); i++)
+        cmd[i] = toupper(cmd[i]);
+    size_t argc = argv.size();
+
+    if(cmd == "PING")
+    {
+        if(argc > 1)
+            c->reply_bulk(argv[1]);
+        else
+            c->reply("+PONG\r\n");
+    }
+    else if(cmd == "QUIT")
+    {
+        c->reply("+OK\r\n");
+        c->closing = true;
+    }
+    else if(cmd == "COMMAND")
+    {
+        c->reply("*0\r\n");
+    }
+    else if(this->read_only && (cmd == "SETBIT" || cmd == "BITOP" || cmd == "EXPIRE" || cmd == "DEL"))
+    {
+        c->reply("-READONLY You can't write against a read only replica.\r\n");
+    }
+    else if(!keys_ok(cmd, argv))
+    {
+        c->reply_error("keys can't start with a dot");
+    }
+    else if(cmd == "GETBIT")
+    {
+        int64_t bit;
+        if(argc != 3)
+            c->reply_error("wrong number of arguments for 'getbit' command");
+        else if(!parse_int64(argv[2], &bit) || bit < 0)
+            c->reply_error("bit offset is not an integer or out of range");
+        else
+            c->reply_integer(this->box_for(argv[1], false).get_bit(argv[1], bit));
+    }
+    else if(cmd == "SETBIT")
+    {
+        int64_t bit, value;
+        if(argc != 4)
+            c->reply_error("wrong number of arguments for 'setbit' command");
+        else if(!parse_int64(argv[2], &bit) || bit < 0)
+            c->reply_error("bit offset is not an integer or out of range");
+        else if(!parse_int64(argv[3], &value) || (value != 0 && value != 1))
+            c->reply_error("bit is not an integer or out of range");
+        else
+        {
+            c->reply_integer(this->box_for(argv[1], true).change_bit(argv[1], bit, value));
+            return true;
+        }
+    }
+    else if(cmd == "BITCOUNT")
+    {
+        int64_t start = 0, end = -1;
+        if(argc != 2 && argc != 4)
+            c->reply_error("wrong number of arguments for 'bitcount' command");
+        else if(argc == 4 && (!parse_int64(argv[2], &start) || !parse_int64(argv[3], &end)))
+            c->reply_error("value is not an integer or out of range");
+        else if(argc == 2)
+            c->reply_integer(this->box_for(argv[1], false).count_bits(argv[1], 0, INT64_MAX));
+        else if(!normalize_byte_range(this->box_for(argv[1], false).byte_length(argv[1]), &start, &end))
+            c->reply_integer(0);
+        else
+            c->reply_integer(this->box_for(argv[1], false).count_bits(argv[1], start * 8, (end + 1) * 8));
+    }
+    else if(cmd == "BITPOS")
+    {
+        int64_t value, start = 0, end = -1;
+        if(argc < 3 || argc > 5)
+            c->reply_error("wrong number of arguments for 'bitpos' command");
+        else if(!parse_int64(argv[2], &value) || (value != 0 && value != 1))
+            c->reply_error("The bit argument must be 1 or 0.");
+        else if((argc > 3 && !parse_int64(argv[3], &start)) || (argc > 4 && !parse_int64(argv[4], &end)))
+            c->reply_error("value is not an integer or out of range");
+        else
+        {
+            Bitbox & box = this->box_for(argv[1], false);
+            int64_t len = box.byte_length(argv[1]);
+            bool end_given = argc > 4;
+
+            if(len == 0)
+                c->reply_integer(value ? -1 : 0);
+            else if(!normalize_byte_range(len, &start, &end))
+                c->reply_integer(-1);
+            else if(end_given || value)
+                c->reply_integer(box.find_bit(argv[1], value, start * 8, (end + 1) * 8));
+            else
+                // with no end given, a search for a zero may run off the end
+                // of the data, where everything is zero.
+                c->reply_integer(box.find_bit(argv[1], 0, start * 8, INT64_MAX));
+        }
+    }
+    else if(cmd == "BITOP")
+    {
+        std::string op = argc > 1 ? argv[1] : "";
+        for(size_t i = 0; i < op.size(); i++)
+            op[i] = toupper(op[i]);
+
+        BitboxBitop bitop;
+        bool known = true;
+        if(op == "AND")      bitop = BITBOX_BITOP_AND;
+        else if(op == "OR")  bitop = BITBOX_BITOP_OR;
+        else if(op == "XOR") bitop = BITBOX_BITOP_XOR;
+        else if(op == "NOT") bitop = BITBOX_BITOP_NOT;
+        else known = false;
+
+        if(argc < 4)
+            c->reply_error("wrong number of arguments for 'bitop' command");
+        else if(!known)
+            c->reply_error("syntax error");
+        else if(bitop == BITBOX_BITOP_NOT && argc != 4)
+            c->reply_error("BITOP NOT must be called with a single source key.");
+        else
+        {
+            // one box has to see every key at once, as redis cluster
+            // requires of its slots.
+            int n = this->boxes.size();
+            int p = Bitbox::partition_for(argv[2], n);
+            bool together = true;
+            for(size_t i = 3; i < argc && together; i++)
+                together = Bitbox::partition_for(argv[i], n) == p;
+
+            if(!together)
+                c->reply("-CROSSSLOT Keys in request don't hash to the same partition\r\n");
+            else
+            {
+                std::vector<std::string> sources(argv.begin() + 3, argv.end());
+                c->reply_integer(this->box_for(argv[2], true).bitop(bitop, argv[2], sources));
+                return true;
+            }
+        }
+    }
+    else if(cmd == "BITFIELD" || cmd == "BITFIELD_RO")
+    {
+        std::vector<BitboxOp> ops;
+        BitboxOverflow overflow = BITBOX_OVERFLOW_WRAP;
+        bool writes = false;
+        const char * error = argc < 2 ? "wrong number of arguments for 'bitfield' command" : NULL;
+
+        for(size_t i = 2; i < argc && !error; )
+        {
+            std::string sub = argv[i];
+            for(size_t j = 0; j < sub.size(); j++)
+                sub[j] = toupper(sub[j]);
+
+            if(sub == "OVERFLOW" && i + 1 < argc)
+            {
+                std::string how = argv[i + 1];
+                for(size_t j = 0; j < how.size(); j++)
+                    how[j] = toupper(how[j]);
+                if(how == "WRAP")      overflow = BITBOX_OVERFLOW_WRAP;
+                else if(how == "SAT")  overflow = BITBOX_OVERFLOW_SAT;
+                else if(how == "FAIL") overflow = BITBOX_OVERFLOW_FAIL;
+                else error = "Invalid OVERFLOW type specified";
+                i += 2;
+                continue;
+            }
+
+            BitboxOp op = BitboxOp();
+            size_t nargs = 0;
+            if(sub == "GET")         { op.type = BITBOX_OP_GET_FIELD;  nargs = 2; }
+            else if(sub == "SET")    { op.type = BITBOX_OP_SET_FIELD;  nargs = 3; }
+            else if(sub == "INCRBY") { op.type = BITBOX_OP_INCR_FIELD; nargs = 3; }
+
+            if(!nargs || i + nargs >= argc)
+                error = "syntax error";
+            else if(!parse_field_type(argv[i + 1], &op.width, &op.is_signed))
+                error = "Invalid bitfield type. Use something like i16 u8. Note that u64 is not supported but i64 is.";
+            else if(!parse_field_offset(argv[i + 2], op.width, &op.bit))
+                error = "bit offset is not an integer or out of range";
+            else if(nargs == 3 && !parse_int64(argv[i + 3], &op.value))
+                error = "value is not an integer or out of range";
+            else if(nargs == 3 && cmd == "BITFIELD_RO")
+                error = "BITFIELD_RO only supports the GET subcommand";
+
+            op.key = &argv[1];
+            op.overflow = overflow;
+            writes = writes || bitbox_op_writes(op.type);
+            ops.push_back(op);
+            i += nargs + 1;
+        }
+
+        if(error)
+            c->reply_error(error);
+        else if(writes && this->read_only)
+            c->reply("-READONLY You can't write against a read only replica.\r\n");
+        else
+        {
+            // all of the subcommands run as one batch, so nothing else gets
+            // at the key between them.
+            if(!ops.empty())
+                this->box_for(argv[1], writes).execute_batch(ops);
+
+            char buf[32];
+            snprintf(buf, sizeof(buf), "*%zu\r\n", ops.size());
+            std::string reply = buf;
+            for(size_t i = 0; i < ops.size(); i++)
+            {
+                if(ops[i].failed)
+                    reply += "$-1\r\n";
+                else
+                {
+                    snprintf(buf, sizeof(buf), ":%" PRId64 "\r\n", ops[i].result);
+                    reply += buf;
+                }
+            }
+            c->reply(reply);
+            return writes;
+        }
+    }
+    else if(cmd == "EXPIRE")
+    {
+        int64_t seconds;
+        if(argc != 3)
+            c->reply_error("wrong number of arguments for 'expire' command");
+        else if(!parse_int64(argv[2], &seconds))
+            c->reply_error("value is not an integer or out of range");
+        else
+        {
+            c->reply_integer(this->box_for(argv[1], true).expire(argv[1], seconds));
+            return true;
+        }
+    }
+    else if(cmd == "TTL")
+    {
+        if(argc != 2)
+            c->reply_error("wrong number of arguments for 'ttl' command");
+        else
+            c->reply_integer(this->box_for(argv[1], false).ttl(argv[1]));
+    }
+    else if(cmd == "DEL")
+    {
+        if(argc < 2)
+            c->reply_error("wrong number of arguments for 'del' command");
+        else
+        {
+            int64_t deleted = 0;
+            for(size_t i = 1; i < argc; i++)
+                deleted += this->box_for(argv[i], true).delete_key(argv[i]);
+            c->reply_integer(deleted);
+            return true;
+        }
+    }
+    else
+    {
+        std::string msg = "unknown command '" + argv[0] + "'";
+        c->reply_error(msg.c_str());
+    }
+
+    return false;
+}
+
+void RespServer::run()
+{
+    struct epoll_event events[RESP_MAX_EVENTS];
+
+    // connections with work to do: events arrived, or input is still waiting
+    // behind a backlog of output.
+    std::vector<RespConnection *> active;
+
+    while(!this->stopping)
+    {
+        int n = epoll_wait(this->epoll_fd, events, RESP_MAX_EVENTS, active.empty() ? -1 : 0);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("resp: epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == &this->listen_fd)
+            {
+                this->accept_connections();
+                continue;
+            }
+            if(events[i].data.ptr == &this->wake_fd)
+                continue;
+
+            RespConnection * c = (RespConnection *)events[i].data.ptr;
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                c->readable = true;
+            if(events[i].events & EPOLLOUT)
+                c->writable = true;
+            if(!c->active)
+            {
+                c->active = true;
+                active.push_back(c);
+            }
+        }
+
+        bool wrote = false;
+        std::vector<RespConnection *> still_active;
+
+        for(size_t i = 0; i < active.size(); i++)
+        {
+            RespConnection * c = active[i];
+            bool ok = true;
+
+            if(c->out_bytes < RESP_MAX_PENDING_OUTPUT)
+                ok = this->read_from(c);
+            if(ok && this->process_input(c))
+                wrote = true;
+            if(ok)
+                ok = this->flush(c);
+
+            // at eof, anything left unparsed is an incomplete command that
+            // will never be finished.
+            if(!ok || (c->out.empty() && (c->closing || c->eof)))
+            {
+                this->close_connection(c);
+                continue;
+            }
+
+            // stay on the list while there's input we haven't gotten to, or
+            // output that didn't fit in one writev.  otherwise the next epoll
+            // event brings us back.
+            if(((c->readable || c->blocked) && c->out_bytes < RESP_MAX_PENDING_OUTPUT) ||
+                    (c->writable && !c->out.empty()))
+                still_active.push_back(c);
+            else
+                c->active = false;
+        }
+
+        active.swap(still_active);
+
+        if(wrote)
+            for(size_t p = 0; p < this->written.size(); p++)
+                if(this->written[p])
+                {
+                    this->written[p] = false;
+                    this->boxes[p].run_maintenance_step();
+                }
+    }
+
+    for(size_t i = 0; i < active.size(); i++)
+        active[i]->active = false;
+}
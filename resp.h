@@ -0,0 +1,64 @@
+#ifndef __RESP_H__
+#define __RESP_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "partitions.h"
+
+// a front end that speaks the redis protocol (RESP), so redis clients can
+// use GETBIT, SETBIT, BITCOUNT, BITPOS, BITOP, BITFIELD, EXPIRE, TTL and DEL
+// against the same Bitbox the thrift server uses.
+//
+// it runs its own edge-triggered epoll loop in whichever thread calls run().
+// clients may pipeline as many commands as they like; every reply produced
+// while handling one loop iteration's worth of events is sent back with a
+// single writev() per connection.
+//
+// with several partitions, each command goes straight to the box that owns
+// its key, and several servers can share a port (see listen()), one per core,
+// so that no one loop is in the way of the rest.
+
+struct RespConnection;
+
+class RespServer {
+private:
+    BitboxPartitions & boxes;
+    std::vector<bool> written; // boxes to run maintenance on
+    int port;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;  // eventfd used by stop()
+    volatile bool stopping;
+    bool read_only;
+
+    void accept_connections();
+    bool read_from(RespConnection * c);
+    bool flush(RespConnection * c);
+    void close_connection(RespConnection * c);
+    bool process_input(RespConnection * c);
+    bool parse_command(RespConnection * c, std::vector<std::string> & argv);
+    bool execute(RespConnection * c, std::vector<std::string> & argv);
+    Bitbox & box_for(const std::string & key, bool writing);
+
+public:
+    RespServer(BitboxPartitions & boxes, int port);
+    ~RespServer();
+
+    // refuse commands that write, as on a replica.
+    void set_read_only(bool read_only) { this->read_only = read_only; }
+
+    // binds the listening socket.  returns false (with errno set) on failure.
+    // servers that listen shared on the same port each get their own socket,
+    // with SO_REUSEPORT, and the kernel spreads new connections among them.
+    bool listen(bool shared = false);
+
+    // serves until stop() is called.
+    void run();
+
+    // may be called from any thread.
+    void stop();
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <algorithm>
+
+#include "bitbox.h"
+#include "ring.h"
+
+static uint64_t ring_hash(const char * data, size_t len)
+{
+    return MurmurHash(data, len, 0);
+}
+
+void HashRing::add_node(int node, const std::string & name)
+{
+    for(int i = 0; i < RING_VNODES; i++)
+    {
+        char point[32];
+        std::string s = name;
+        snprintf(point, sizeof(point), "#%d", i);
+        s += point;
+        this->points.push_back(std::make_pair(ring_hash(s.data(), s.size()), node));
+    }
+    std::sort(this->points.begin(), this->points.end());
+}
+
+int HashRing::node_for(const std::string & key) const
+{
+    if(this->points.empty())
+        return -1;
+
+    std::pair<uint64_t, int> k(ring_hash(key.data(), key.size()), -1);
+    std::vector<std::pair<uint64_t, int> >::const_iterator it =
+        std::lower_bound(this->points.begin(), this->points.end(), k);
+    if(it == this->points.end())
+        it = this->points.begin();
+    return it->second;
+}
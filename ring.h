@@ -0,0 +1,27 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a consistent hash ring.  each node is placed at RING_VNODES points around
+// it, and a key belongs to the node at the first point at or after the key's
+// own hash.  adding a node only takes keys away from the others, about
+// 1/n of them, rather than reshuffling everything.
+#define RING_VNODES 160
+
+class HashRing {
+private:
+    // (position, node), sorted
+    std::vector<std::pair<uint64_t, int> > points;
+
+public:
+    void add_node(int node, const std::string & name);
+
+    // -1 if the ring is empty.
+    int node_for(const std::string & key) const;
+};
+
+#endif
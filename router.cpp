@@ -0,0 +1,770 @@
+// bitbox-router: speaks the bitbox.thrift interface on behalf of several
+// bitbox-servers, placing each key on one of them with a consistent hash ring.
+//
+//     bitbox-router [-p port] [-t threads] host:port host:port ...
+//
+// batches that touch keys on several servers are split up and sent to all of
+// them at once.  add_node() brings a new server in while running: the ring
+// switches over immediately, and a background thread walks the old servers'
+// keys moving the ones that now belong elsewhere.  until it's done, any
+// request for a key that's due to move moves it first, so nothing is ever
+// read from the wrong place.
+
+#include "BitboxRouter.h"
+#include <protocol/TBinaryProtocol.h>
+#include <server/TNonblockingServer.h>
+#include <transport/TSocket.h>
+#include <transport/TBufferTransports.h>
+#include <concurrency/ThreadManager.h>
+#include <concurrency/PosixThreadFactory.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ring.h"
+
+using namespace ::apache::thrift;
+using namespace ::apache::thrift::protocol;
+using namespace ::apache::thrift::transport;
+using namespace ::apache::thrift::server;
+using namespace ::apache::thrift::concurrency;
+
+using boost::shared_ptr;
+
+// how many keys the rebalancer asks a server for at a time.
+#define ROUTER_SCAN_BATCH 1000
+
+// one backend server, with a pool of connections to it so several requests
+// can be talking to it at once.
+struct BackendNode {
+    std::string host;
+    int port;
+    std::string name;
+
+    std::mutex mu;
+    std::vector<BitboxClient *> idle;
+
+    BackendNode(const std::string & host, int port)
+        : host(host), port(port)
+    {
+        char buf[16];
+        snprintf(buf, sizeof(buf), ":%d", port);
+        this->name = host + buf;
+    }
+
+    BitboxClient * acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mu);
+            if(!this->idle.empty())
+            {
+                BitboxClient * client = this->idle.back();
+                this->idle.pop_back();
+                return client;
+            }
+        }
+
+        shared_ptr<TSocket> socket(new TSocket(this->host, this->port));
+        shared_ptr<TTransport> transport(new TFramedTransport(socket));
+        shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport));
+        transport->open();
+        return new BitboxClient(protocol);
+    }
+
+    // a connection that saw an error is thrown away rather than reused.
+    void release(BitboxClient * client, bool ok)
+    {
+        if(!ok)
+        {
+            delete client;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->idle.push_back(client);
+    }
+};
+
+// borrows a connection for the length of a scope.  call done() once the
+// call has succeeded, so the connection goes back in the pool.
+class NodeConnection {
+    private:
+        BackendNode * node;
+        BitboxClient * client;
+        bool ok;
+    public:
+        NodeConnection(BackendNode * node)
+            : node(node), client(node->acquire()), ok(false)
+        {}
+        ~NodeConnection() { this->node->release(this->client, this->ok); }
+        BitboxClient * operator->() { return this->client; }
+        void done() { this->ok = true; }
+};
+
+// holds the ring lock for reading for the length of a scope.
+class RingReadLock {
+    private:
+        pthread_rwlock_t * lock;
+    public:
+        RingReadLock(pthread_rwlock_t * lock) : lock(lock) { pthread_rwlock_rdlock(lock); }
+        ~RingReadLock() { pthread_rwlock_unlock(this->lock); }
+};
+
+class RouterHandler : virtual public BitboxRouterIf {
+    private:
+        // nodes and the rings only change with ring_lock held for writing.
+        // requests hold it for reading from routing through to the reply, so
+        // a new ring never takes effect while a request is using the old one.
+        pthread_rwlock_t ring_lock;
+        std::vector<BackendNode *> nodes;
+        HashRing ring;
+        HashRing old_ring; // the ring before the last add_node(), while rebalancing
+        bool rebalancing;
+        std::thread rebalancer;
+
+        // keys moved since the rebalance began.  moves happen one at a time.
+        std::mutex move_mu;
+        std::set<std::string> moved;
+        int64_t keys_moved;
+
+        // copies key from one server to another and removes it from the
+        // first, unless that's already been done.
+        void move_key(const std::string & key, BackendNode * from, BackendNode * to)
+        {
+            std::lock_guard<std::mutex> lock(this->move_mu);
+            if(this->moved.count(key))
+                return;
+
+            std::string data;
+            int64_t ttl;
+            {
+                NodeConnection c(from);
+                ttl = c->ttl(key);
+                c->dump_key(data, key);
+                c.done();
+            }
+            if(!data.empty())
+            {
+                NodeConnection c(to);
+                c->merge_key(key, data);
+                if(ttl >= 0)
+                    c->expire(key, std::max(ttl, (int64_t)1));
+                c.done();
+            }
+            {
+                NodeConnection c(from);
+                c->drop_key(key);
+                c.done();
+            }
+
+            this->moved.insert(key);
+            this->keys_moved++;
+        }
+
+        // keys starting with a dot are turned away here as the servers would
+        // (see Bitbox::key_ok()), before one could be moved between them.
+        void check_key(const std::string & key)
+        {
+            if(!key.empty() && key[0] == '.')
+            {
+                InvalidArgument ia;
+                ia.message = "keys can't start with a dot";
+                throw ia;
+            }
+        }
+
+        // the node that holds key, moving it there first if a rebalance
+        // means it's due to.  call with ring_lock held for reading.
+        int owner(const std::string & key)
+        {
+            int node = this->ring.node_for(key);
+            if(this->rebalancing)
+            {
+                int old_node = this->old_ring.node_for(key);
+                if(old_node != node)
+                    this->move_key(key, this->nodes[old_node], this->nodes[node]);
+            }
+            return node;
+        }
+
+        void rebalance(size_t old_node_count)
+        {
+            for(size_t i = 0; i < old_node_count; i++)
+            {
+                std::string after;
+                for(;;)
+                {
+                    std::vector<std::string> keys;
+                    try
+                    {
+                        NodeConnection c(this->nodes[i]);
+                        c->scan_keys(keys, after, ROUTER_SCAN_BATCH, "");
+                        c.done();
+                    }
+                    catch(TException & e)
+                    {
+                        fprintf(stderr, "router: scanning %s: %s\n", this->nodes[i]->name.c_str(), e.what());
+                        sleep(1);
+                        continue;
+                    }
+                    if(keys.empty())
+                        break;
+
+                    for(size_t k = 0; k < keys.size(); k++)
+                    {
+                        RingReadLock lock(&this->ring_lock);
+                        try
+                        {
+                            this->owner(keys[k]);
+                        }
+                        catch(TException & e)
+                        {
+                            fprintf(stderr, "router: moving %s: %s\n", keys[k].c_str(), e.what());
+                        }
+                    }
+                    after = keys.back();
+                }
+            }
+
+            pthread_rwlock_wrlock(&this->ring_lock);
+            this->rebalancing = false;
+            this->old_ring = this->ring;
+            {
+                std::lock_guard<std::mutex> lock(this->move_mu);
+                this->moved.clear();
+            }
+            pthread_rwlock_unlock(&this->ring_lock);
+            fprintf(stderr, "router: rebalance done.\n");
+        }
+
+    public:
+        RouterHandler(const std::vector<std::pair<std::string, int> > & backends)
+            : rebalancing(false), keys_moved(0)
+        {
+            pthread_rwlock_init(&this->ring_lock, NULL);
+            for(size_t i = 0; i < backends.size(); i++)
+            {
+                this->nodes.push_back(new BackendNode(backends[i].first, backends[i].second));
+                this->ring.add_node(i, this->nodes[i]->name);
+            }
+            this->old_ring = this->ring;
+        }
+
+        ~RouterHandler()
+        {
+            if(this->rebalancer.joinable())
+                this->rebalancer.join();
+            pthread_rwlock_destroy(&this->ring_lock);
+        }
+
+        bool add_node(const std::string & host, const int32_t port)
+        {
+            pthread_rwlock_wrlock(&this->ring_lock);
+            if(this->rebalancing)
+            {
+                pthread_rwlock_unlock(&this->ring_lock);
+                return false;
+            }
+
+            size_t old_node_count = this->nodes.size();
+            BackendNode * node = new BackendNode(host, port);
+            this->nodes.push_back(node);
+            this->old_ring = this->ring;
+            this->ring.add_node(old_node_count, node->name);
+            this->rebalancing = true;
+            pthread_rwlock_unlock(&this->ring_lock);
+
+            fprintf(stderr, "router: added %s, rebalancing.\n", node->name.c_str());
+            if(this->rebalancer.joinable())
+                this->rebalancer.join();
+            this->rebalancer = std::thread(&RouterHandler::rebalance, this, old_node_count);
+            return true;
+        }
+
+        bool get_bit(const std::string& key, const int64_t bit)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            bool value = c->get_bit(key, bit);
+            c.done();
+            return value;
+        }
+
+        void set_bit(const std::string& key, const int64_t bit)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            c->set_bit(key, bit);
+            c.done();
+        }
+
+        void set_bits(const std::string& key, const std::set<int64_t> & bits)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            c->set_bits(key, bits);
+            c.done();
+        }
+
+        void set_packed_bits(const std::string& key, const std::string& positions)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            c->set_packed_bits(key, positions);
+            c.done();
+        }
+
+        void or_bitmap(const std::string& key, const int64_t start_bit, const std::string& bitmap)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            try
+            {
+                c->or_bitmap(key, start_bit, bitmap);
+            }
+            catch(InvalidArgument & ia)
+            {
+                // the whole reply came back, so the connection is still good.
+                c.done();
+                throw;
+            }
+            c.done();
+        }
+
+        void get_range(std::string & _return, const std::string & key, const int64_t start_bit, const int64_t end_bit)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            try
+            {
+                c->get_range(_return, key, start_bit, end_bit);
+            }
+            catch(InvalidArgument & ia)
+            {
+                // the whole reply came back, so the connection is still good.
+                c.done();
+                throw;
+            }
+            c.done();
+        }
+
+        int64_t get_field(const std::string& key, const int64_t bit, const int32_t width, const bool is_signed)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            int64_t value;
+            try
+            {
+                value = c->get_field(key, bit, width, is_signed);
+            }
+            catch(InvalidArgument & ia)
+            {
+                // the whole reply came back, so the connection is still good.
+                c.done();
+                throw;
+            }
+            c.done();
+            return value;
+        }
+
+        int64_t set_field(const std::string& key, const int64_t bit, const int32_t width, const bool is_signed, const int64_t value)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            int64_t old;
+            try
+            {
+                old = c->set_field(key, bit, width, is_signed, value);
+            }
+            catch(InvalidArgument & ia)
+            {
+                // the whole reply came back, so the connection is still good.
+                c.done();
+                throw;
+            }
+            c.done();
+            return old;
+        }
+
+        int64_t incr_field(const std::string& key, const int64_t bit, const int32_t width, const bool is_signed, const int64_t by, const Overflow::type overflow)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            int64_t result;
+            try
+            {
+                result = c->incr_field(key, bit, width, is_signed, by, overflow);
+            }
+            catch(FieldOverflow & fo)
+            {
+                // the whole reply came back, so the connection is still good.
+                c.done();
+                throw;
+            }
+            catch(InvalidArgument & ia)
+            {
+                c.done();
+                throw;
+            }
+            c.done();
+            return result;
+        }
+
+        void execute_batch(std::vector<OpResult> & _return, const std::vector<Op> & ops)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            // split the ops up by node, remembering where each came from.
+            // ops on keys starting with a dot fail here, as the servers
+            // would fail them.
+            std::map<int, std::vector<size_t> > positions;
+            _return.resize(ops.size());
+            for(size_t i = 0; i < ops.size(); i++)
+            {
+                if(!ops[i].key.empty() && ops[i].key[0] == '.')
+                    _return[i].failed = true;
+                else
+                    positions[this->owner(ops[i].key)].push_back(i);
+            }
+            if(positions.empty())
+                return;
+
+            std::vector<std::future<void> > calls;
+            std::map<int, std::vector<size_t> >::iterator last = --positions.end();
+            for(std::map<int, std::vector<size_t> >::iterator it = positions.begin(); it != positions.end(); ++it)
+            {
+                BackendNode * node = this->nodes[it->first];
+                const std::vector<size_t> * where = &it->second;
+
+                std::function<void()> call = [node, where, &ops, &_return]() {
+                    std::vector<Op> node_ops;
+                    node_ops.reserve(where->size());
+                    for(size_t i = 0; i < where->size(); i++)
+                        node_ops.push_back(ops[(*where)[i]]);
+
+                    std::vector<OpResult> results;
+                    NodeConnection c(node);
+                    c->execute_batch(results, node_ops);
+                    c.done();
+
+                    for(size_t i = 0; i < where->size() && i < results.size(); i++)
+                        _return[(*where)[i]] = results[i];
+                };
+
+                // the last one runs here rather than in a thread of its own.
+                if(it == last)
+                    call();
+                else
+                    calls.push_back(std::async(std::launch::async, call));
+            }
+
+            for(size_t i = 0; i < calls.size(); i++)
+                calls[i].get();
+        }
+
+        // each server's counters, prefixed with its host:port, and the
+        // router's own.
+        void stats(std::map<std::string, int64_t> & _return)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            std::vector<std::map<std::string, int64_t> > node_stats(this->nodes.size());
+            std::vector<std::future<void> > calls;
+            for(size_t i = 0; i < this->nodes.size(); i++)
+            {
+                BackendNode * node = this->nodes[i];
+                std::map<std::string, int64_t> * out = &node_stats[i];
+                calls.push_back(std::async(std::launch::async, [node, out]() {
+                    NodeConnection c(node);
+                    c->stats(*out);
+                    c.done();
+                }));
+            }
+            for(size_t i = 0; i < calls.size(); i++)
+                calls[i].get();
+
+            for(size_t i = 0; i < this->nodes.size(); i++)
+                for(std::map<std::string, int64_t>::iterator it = node_stats[i].begin(); it != node_stats[i].end(); ++it)
+                    _return[this->nodes[i]->name + "/" + it->first] = it->second;
+
+            std::lock_guard<std::mutex> move_lock(this->move_mu);
+            _return["router_nodes"] = this->nodes.size();
+            _return["router_rebalancing"] = this->rebalancing;
+            _return["router_keys_moved"] = this->keys_moved;
+        }
+
+        // merges every server's keys, in order.
+        void scan_keys(std::vector<std::string> & _return, const std::string & after, const int32_t count, const std::string & prefix)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            std::set<std::string> keys;
+            for(size_t i = 0; i < this->nodes.size(); i++)
+            {
+                std::vector<std::string> node_keys;
+                NodeConnection c(this->nodes[i]);
+                c->scan_keys(node_keys, after, count, prefix);
+                c.done();
+                keys.insert(node_keys.begin(), node_keys.end());
+            }
+
+            for(std::set<std::string>::iterator it = keys.begin(); it != keys.end() && (int32_t)_return.size() < count; ++it)
+                _return.push_back(*it);
+        }
+
+        void dump_key(std::string & _return, const std::string & key)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            c->dump_key(_return, key);
+            c.done();
+        }
+
+        void merge_key(const std::string & key, const std::string & data)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            try
+            {
+                c->merge_key(key, data);
+            }
+            catch(InvalidArgument & ia)
+            {
+                // the whole reply came back, so the connection is still good.
+                c.done();
+                throw;
+            }
+            c.done();
+        }
+
+        void drop_key(const std::string & key)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            c->drop_key(key);
+            c.done();
+        }
+
+        bool expire(const std::string & key, const int64_t seconds)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            bool found = c->expire(key, seconds);
+            c.done();
+            return found;
+        }
+
+        void key_info(KeyInfo & _return, const std::string & key)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            c->key_info(_return, key);
+            c.done();
+        }
+
+        // the biggest overall are among the biggest count from each server.
+        void memory_top(std::vector<KeyInfo> & _return, const int32_t count)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            std::vector<std::vector<KeyInfo> > node_top(this->nodes.size());
+            std::vector<std::future<void> > calls;
+            for(size_t i = 0; i < this->nodes.size(); i++)
+            {
+                BackendNode * node = this->nodes[i];
+                std::vector<KeyInfo> * out = &node_top[i];
+                calls.push_back(std::async(std::launch::async, [node, out, count]() {
+                    NodeConnection c(node);
+                    c->memory_top(*out, count);
+                    c.done();
+                }));
+            }
+            for(size_t i = 0; i < calls.size(); i++)
+                calls[i].get();
+
+            for(size_t i = 0; i < node_top.size(); i++)
+                _return.insert(_return.end(), node_top[i].begin(), node_top[i].end());
+            std::stable_sort(_return.begin(), _return.end(), [](const KeyInfo & a, const KeyInfo & b) {
+                return a.memory_bytes > b.memory_bytes;
+            });
+            if((int32_t)_return.size() > count)
+                _return.resize(std::max(count, 0));
+        }
+
+        int64_t ttl(const std::string & key)
+        {
+            this->check_key(key);
+            RingReadLock lock(&this->ring_lock);
+            NodeConnection c(this->nodes[this->owner(key)]);
+            int64_t seconds = c->ttl(key);
+            c.done();
+            return seconds;
+        }
+
+        // every server deletes its own share.
+        int64_t delete_prefix(const std::string & prefix)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            std::vector<int64_t> deleted(this->nodes.size());
+            std::vector<std::future<void> > calls;
+            for(size_t i = 0; i < this->nodes.size(); i++)
+            {
+                BackendNode * node = this->nodes[i];
+                int64_t * out = &deleted[i];
+                calls.push_back(std::async(std::launch::async, [node, out, &prefix]() {
+                    NodeConnection c(node);
+                    *out = c->delete_prefix(prefix);
+                    c.done();
+                }));
+            }
+            for(size_t i = 0; i < calls.size(); i++)
+                calls[i].get();
+
+            int64_t total = 0;
+            for(size_t i = 0; i < deleted.size(); i++)
+                total += deleted[i];
+            return total;
+        }
+
+        // true if every server started.
+        bool export_data(const std::string & filename)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            bool started = true;
+            for(size_t i = 0; i < this->nodes.size(); i++)
+            {
+                NodeConnection c(this->nodes[i]);
+                try
+                {
+                    started = c->export_data(filename) && started;
+                }
+                catch(InvalidArgument & ia)
+                {
+                    // every server refuses the same names.
+                    c.done();
+                    throw;
+                }
+                c.done();
+            }
+            return started;
+        }
+
+        // each server is sent its own share of the keys.
+        void prefetch(const std::vector<std::string> & keys)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            std::map<int, std::vector<std::string> > shares;
+            for(size_t i = 0; i < keys.size(); i++)
+                shares[this->owner(keys[i])].push_back(keys[i]);
+
+            for(std::map<int, std::vector<std::string> >::iterator it = shares.begin(); it != shares.end(); ++it)
+            {
+                NodeConnection c(this->nodes[it->first]);
+                c->prefetch(it->second);
+                c.done();
+            }
+        }
+
+        int64_t resident(const std::vector<std::string> & keys)
+        {
+            RingReadLock lock(&this->ring_lock);
+
+            std::map<int, std::vector<std::string> > shares;
+            for(size_t i = 0; i < keys.size(); i++)
+                shares[this->owner(keys[i])].push_back(keys[i]);
+
+            int64_t total = 0;
+            for(std::map<int, std::vector<std::string> >::iterator it = shares.begin(); it != shares.end(); ++it)
+            {
+                NodeConnection c(this->nodes[it->first]);
+                total += c->resident(it->second);
+                c.done();
+            }
+            return total;
+        }
+};
+
+static void usage(const char * argv0)
+{
+  fprintf(stderr, "usage: %s [-p port] [-t threads] host:port ...\n", argv0);
+  fprintf(stderr, "  -p  port for the thrift interface (default 9090)\n");
+  fprintf(stderr, "  -t  requests handled at once (default 16)\n");
+}
+
+int main(int argc, char **argv) {
+  int port = 9090;
+  int threads = 16;
+
+  int opt;
+  while((opt = getopt(argc, argv, "p:t:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'p': port = atoi(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if(optind == argc || threads < 1)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::pair<std::string, int> > backends;
+  for(int i = optind; i < argc; i++)
+  {
+    const char * colon = strrchr(argv[i], ':');
+    if(!colon)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    backends.push_back(std::make_pair(std::string(argv[i], colon - argv[i]), atoi(colon + 1)));
+  }
+
+  shared_ptr<RouterHandler> handler(new RouterHandler(backends));
+
+  shared_ptr<TProcessor> processor(new BitboxRouterProcessor(handler));
+  shared_ptr<TProtocolFactory> protocol_factory(new TBinaryProtocolFactory());
+
+  // requests block on the servers behind us, so they need threads to wait in.
+  shared_ptr<ThreadManager> thread_manager = ThreadManager::newSimpleThreadManager(threads);
+  thread_manager->threadFactory(shared_ptr<PosixThreadFactory>(new PosixThreadFactory()));
+  thread_manager->start();
+
+  TNonblockingServer server(processor, protocol_factory, port, thread_manager);
+  server.serve();
+
+  return 0;
+}
@@ -5,6 +5,8 @@
 #include <server/TNonblockingServer.h>
 #include <transport/TServerSocket.h>
 #include <transport/TBufferTransports.h>
+#include <concurrency/ThreadManager.h>
+#include <concurrency/PosixThreadFactory.h>
 
 #include <vector>
 #include <iterator>
@@ -13,22 +15,64 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <thread>
+#include <future>
+#include <pthread.h>
 
 #include "bitbox.h"
+#include "partitions.h"
+#include "replication.h"
+#include "resp.h"
 #include "sigh.h"
 
 using namespace ::apache::thrift;
 using namespace ::apache::thrift::protocol;
 using namespace ::apache::thrift::transport;
 using namespace ::apache::thrift::server;
+using namespace ::apache::thrift::concurrency;
 
 using boost::shared_ptr;
 
-static bool maintenance_running = false;
+// how long a shutdown may spend writing arrays to disk, in seconds.  0 for
+// as long as it takes.
+static int64_t shutdown_seconds = 0;
+
+static void report_flush_progress(const BitboxFlushProgress & p)
+{
+    fprintf(stderr, "shutdown: wrote %" PRId64 " arrays (%.1f MB) in %.1fs, %" PRId64 " left.\n",
+            p.arrays_written, p.bytes_written / (1024.0 * 1024.0), p.seconds, p.arrays_left);
+}
+
+static void flush_for_shutdown(BitboxPartitions & boxes)
+{
+    if(!boxes.shutdown(shutdown_seconds, report_flush_progress))
+        fprintf(stderr, "shutdown: gave up after %" PRId64 "s with arrays left unwritten.\n", shutdown_seconds);
+}
+
+static void copy_key_info(const BitboxKeyInfo & from, KeyInfo & to)
+{
+    to.key = from.key;
+    switch(from.state)
+    {
+        case BITBOX_KEY_MISSING:   to.state = KeyState::MISSING;   break;
+        case BITBOX_KEY_IN_MEMORY: to.state = KeyState::IN_MEMORY; break;
+        case BITBOX_KEY_IN_TIER:   to.state = KeyState::IN_TIER;   break;
+        case BITBOX_KEY_ON_DISK:   to.state = KeyState::ON_DISK;   break;
+    }
+    to.size = from.size;
+    to.offset = from.offset;
+    to.bits_set = from.bits;
+    to.memory_bytes = from.memory_bytes;
+    to.disk_bytes = from.disk_bytes;
+    to.idle = from.idle;
+}
+
 gboolean idle_maintenance(gpointer data)
 {
     Bitbox * box = static_cast<Bitbox *>(data);
-    bool more_maintenance_needed = maintenance_running = box->run_maintenance_step();
+    bool more_maintenance_needed = box->run_maintenance_step();
     if(!more_maintenance_needed)
         fprintf(stderr, "done with maintenance for now.\n");
     return more_maintenance_needed ? TRUE : FALSE;
@@ -36,39 +80,354 @@ gboolean idle_maintenance(gpointer data)
 
 class BitboxHandler : virtual public BitboxIf {
     private:
-        void schedule_maintenance()
+        void schedule_maintenance(Bitbox & box)
+        {
+            idle_maintenance(&box);
+        }
+
+        static BitboxOverflow overflow_policy(Overflow::type overflow)
+        {
+            switch(overflow)
+            {
+                case Overflow::SAT:  return BITBOX_OVERFLOW_SAT;
+                case Overflow::FAIL: return BITBOX_OVERFLOW_FAIL;
+                default:             return BITBOX_OVERFLOW_WRAP;
+            }
+        }
+
+        void check_writable()
+        {
+            if(this->replica)
+            {
+                ReadOnly ro;
+                ro.message = "this server is a read only replica";
+                throw ro;
+            }
+        }
+
+        void check_key(const std::string & key)
+        {
+            if(!Bitbox::key_ok(key))
+            {
+                InvalidArgument ia;
+                ia.message = "keys can't start with a dot";
+                throw ia;
+            }
+        }
+
+        void check_field(int64_t bit, int32_t width, bool is_signed)
         {
-            //if(!maintenance_running)
-            //{
-                //fprintf(stderr, "adding the maintenance callback.\n");
-                //g_idle_add(idle_maintenance, &this->box);
-                idle_maintenance(&this->box);
-                //maintenance_running = true;
-            //}
+            if(!Bitbox::field_ok(bit, width, is_signed))
+            {
+                InvalidArgument ia;
+                ia.message = "fields need a non-negative bit and a width from 1 to 64 signed or 63 unsigned";
+                throw ia;
+            }
         }
     public:
-        Bitbox box;
+        BitboxPartitions boxes;
+        ReplicationPrimary * primary;
+        ReplicationReplica * replica;
+        std::mutex export_mu;
+        std::thread exporter;
+
+        BitboxHandler(int npartitions)
+            : boxes(npartitions), primary(NULL), replica(NULL)
+        {}
 
         bool get_bit(const std::string& key, const int64_t bit)
         {
-            return this->box.get_bit(key.c_str(), bit);
+            this->check_key(key);
+            return this->boxes.for_key(key).get_bit(key, bit);
         }
 
         void set_bit(const std::string& key, const int64_t bit)
         {
-            this->schedule_maintenance();
-            this->box.set_bit(key.c_str(), bit);
+            this->check_writable();
+            this->check_key(key);
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            box.set_bit(key, bit);
         }
 
         void set_bits(const std::string& key, const std::set<int64_t> & bits)
         {
-            this->schedule_maintenance();
-            this->box.set_bits(key.c_str(), bits.begin(), bits.end());
+            this->check_writable();
+            this->check_key(key);
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            box.set_bits(key, bits.begin(), bits.end());
+        }
+
+        void set_packed_bits(const std::string& key, const std::string& positions)
+        {
+            this->check_writable();
+            this->check_key(key);
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            box.set_bits(key, BitboxPositionReader((const uint8_t *)positions.data(), positions.size()), BitboxPositionReader());
+        }
+
+        void or_bitmap(const std::string& key, const int64_t start_bit, const std::string& bitmap)
+        {
+            this->check_writable();
+            this->check_key(key);
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            if(!box.or_bitmap(key, start_bit, (const uint8_t *)bitmap.data(), bitmap.size()))
+            {
+                InvalidArgument ia;
+                ia.message = "start_bit must be non-negative and the bitmap must end before bit 2^63";
+                throw ia;
+            }
+        }
+
+        int64_t get_field(const std::string& key, const int64_t bit, const int32_t width, const bool is_signed)
+        {
+            this->check_key(key);
+            this->check_field(bit, width, is_signed);
+            return this->boxes.for_key(key).get_field(key, bit, width, is_signed);
+        }
+
+        int64_t set_field(const std::string& key, const int64_t bit, const int32_t width, const bool is_signed, const int64_t value)
+        {
+            this->check_writable();
+            this->check_key(key);
+            this->check_field(bit, width, is_signed);
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            return box.set_field(key, bit, width, is_signed, value);
+        }
+
+        int64_t incr_field(const std::string& key, const int64_t bit, const int32_t width, const bool is_signed, const int64_t by, const Overflow::type overflow)
+        {
+            this->check_writable();
+            this->check_key(key);
+            this->check_field(bit, width, is_signed);
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            int64_t result;
+            if(!box.incr_field(key, bit, width, is_signed, by, overflow_policy(overflow), &result))
+            {
+                FieldOverflow fo;
+                fo.message = "the field can't hold the result";
+                throw fo;
+            }
+            return result;
+        }
+
+        void execute_batch(std::vector<OpResult> & _return, const std::vector<Op> & ops)
+        {
+            std::vector<BitboxOp> box_ops(ops.size());
+            std::vector<bool> written(this->boxes.size(), false);
+            bool writes = false;
+
+            for(size_t i = 0; i < ops.size(); i++)
+            {
+                BitboxOp & op = box_ops[i];
+                op.key = &ops[i].key;
+                op.bit = ops[i].bit;
+                op.end_bit = ops[i].end_bit;
+                op.bits = &ops[i].bits;
+                op.width = ops[i].width;
+                op.is_signed = ops[i].is_signed;
+                op.value = ops[i].value;
+                op.overflow = overflow_policy(ops[i].overflow);
+
+                switch(ops[i].type)
+                {
+                    case OpType::GET_BIT:     op.type = BITBOX_OP_GET_BIT;     break;
+                    case OpType::SET_BIT:     op.type = BITBOX_OP_SET_BIT;     break;
+                    case OpType::SET_BITS:    op.type = BITBOX_OP_SET_BITS;    break;
+                    case OpType::SET_RANGE:   op.type = BITBOX_OP_SET_RANGE;   break;
+                    case OpType::COUNT_RANGE: op.type = BITBOX_OP_COUNT_RANGE; break;
+                    case OpType::GET_FIELD:   op.type = BITBOX_OP_GET_FIELD;   break;
+                    case OpType::SET_FIELD:   op.type = BITBOX_OP_SET_FIELD;   break;
+                    case OpType::INCR_FIELD:  op.type = BITBOX_OP_INCR_FIELD;  break;
+                    default:
+                        // unknown operations read as nothing.
+                        op.type = BITBOX_OP_COUNT_RANGE;
+                        op.end_bit = op.bit;
+                        break;
+                }
+                if(bitbox_op_writes(op.type))
+                    written[Bitbox::partition_for(ops[i].key, this->boxes.size())] = writes = true;
+            }
+
+            if(writes)
+            {
+                this->check_writable();
+                for(int p = 0; p < this->boxes.size(); p++)
+                    if(written[p])
+                        this->schedule_maintenance(this->boxes[p]);
+            }
+            this->boxes.execute_batch(box_ops);
+
+            _return.resize(ops.size());
+            for(size_t i = 0; i < ops.size(); i++)
+            {
+                _return[i].bit = box_ops[i].type == BITBOX_OP_GET_BIT && box_ops[i].result;
+                _return[i].count = box_ops[i].result;
+                _return[i].value = box_ops[i].result;
+                _return[i].failed = box_ops[i].failed;
+            }
+        }
+
+        // the bytes go straight from the array into the reply.
+        void get_range(std::string & _return, const std::string & key, const int64_t start_bit, const int64_t end_bit)
+        {
+            this->check_key(key);
+            if(start_bit < 0)
+            {
+                InvalidArgument ia;
+                ia.message = "start_bit must be non-negative";
+                throw ia;
+            }
+            if(end_bit <= start_bit)
+                return;
+
+            // measured from start_bit, since start_bit plus the most we send
+            // can run past INT64_MAX.
+            int64_t end = end_bit;
+            if(end_bit - start_bit > (int64_t)BITBOX_RANGE_MAX_BYTES * 8)
+                end = start_bit + (int64_t)BITBOX_RANGE_MAX_BYTES * 8;
+            _return.resize((end - start_bit + 7) / 8);
+            this->boxes.for_key(key).get_range(key, start_bit, end, (uint8_t *)&_return[0]);
+        }
+
+        void stats(std::map<std::string, int64_t> & _return)
+        {
+            this->boxes.get_stats(_return);
+            if(this->primary)
+                this->primary->get_stats(_return);
+            if(this->replica)
+                this->replica->get_stats(_return);
+        }
+
+        void scan_keys(std::vector<std::string> & _return, const std::string & after, const int32_t count, const std::string & prefix)
+        {
+            this->boxes.scan_keys(prefix, after, MAX(count, 0), _return);
+        }
+
+        void dump_key(std::string & _return, const std::string & key)
+        {
+            this->check_key(key);
+            this->boxes.for_key(key).dump(key, _return);
+        }
+
+        void merge_key(const std::string & key, const std::string & data)
+        {
+            this->check_writable();
+            this->check_key(key);
+            Bitarray * b = Bitarray::thaw(key.data(), key.size(), (const uint8_t *)data.data(), data.size());
+            if(!b)
+            {
+                InvalidArgument ia;
+                ia.message = "data isn't an array from dump_key()";
+                throw ia;
+            }
+            Bitbox & box = this->boxes.for_key(key);
+            this->schedule_maintenance(box);
+            box.merge(key, b);
+            delete b;
+        }
+
+        void drop_key(const std::string & key)
+        {
+            this->check_writable();
+            this->check_key(key);
+            this->boxes.for_key(key).delete_key(key);
+        }
+
+        bool expire(const std::string & key, const int64_t seconds)
+        {
+            this->check_writable();
+            this->check_key(key);
+            return this->boxes.for_key(key).expire(key, seconds);
+        }
+
+        int64_t ttl(const std::string & key)
+        {
+            this->check_key(key);
+            return this->boxes.for_key(key).ttl(key);
+        }
+
+        int64_t delete_prefix(const std::string & prefix)
+        {
+            this->check_writable();
+            return this->boxes.delete_prefix(prefix);
+        }
+
+        void prefetch(const std::vector<std::string> & keys)
+        {
+            this->boxes.prefetch(keys);
+        }
+
+        int64_t resident(const std::vector<std::string> & keys)
+        {
+            return this->boxes.resident(keys);
+        }
+
+        void key_info(KeyInfo & _return, const std::string & key)
+        {
+            this->check_key(key);
+            BitboxKeyInfo info;
+            this->boxes.for_key(key).key_info(key, info);
+            copy_key_info(info, _return);
+        }
+
+        void memory_top(std::vector<KeyInfo> & _return, const int32_t count)
+        {
+            std::vector<BitboxKeyInfo> top;
+            this->boxes.memory_top(MAX(count, 0), top);
+            _return.resize(top.size());
+            for(size_t i = 0; i < top.size(); i++)
+                copy_key_info(top[i], _return[i]);
+        }
+
+        // exports take a while, so each runs in a thread of its own.  this
+        // returns once it has taken its snapshot, so everything written
+        // before the call is in the export and nothing written after it.
+        // with several partitions, each writes filename.N.  filename is only a
+        // name; the file goes in data/.exports, so that clients can't write
+        // anywhere else.
+        bool export_data(const std::string & name)
+        {
+            if(name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos || name.find('\0') != std::string::npos)
+            {
+                InvalidArgument ia;
+                ia.message = "the export's name can't be empty, . or .., or have a / in it";
+                throw ia;
+            }
+            mkdir("data/.exports", 0755);
+            std::string filename = "data/.exports/" + name;
+
+            std::lock_guard<std::mutex> lock(this->export_mu);
+            std::map<std::string, int64_t> stats;
+            this->boxes.get_stats(stats);
+            if(stats["export_running"])
+                return false;
+            if(this->exporter.joinable())
+                this->exporter.join();
+
+            BitboxPartitions * box = &this->boxes;
+            std::shared_ptr<std::promise<bool> > started(new std::promise<bool>());
+            std::future<bool> began = started->get_future();
+            this->exporter = std::thread([box, filename, started]() {
+                bool ok = box->export_to_file(filename, [started](bool ok) {
+                    started->set_value(ok);
+                });
+                if(ok)
+                    fprintf(stderr, "exported to %s.\n", filename.c_str());
+                else
+                    fprintf(stderr, "export to %s failed.\n", filename.c_str());
+            });
+            return began.get();
         }
 
         void shutdown()
         {
-            this->box.shutdown();
+            flush_for_shutdown(this->boxes);
         }
 };
 
@@ -107,18 +466,169 @@ class BitboxHandler : virtual public BitboxIf {
 //    return TRUE;
 //}
 
+// runs a redis front end on one core.
+static void run_pinned(RespServer * resp, int core)
+{
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core, &cpus);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    fprintf(stderr, "couldn't pin the redis front end to core %d.\n", core);
+  resp->run();
+}
+
+// deletes keys as their TTLs run out.  a replica leaves this to its primary,
+// whose deletes it's sent.
+static volatile bool expiry_stopping = false;
+static void expiry_loop(BitboxPartitions * boxes)
+{
+  while(!expiry_stopping)
+  {
+    boxes->expire_keys();
+    sleep(1);
+  }
+}
+
+static void usage(const char * argv0)
+{
+  fprintf(stderr, "usage: %s [-p thrift_port] [-t threads] [-r redis_port] [-P partitions] [-d dir] [-e policy] [-s seconds] [-R repl_port | -m host:port]\n", argv0);
+  fprintf(stderr, "  -p  port for the thrift interface (default 9090)\n");
+  fprintf(stderr, "  -t  thrift requests handled at once (default 8)\n");
+  fprintf(stderr, "  -r  also serve the redis protocol on this port\n");
+  fprintf(stderr, "  -P  split keys among this many boxes, 0 for one per core, each with a\n");
+  fprintf(stderr, "      redis front end pinned to its core (default 1, no replication)\n");
+  fprintf(stderr, "  -d  run in this directory, which holds data/ (default: the current one)\n");
+  fprintf(stderr, "  -e  eviction policy: lru, tinylfu or gdsf (default %s)\n", EVICTION_DEFAULT_POLICY);
+  fprintf(stderr, "  -s  give up writing arrays to disk this long into a shutdown (default: never)\n");
+  fprintf(stderr, "  -R  accept replicas on this port\n");
+  fprintf(stderr, "  -m  be a read only replica of the primary at host:port\n");
+}
+
 int main(int argc, char **argv) {
   int port = 9090;
+  int threads = 8;
+  int resp_port = 0;
+  int partitions = 1;
+  int repl_port = 0;
+  const char * dir = NULL;
+  const char * eviction_policy = EVICTION_DEFAULT_POLICY;
+  std::string primary_host;
+  int primary_port = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "p:t:r:P:d:e:s:R:m:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'p': port = atoi(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case 'r': resp_port = atoi(optarg); break;
+      case 'P': partitions = atoi(optarg); break;
+      case 'd': dir = optarg; break;
+      case 'e': eviction_policy = optarg; break;
+      case 's': shutdown_seconds = atoll(optarg); break;
+      case 'R': repl_port = atoi(optarg); break;
+      case 'm':
+      {
+        const char * colon = strrchr(optarg, ':');
+        if(!colon)
+        {
+          usage(argv[0]);
+          return 1;
+        }
+        primary_host.assign(optarg, colon - optarg);
+        primary_port = atoi(colon + 1);
+        break;
+      }
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if(partitions == 0)
+    partitions = std::thread::hardware_concurrency();
+
+  // a replica can't pass along the full copy it's sent when it (re)connects.
+  // replication streams one box's changes.
+  if((repl_port && primary_port) || threads < 1 || partitions < 1 ||
+      (partitions > 1 && (repl_port || primary_port)))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(dir && chdir(dir) == -1)
+  {
+    perror(dir);
+    return 1;
+  }
 
   sigset_t sigs = sigh_make_sigset(SIGINT, SIGTERM, 0);
   assert(sigh_watch(&sigs));
 
-  shared_ptr<BitboxHandler> handler(new BitboxHandler());
+  shared_ptr<BitboxHandler> handler(new BitboxHandler(partitions));
+  if(!handler->boxes.set_eviction_policy(eviction_policy))
+  {
+    usage(argv[0]);
+    return 1;
+  }
   shared_ptr<TProcessor> processor(new BitboxProcessor(handler));
+  shared_ptr<TProtocolFactory> protocol_factory(new TBinaryProtocolFactory());
 
-  TNonblockingServer server(processor, port);
+  // a request for a key that's only on disk waits while it's read, so
+  // requests run in threads of their own, and the rest carry on meanwhile.
+  shared_ptr<ThreadManager> thread_manager = ThreadManager::newSimpleThreadManager(threads);
+  thread_manager->threadFactory(shared_ptr<PosixThreadFactory>(new PosixThreadFactory()));
+  thread_manager->start();
+
+  TNonblockingServer server(processor, protocol_factory, port, thread_manager);
   //global_server = &server;
 
+  // with partitions, a redis front end per core, all on the same port.
+  std::vector<RespServer *> resps;
+  std::vector<std::thread> resp_threads;
+  if(resp_port)
+  {
+    for(int i = 0; i < partitions; i++)
+    {
+      RespServer * resp = new RespServer(handler->boxes, resp_port);
+      resps.push_back(resp);
+      if(!resp->listen(partitions > 1))
+      {
+        perror("redis listener");
+        return 1;
+      }
+      resp->set_read_only(primary_port != 0);
+    }
+    for(int i = 0; i < partitions; i++)
+    {
+      if(partitions > 1)
+        resp_threads.push_back(std::thread(run_pinned, resps[i], i % std::thread::hardware_concurrency()));
+      else
+        resp_threads.push_back(std::thread(&RespServer::run, resps[i]));
+    }
+  }
+
+  if(repl_port)
+  {
+    handler->primary = new ReplicationPrimary(handler->boxes[0], repl_port);
+    if(!handler->primary->listen())
+    {
+      perror("replication listener");
+      return 1;
+    }
+    handler->primary->start();
+  }
+
+  if(primary_port)
+  {
+    handler->replica = new ReplicationReplica(handler->boxes[0], primary_host, primary_port);
+    handler->replica->start();
+  }
+
+  std::thread expiry_thread;
+  if(!primary_port)
+    expiry_thread = std::thread(expiry_loop, &handler->boxes);
+
   //// add the server polling source to the main loop
 
   //loop = g_main_loop_new(NULL, FALSE);
@@ -154,6 +664,26 @@ int main(int argc, char **argv) {
 
   event_base_loopbreak(server.getEventBase());
   //server.thread()->join();
+
+  for(size_t i = 0; i < resps.size(); i++)
+  {
+    resps[i]->stop();
+    if(i < resp_threads.size())
+      resp_threads[i].join();
+    delete resps[i];
+  }
+  if(expiry_thread.joinable())
+  {
+    expiry_stopping = true;
+    expiry_thread.join();
+  }
+  if(handler->primary)
+    handler->primary->stop();
+  if(handler->replica)
+    handler->replica->stop();
+  if(handler->exporter.joinable())
+    handler->exporter.join();
+  flush_for_shutdown(handler->boxes);
   fprintf(stderr, "shutdown cleanly.\n");
 
   return 0;
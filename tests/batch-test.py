@@ -0,0 +1,54 @@
+import sys, time, random
+sys.path.append('gen-py')
+
+from bitbox import Bitbox
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType
+
+from thrift import Thrift
+from thrift.transport import TSocket
+from thrift.transport import TTransport
+from thrift.protocol import TBinaryProtocol
+
+transport = TSocket.TSocket('localhost', 9090)
+transport = TTransport.TFramedTransport(transport)
+protocol = TBinaryProtocol.TBinaryProtocol(transport)
+
+client = Bitbox.Client(protocol)
+
+transport.open()
+
+a = str("%0.12f" % time.time()) + 'a'
+b = str("%0.12f" % time.time()) + 'b'
+
+results = client.execute_batch([
+    Op(type=OpType.SET_BIT, key=a, bit=5),
+    Op(type=OpType.SET_BITS, key=b, bits=set([1, 2, 3])),
+    Op(type=OpType.GET_BIT, key=a, bit=5),
+    Op(type=OpType.GET_BIT, key=b, bit=4),
+    Op(type=OpType.SET_RANGE, key=a, bit=100, end_bit=200),
+    Op(type=OpType.COUNT_RANGE, key=a, bit=0, end_bit=1000),
+    Op(type=OpType.COUNT_RANGE, key=b, bit=2, end_bit=4),
+])
+
+assert len(results) == 7
+assert results[2].bit == True
+assert results[3].bit == False
+assert results[5].count == 101
+assert results[6].count == 2
+
+assert client.get_bit(a, 100) == 1
+assert client.get_bit(a, 199) == 1
+assert client.get_bit(a, 200) == 0
+assert client.get_bit(b, 3) == 1
+
+# writes to negative bits fail and leave the key alone
+results = client.execute_batch([
+    Op(type=OpType.SET_BIT, key=a, bit=-1),
+    Op(type=OpType.SET_BITS, key=a, bits=set([-8, 7])),
+    Op(type=OpType.SET_RANGE, key=a, bit=-5, end_bit=5),
+    Op(type=OpType.GET_BIT, key=a, bit=-1),
+    Op(type=OpType.COUNT_RANGE, key=a, bit=-100, end_bit=1000),
+])
+assert [r.failed for r in results] == [True, True, True, False, False]
+assert results[4].count == 101
@@ -0,0 +1,159 @@
+// compares the KeyTable key index against the google::sparse_hash_map it
+// replaced, using the same Bitarrays and the same std::string lookups that
+// the thrift handler does.
+//
+//     make bench-keyhash
+//     ./bench-keyhash [num_keys ...]      (default: 1000000 50000000)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <google/sparse_hash_map>
+
+#include "bitbox.h"
+
+struct bitbox_str_hasher
+{
+    size_t operator()(const char * key) const
+    {
+        return MurmurHash(key, strlen(key), 0);
+    }
+};
+
+struct eqstr
+{
+    bool operator()(const char* s1, const char* s2) const
+    {
+        return (s1 == s2) || (s1 && s2 && strcmp(s1, s2) == 0);
+    }
+};
+
+typedef google::sparse_hash_map<const char *, Bitarray *, bitbox_str_hasher, eqstr> sparse_t;
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static long rss_kb(void)
+{
+    long pages = 0, resident = 0;
+    FILE * f = fopen("/proc/self/statm", "r");
+    if(f)
+    {
+        if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static std::string make_key(int64_t i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "user:%" PRId64, i);
+    return buf;
+}
+
+static void report(const char * table, const char * op, int64_t n, double secs)
+{
+    printf("%-8s %-7s %10" PRId64 " keys %8.3fs %8.1f ns/op\n", table, op, n, secs, secs * 1e9 / n);
+}
+
+static void bench(int64_t n)
+{
+    std::vector<Bitarray *> arrays;
+    arrays.reserve(n);
+    for(int64_t i = 0; i < n; i++)
+    {
+        std::string key = make_key(i);
+        arrays.push_back(new Bitarray(key.data(), key.size(), -1));
+    }
+
+    // look keys up in a scrambled order so we measure cache misses, not the
+    // insertion order.
+    std::vector<std::string> hits, misses;
+    int64_t lookups = n < 5000000 ? n : 5000000;
+    srand(n);
+    for(int64_t i = 0; i < lookups; i++)
+    {
+        hits.push_back(make_key(((int64_t)rand() * RAND_MAX + rand()) % n));
+        misses.push_back(make_key(n + i));
+    }
+
+    int64_t found = 0;
+    double t;
+
+    {
+        long before = rss_kb();
+        sparse_t sparse;
+        sparse.set_deleted_key("");
+
+        t = now();
+        for(int64_t i = 0; i < n; i++)
+            sparse[arrays[i]->key] = arrays[i];
+        report("sparse", "insert", n, now() - t);
+        printf("sparse   memory  %10ld KB\n", rss_kb() - before);
+
+        t = now();
+        for(int64_t i = 0; i < lookups; i++)
+            found += sparse.find(hits[i].c_str()) != sparse.end();
+        report("sparse", "hit", lookups, now() - t);
+
+        t = now();
+        for(int64_t i = 0; i < lookups; i++)
+            found += sparse.find(misses[i].c_str()) != sparse.end();
+        report("sparse", "miss", lookups, now() - t);
+    }
+
+    {
+        long before = rss_kb();
+        KeyTable table;
+
+        t = now();
+        for(int64_t i = 0; i < n; i++)
+            table.insert(arrays[i], KeyTable::hash_key(arrays[i]->key, arrays[i]->keylen));
+        report("keytable", "insert", n, now() - t);
+        printf("keytable memory  %10ld KB\n", rss_kb() - before);
+
+        t = now();
+        for(int64_t i = 0; i < lookups; i++)
+            found += table.find(hits[i].data(), hits[i].size()) != NULL;
+        report("keytable", "hit", lookups, now() - t);
+
+        t = now();
+        for(int64_t i = 0; i < lookups; i++)
+            found += table.find(misses[i].data(), misses[i].size()) != NULL;
+        report("keytable", "miss", lookups, now() - t);
+    }
+
+    if(found != lookups * 2)
+    {
+        fprintf(stderr, "lookup mismatch: found %" PRId64 ", expected %" PRId64 "\n", found, lookups * 2);
+        exit(1);
+    }
+
+    for(int64_t i = 0; i < n; i++)
+        delete arrays[i];
+    printf("\n");
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        bench(1000000);
+        bench(50000000);
+    }
+    for(int i = 1; i < argc; i++)
+        bench(atoll(argv[i]));
+    return 0;
+}
@@ -0,0 +1,61 @@
+// checks CompressedTier's byte count as entries go in, come back out and
+// age out, reusing one buffer for everything taken out the way
+// Bitbox::age_out_of_tier() does.
+//
+//     make compressedtier-test && ./compressedtier-test
+
+#include <assert.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "compressedtier.h"
+
+int main()
+{
+    CompressedTier tier(1000);
+    int64_t expected = 0;
+    for(int i = 0; i < 20; i++)
+    {
+        std::string key = "key" + std::to_string(i);
+        std::string frozen(10 + i * 7, 'x');
+        expected += key.size() + frozen.size();
+        assert(tier.put(key, frozen, i % 2) && frozen.empty());
+    }
+    assert(tier.memory_bytes() == expected);
+
+    std::string key, frozen;
+    bool dirty;
+    assert(tier.take("key3", frozen, &dirty) && frozen.size() == 31 && dirty);
+    expected -= 4 + 31;
+    assert(tier.memory_bytes() == expected);
+
+    // frozen still holds key3's data as each of these goes into it.
+    int popped = 0;
+    while(tier.pop_overflow(key, frozen, &dirty))
+    {
+        expected -= key.size() + frozen.size();
+        assert(tier.memory_bytes() == expected);
+        popped++;
+    }
+    assert(popped > 1);
+    assert(tier.memory_bytes() <= 1000);
+
+    std::vector<std::string> keys;
+    tier.keys(keys);
+    int64_t total = 0;
+    for(size_t i = 0; i < keys.size(); i++)
+        total += tier.entry_bytes(keys[i]);
+    assert(total == tier.memory_bytes());
+
+    while(tier.take(keys.back(), frozen, &dirty))
+    {
+        keys.pop_back();
+        if(keys.empty())
+            break;
+    }
+    assert(tier.size() == 0 && tier.memory_bytes() == 0);
+    printf("compressed tier ok\n");
+    return 0;
+}
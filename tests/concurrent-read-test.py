@@ -0,0 +1,64 @@
+# grows keys two bits at a time, in batches that set both at once, while
+# other connections count their bits over the redis protocol; a count is
+# never odd unless a read saw half of a batch.  run from the top of the tree
+# after building bitbox-server.
+
+import sys, socket, threading
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-concurrent-read-test')
+
+def redis(sock, *args):
+    sock.sendall('*%d\r\n' % len(args) + ''.join('$%d\r\n%s\r\n' % (len(str(a)), a) for a in args))
+    reply = ''
+    while not reply.endswith('\r\n'):
+        reply += sock.recv(4096)
+    return reply
+
+keys = ['cr%d' % i for i in range(10)]
+rounds = 2000
+stop = threading.Event()
+errors = []
+reads = [0]
+
+def read():
+    sock = socket.create_connection(('localhost', 6394))
+    while not stop.is_set():
+        for key in keys:
+            count = int(redis(sock, 'BITCOUNT', key)[1:])
+            if count % 2:
+                errors.append('%s had %d bits' % (key, count))
+            reads[0] += 1
+
+server = start_server(d, 9294, '-r', '6394', '-t', '8')
+try:
+    client = connect(9294)
+    readers = [threading.Thread(target=read) for i in range(4)]
+    for t in readers:
+        t.start()
+
+    # the second bit of each pair is far past the first, so arrays keep
+    # growing under the readers.
+    for i in range(rounds):
+        ops = []
+        for key in keys:
+            ops.append(Op(type=OpType.SET_RANGE, key=key, bit=i, end_bit=i + 1))
+            ops.append(Op(type=OpType.SET_RANGE, key=key, bit=i * 500 + 1000000, end_bit=i * 500 + 1000001))
+        client.execute_batch(ops)
+        if i % 500 == 0:
+            client.delete_prefix('cr9')
+
+    stop.set()
+    for t in readers:
+        t.join()
+    assert not errors, errors[:10]
+    for key in keys[:-1]:
+        assert client.execute_batch([Op(type=OpType.COUNT_RANGE, key=key, bit=0, end_bit=1 << 40)])[0].count == rounds * 2
+    print 'concurrent reads ok, %d counts' % reads[0]
+finally:
+    stop(server)
@@ -0,0 +1,52 @@
+# run against a server started with: ./bitbox-server
+
+import sys, time
+sys.path.append('gen-py')
+
+from bitbox import Bitbox
+from bitbox.constants import *
+
+from thrift import Thrift
+from thrift.transport import TSocket
+from thrift.transport import TTransport
+from thrift.protocol import TBinaryProtocol
+
+transport = TSocket.TSocket('localhost', 9090)
+transport = TTransport.TFramedTransport(transport)
+protocol = TBinaryProtocol.TBinaryProtocol(transport)
+
+client = Bitbox.Client(protocol)
+
+transport.open()
+
+prefix = str("%0.12f" % time.time())
+short, long, forever = prefix + 'short', prefix + 'long', prefix + 'forever'
+for key in (short, long, forever):
+    client.set_bit(key, 5)
+
+assert client.ttl(prefix + 'missing') == -2
+assert not client.expire(prefix + 'missing', 10)
+assert client.ttl(forever) == -1
+
+assert client.expire(short, 1)
+assert client.expire(long, 1000)
+assert 990 < client.ttl(long) <= 1000
+
+# the server looks for expired keys once a second
+time.sleep(3)
+assert client.ttl(short) == -2
+assert not client.get_bit(short, 5)
+assert client.get_bit(long, 5)
+
+# an expiry that isn't positive deletes the key now
+assert client.expire(long, 0)
+assert client.ttl(long) == -2
+
+for i in range(250):
+    client.set_bit(prefix + 'p' + str(i), i)
+assert client.delete_prefix(prefix + 'p') == 250
+assert not [key for key in client.scan_keys(prefix, 1000) if key.startswith(prefix + 'p')]
+assert client.get_bit(forever, 5)
+
+stats = client.stats()
+assert stats['keys_expired'] >= 1
@@ -0,0 +1,66 @@
+# sets random bits on a server in a directory under /tmp, restarts it so that
+# most keys are only on disk, exports while changing keys, and checks the
+# export with read-export.  run from the top of the tree after building
+# bitbox-server and read-export.
+
+import sys, time, subprocess, random
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import InvalidArgument
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-export-test')
+
+def run_server():
+    return start_server(d, 9291)
+
+expected = {}
+server = run_server()
+try:
+    client = connect(9291)
+    for i in range(2000):
+        key = 'exp' + str(i)
+        bits = set(random.randint(0, 1000000) for j in range(random.randint(1, 10)))
+        for bit in bits:
+            client.set_bit(key, bit)
+        expected[key] = len(bits)
+    client.shutdown()
+finally:
+    stop(server)
+
+server = run_server()
+try:
+    client = connect(9291)
+    client.set_bit('exp0', 1000001)
+    expected['exp0'] += 1
+
+    # exports only go in data/.exports
+    for name in ('', '..', '../export.bbx', '/tmp/export.bbx'):
+        try:
+            client.export_data(name)
+            assert False
+        except InvalidArgument:
+            pass
+
+    assert client.export_data('export.bbx')
+    # whatever happens after the export starts isn't in it
+    client.set_bit('exp1999', 1000001)
+    client.delete_key('exp1998')
+    client.set_bit('exp-new', 1)
+
+    while client.stats()['export_running']:
+        time.sleep(0.1)
+    assert client.stats()['export_keys'] == len(expected)
+finally:
+    stop(server)
+
+reader = subprocess.Popen(['./read-export', d + '/data/.exports/export.bbx'], stdout=subprocess.PIPE)
+got = {}
+for line in reader.stdout:
+    key, count = line.split()
+    got[key] = int(count)
+assert reader.wait() == 0
+assert got == expected
+print 'exported %d keys' % len(got)
@@ -0,0 +1,91 @@
+# checks get_field(), set_field() and incr_field() against a model of the
+# key's bits, with fields of every width at odd offsets, and the overflow
+# policies in execute_batch(), and that bad fields are refused.  run from
+# the top of the tree after building bitbox-server.
+
+import sys, random
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType, Overflow, FieldOverflow, InvalidArgument
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-field-test')
+
+def as_signed(value, width):
+    return value - (1 << width) if value >> (width - 1) else value
+
+server = start_server(d, 9299)
+try:
+    client = connect(9299)
+    random.seed(50)
+
+    bits = {}
+    for i in range(500):
+        width = random.randint(1, 64)
+        is_signed = width == 64 or random.random() < 0.5
+        bit = random.randrange(0, 2000000)
+        value = random.getrandbits(width)
+        old = sum(bits.get(bit + j, 0) << j for j in range(width))
+        want = as_signed(old, width) if is_signed else old
+        assert client.get_field('fields', bit, width, is_signed) == want
+        assert client.set_field('fields', bit, width, is_signed, as_signed(value, width) if is_signed else value) == want
+        for j in range(width):
+            bits[bit + j] = (value >> j) & 1
+    for bit in random.sample(sorted(bits), 300):
+        assert client.get_bit('fields', bit) == bits[bit]
+
+    # a 4 bit counter at bit 13.
+    client.set_field('counter', 13, 4, False, 14)
+    assert client.incr_field('counter', 13, 4, False, 1, Overflow.FAIL) == 15
+    try:
+        client.incr_field('counter', 13, 4, False, 1, Overflow.FAIL)
+        assert False
+    except FieldOverflow:
+        pass
+    assert client.incr_field('counter', 13, 4, False, 1, Overflow.SAT) == 15
+    assert client.incr_field('counter', 13, 4, False, 1, Overflow.WRAP) == 0
+    assert client.get_field('counter', 13, 4, True) == 0
+
+    # width 0, width 65, u64 and a negative bit are refused.
+    for bit, width, is_signed in ((13, 0, False), (13, 65, True), (13, 64, False), (-1, 4, False)):
+        for call in (lambda: client.get_field('counter', bit, width, is_signed),
+                     lambda: client.set_field('counter', bit, width, is_signed, 1),
+                     lambda: client.incr_field('counter', bit, width, is_signed, 1, Overflow.WRAP)):
+            try:
+                call()
+                assert False
+            except InvalidArgument:
+                pass
+    assert client.get_field('counter', 13, 4, True) == 0
+    results = client.execute_batch([Op(type=OpType.INCR_FIELD, key='counter', bit=13, width=64, value=1),
+                                    Op(type=OpType.GET_FIELD, key='counter', bit=-1, width=4)])
+    assert results[0].failed and results[1].failed
+
+    ops = [Op(type=OpType.INCR_FIELD, key='visits', bit=i * 4, width=4, value=i, overflow=Overflow.FAIL) for i in range(20)]
+    ops += [Op(type=OpType.GET_FIELD, key='visits', bit=i * 4, width=4) for i in range(20)]
+    results = client.execute_batch(ops)
+    for i in range(20):
+        assert results[i].failed == (i > 15)
+        assert results[20 + i].value == (i if i <= 15 else 0)
+finally:
+    stop(server)
+
+# with several partitions, a batch is split between them and put back
+# together, failures and all.
+fresh_dir(d)
+server = start_server(d, 9299, '-P', '4')
+try:
+    client = connect(9299)
+    keys = ['visits%d' % i for i in range(20)]
+    ops = [Op(type=OpType.SET_FIELD, key=key, bit=0, width=4, value=15) for key in keys]
+    ops += [Op(type=OpType.INCR_FIELD, key=key, bit=0, width=4, value=1, overflow=Overflow.FAIL) for key in keys]
+    ops += [Op(type=OpType.GET_FIELD, key=key, bit=-1, width=4) for key in keys]
+    ops += [Op(type=OpType.INCR_FIELD, key=key, bit=0, width=4, value=-1, overflow=Overflow.FAIL) for key in keys]
+    results = client.execute_batch(ops)
+    assert [r.failed for r in results] == [False] * 20 + [True] * 40 + [False] * 20
+    assert all(r.value == 14 for r in results[60:])
+    print 'fields ok'
+finally:
+    stop(server)
@@ -0,0 +1,49 @@
+# checks get_range() against get_bit() at a few alignments, for a small key,
+# a paged one and a missing one.  run from the top of the tree after building
+# bitbox-server.
+
+import sys, random
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import InvalidArgument
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-get-range-test')
+
+def unpack(data, nbits):
+    return [(ord(data[i / 8]) >> (i % 8)) & 1 for i in range(nbits)]
+
+server = start_server(d, 9297)
+try:
+    client = connect(9297)
+    random.seed(3)
+    small = set(random.randrange(1000, 3000) for i in range(300))
+    paged = set(random.randrange(0, 50000000) for i in range(300))
+    client.set_bits('range-small', small)
+    client.set_bits('range-paged', paged)
+
+    for key, bits, span in [('range-small', small, 4000), ('range-paged', paged, 50000000), ('range-missing', set(), 4000)]:
+        for i in range(50):
+            start = random.randrange(0, span)
+            n = random.randrange(0, 3000)
+            data = client.get_range(key, start, start + n)
+            assert len(data) == (n + 7) / 8
+            assert unpack(data, len(data) * 8) == [int(start + j in bits and j < n) for j in range(len(data) * 8)]
+
+    # the whole paged key, in one call.
+    data = client.get_range('range-paged', 0, 50000000)
+    assert sum(bin(ord(c)).count('1') for c in data) == len(paged)
+    assert client.get_range('range-small', 10, 5) == ''
+    # near the top, where start_bit plus 64 MB would overflow.
+    top = 2**63 - 1
+    assert client.get_range('range-small', top - 16, top) == '\0\0'
+    try:
+        client.get_range('range-small', -8, 8)
+        assert False
+    except InvalidArgument:
+        pass
+    print 'get_range ok'
+finally:
+    stop(server)
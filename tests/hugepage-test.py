@@ -0,0 +1,40 @@
+# grows a key past the paged threshold and checks that its pages come from
+# the huge page allocator, then deletes it and waits for them to be given
+# back.  run from the top of the tree after building bitbox-server.
+
+import sys, time
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-hugepage-test')
+
+server = start_server(d, 9295)
+try:
+    client = connect(9295)
+    before = client.stats()['huge_used_bytes']
+
+    # one bit in each of 64 pages, 64 KB apart.
+    for i in range(64):
+        client.set_bit('huge', i * 64 * 1024 * 8)
+    for i in range(64):
+        assert client.get_bit('huge', i * 64 * 1024 * 8)
+    stats = client.stats()
+    assert stats['huge_used_bytes'] - before >= 64 * 64 * 1024
+    assert stats['huge_mapped_bytes'] >= stats['huge_used_bytes']
+
+    # the pages are only freed once no reader can be looking at them, which
+    # is checked on the maintenance step that a write brings on.
+    client.delete_prefix('huge')
+    for i in range(100):
+        client.set_bit('nudge', i)
+        if client.stats()['huge_used_bytes'] <= before:
+            break
+        time.sleep(0.1)
+    stats = client.stats()
+    assert stats['huge_used_bytes'] <= before
+    print 'huge pages ok, %d bytes backed' % stats['huge_backed_bytes']
+finally:
+    stop(server)
@@ -0,0 +1,67 @@
+# imports random bits with bitbox-import, in both input formats and with a
+# sort budget small enough to spill, into a directory under /tmp that already
+# has some keys, then starts a server there and checks every bit.  run from
+# the top of the tree after building bitbox-server and bitbox-import.
+
+import sys, os, subprocess, random, struct
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-import-test')
+
+def run_server():
+    return start_server(d, 9290)
+
+expected = {}
+def add(key, bits):
+    expected.setdefault(key, set()).update(bits)
+
+# some keys that are on disk before the import, which it should add to
+server = run_server()
+try:
+    client = connect(9290)
+    for i in range(100):
+        key = 'imp' + str(i)
+        bits = [random.randint(0, 10000) for j in range(5)]
+        for bit in bits:
+            client.set_bit(key, bit)
+        add(key, bits)
+    client.shutdown()
+finally:
+    stop(server)
+
+text = open(d + '/bits.txt', 'w')
+binary = open(d + '/bits.bin', 'wb')
+for i in range(50000):
+    key = 'imp' + str(random.randint(0, 2000))
+    if i % 1000 == 0:
+        key = 'impbig'
+    bits = [random.randint(0, 50000000 if key == 'impbig' else 100000) for j in range(random.randint(1, 10))]
+    add(key, bits)
+    if i % 2:
+        text.write(key + ' ' + ' '.join(map(str, bits)) + '\n')
+    else:
+        binary.write(struct.pack('I', len(key)) + key + struct.pack('I', len(bits)) + struct.pack('%dq' % len(bits), *bits))
+text.write('.reserved 1\nno/slashes 2\n')
+text.close()
+binary.close()
+
+assert subprocess.call(['./bitbox-import', '-d', d, '-M', '1', d + '/bits.txt']) == 0
+assert subprocess.call(['./bitbox-import', '-d', d, '-M', '1', '-b', d + '/bits.bin']) == 0
+assert not os.path.exists(d + '/data/.reserved')
+assert not os.path.exists(d + '/data/.import')
+
+server = run_server()
+try:
+    client = connect(9290)
+    for key, bits in expected.items():
+        assert client.execute_batch([Op(type=OpType.COUNT_RANGE, key=key, bit=0, end_bit=1 << 40)])[0].count == len(bits), key
+        for bit in random.sample(sorted(bits), min(len(bits), 20)):
+            assert client.get_bit(key, bit) == 1, (key, bit)
+    print 'imported %d keys' % len(expected)
+finally:
+    stop(server)
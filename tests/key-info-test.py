@@ -0,0 +1,59 @@
+# checks key_info() for keys in memory, on disk and missing, and that
+# memory_top() lists the biggest keys first.  run from the top of the tree
+# after building bitbox-server.
+
+import sys
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import KeyState
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-key-info-test')
+
+def run_server():
+    return start_server(d, 9296, '-P', '2')
+
+server = run_server()
+try:
+    client = connect(9296)
+    # ki0 is the smallest, ki9 the biggest.
+    for i in range(10):
+        key = 'ki%d' % i
+        client.set_bit(key, 0)
+        client.set_bits(key, set(range(8000, 8000 + i * 10)))
+        client.set_bit(key, (i + 1) * 800000)
+
+    info = client.key_info('ki3')
+    assert info.state == KeyState.IN_MEMORY
+    assert info.bits_set == 32
+    assert info.offset == 0 and info.size >= 4 * 800000 / 8 + 1
+    assert info.memory_bytes >= info.size
+    assert info.idle >= 0
+
+    client.set_bit('ki3', 1)
+    assert client.key_info('ki3').bits_set == 33
+    assert client.key_info('nokey').state == KeyState.MISSING
+
+    top = client.memory_top(3)
+    assert [k.key for k in top] == ['ki9', 'ki8', 'ki7'], [k.key for k in top]
+    assert top[0].bits_set == 92
+    client.shutdown()
+finally:
+    stop(server)
+
+server = run_server()
+try:
+    client = connect(9296)
+    info = client.key_info('ki3')
+    assert info.state == KeyState.ON_DISK
+    assert info.disk_bytes > 0 and info.size == -1 and info.bits_set == -1
+    assert client.memory_top(3) == []
+
+    assert client.get_bit('ki3', 1)
+    info = client.key_info('ki3')
+    assert info.state == KeyState.IN_MEMORY and info.bits_set == 33
+    print 'key info ok'
+finally:
+    stop(server)
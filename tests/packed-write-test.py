@@ -0,0 +1,70 @@
+# checks set_packed_bits() and or_bitmap() against get_bit(), with positions
+# sent as delta varints and bitmaps ORed in at odd offsets.  run from the top
+# of the tree after building bitbox-server.
+
+import sys, random
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import InvalidArgument
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-packed-write-test')
+
+def count(data):
+    return sum(bin(ord(c)).count('1') for c in data)
+
+def encode(positions):
+    out = []
+    prev = 0
+    for p in sorted(positions):
+        delta = p - prev
+        prev = p
+        while True:
+            byte = delta & 0x7f
+            delta >>= 7
+            out.append(chr(byte | (0x80 if delta else 0)))
+            if not delta:
+                break
+    return ''.join(out)
+
+server = start_server(d, 9298)
+try:
+    client = connect(9298)
+    random.seed(49)
+
+    positions = set(random.randrange(0, 20000000) for i in range(2000))
+    client.set_packed_bits('packed', encode(positions))
+    for p in positions:
+        assert client.get_bit('packed', p)
+    for i in range(500):
+        p = random.randrange(0, 20000000)
+        assert client.get_bit('packed', p) == (p in positions)
+    assert count(client.get_range('packed', 0, 20000000)) == len(positions)
+
+    # a varint cut short at the end is dropped.
+    client.set_packed_bits('short', encode([5, 9]) + '\x85')
+    assert count(client.get_range('short', 0, 1000)) == 2
+
+    ones = set()
+    for i in range(20):
+        start = random.randrange(0, 100000)
+        bitmap = ''.join(chr(random.randrange(256)) for j in range(random.randrange(1, 200)))
+        client.or_bitmap('bitmap', start, bitmap)
+        ones.update(start + j for j in range(len(bitmap) * 8) if (ord(bitmap[j / 8]) >> (j % 8)) & 1)
+    data = client.get_range('bitmap', 0, 102000)
+    for p in range(0, 102000):
+        assert ((ord(data[p / 8]) >> (p % 8)) & 1) == (p in ones)
+
+    # a negative start_bit, or a bitmap running past the last bit, is refused.
+    for start in (-1, 2**63 - 4):
+        try:
+            client.or_bitmap('bitmap', start, '\xff')
+            assert False
+        except InvalidArgument:
+            pass
+    assert client.get_range('bitmap', 0, 102000) == data
+    print 'packed writes ok'
+finally:
+    stop(server)
@@ -0,0 +1,56 @@
+# writes keys to a server split into partitions, then restarts it with a
+# different number of them and checks that every key and ttl is still there,
+# over thrift and over the redis protocol.  run from the top of the tree after
+# building bitbox-server.
+
+import sys, os, socket
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-partition-test')
+
+def run_server(partitions):
+    return start_server(d, 9293, '-r', '6393', '-P', str(partitions))
+
+def redis(sock, *args):
+    sock.sendall('*%d\r\n' % len(args) + ''.join('$%d\r\n%s\r\n' % (len(str(a)), a) for a in args))
+    reply = ''
+    while not reply.endswith('\r\n'):
+        reply += sock.recv(4096)
+    return reply
+
+keys = ['part%d' % i for i in range(1000)]
+
+server = run_server(4)
+try:
+    client = connect(9293)
+    for i, key in enumerate(keys):
+        client.set_bit(key, i)
+    for key in keys[:100]:
+        assert client.expire(key, 1000)
+    assert client.stats()['partitions'] == 4
+
+    socks = [socket.create_connection(('localhost', 6393)) for i in range(8)]
+    for i, key in enumerate(keys):
+        assert redis(socks[i % 8], 'GETBIT', key, i) == ':1\r\n'
+    assert redis(socks[0], 'BITOP', 'OR', 'part-dest', *keys[:10]).startswith('-CROSSSLOT')
+    client.shutdown()
+finally:
+    stop(server)
+
+server = run_server(2)
+try:
+    client = connect(9293)
+    stats = client.stats()
+    assert stats['keys'] == len(keys) and stats['keys_with_ttl'] == 100
+    for i, key in enumerate(keys):
+        assert client.get_bit(key, i)
+        assert (client.ttl(key) > 900) == (i < 100)
+    for p in range(4):
+        assert os.path.exists(d + '/data/.expiries.%d' % p) == (p < 2)
+    print 'partitions ok'
+finally:
+    stop(server)
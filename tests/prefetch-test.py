@@ -0,0 +1,45 @@
+# writes some keys, restarts the server so that they're only on disk, then
+# prefetches them and waits for them to be in memory.  run from the top of
+# the tree after building bitbox-server.
+
+import sys, time
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+
+from testserver import fresh_dir, start_server, connect, stop
+
+d = fresh_dir('/tmp/bitbox-prefetch-test')
+
+def run_server():
+    return start_server(d, 9292)
+
+keys = ['pf%d' % i for i in range(500)]
+
+server = run_server()
+try:
+    client = connect(9292)
+    for i, key in enumerate(keys):
+        client.set_bit(key, i)
+    client.shutdown()
+finally:
+    stop(server)
+
+server = run_server()
+try:
+    client = connect(9292)
+    assert client.resident(keys) == 0
+    client.prefetch(keys + ['pf-missing'])
+    for i in range(100):
+        if client.resident(keys) == len(keys):
+            break
+        time.sleep(0.1)
+    assert client.resident(keys) == len(keys)
+
+    misses = client.stats()['cache_misses']
+    for i, key in enumerate(keys):
+        assert client.get_bit(key, i)
+    assert client.stats()['cache_misses'] == misses
+    print 'prefetched %d keys' % client.stats()['prefetch_loaded']
+finally:
+    stop(server)
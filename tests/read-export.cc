@@ -0,0 +1,60 @@
+// an example of reading an export offline: prints each key with how many
+// bits it has set, then the totals.  it needs nothing but exportfile.o and
+// lzf, so it's a starting point for analytics jobs that read exports
+// without a server.
+//
+//     make read-export
+//     ./read-export export.bbx
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <string>
+
+#include "exportfile.h"
+
+static int64_t popcount(const uint8_t * data, int64_t size)
+{
+    int64_t count = 0;
+    for(int64_t i = 0; i < size; i++)
+        count += __builtin_popcount(data[i]);
+    return count;
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc != 2)
+    {
+        fprintf(stderr, "usage: %s exportfile\n", argv[0]);
+        return 1;
+    }
+
+    ExportReader reader;
+    if(!reader.open(argv[1]))
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], reader.error());
+        return 1;
+    }
+
+    std::string key;
+    int64_t first_byte, nbytes, byte, size;
+    const uint8_t * data;
+    int64_t keys = 0, total = 0;
+    while(reader.next_key(key, &first_byte, &nbytes))
+    {
+        int64_t bits = 0;
+        while(reader.next_chunk(&byte, &data, &size))
+            bits += popcount(data, size);
+        printf("%s %" PRId64 "\n", key.c_str(), bits);
+        keys++;
+        total += bits;
+    }
+
+    if(!reader.complete())
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], reader.error() ? reader.error() : "cut short");
+        return 1;
+    }
+    fprintf(stderr, "%" PRId64 " keys, %" PRId64 " bits set\n", keys, total);
+    return 0;
+}
@@ -0,0 +1,109 @@
+// replays a trace of requests against each eviction policy in turn and
+// prints how often each one found the key already in memory.  each line of
+// the trace is "get KEY BIT" or "set KEY BIT".  it runs in the current
+// directory and empties data/ first, so run it somewhere disposable.
+//
+//     make replay-eviction
+//     ./replay-eviction trace.txt [policy ...]      (default: lru tinylfu gdsf)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+#include <vector>
+
+#include "bitbox.h"
+
+struct TraceOp {
+    bool set;
+    std::string key;
+    int64_t bit;
+};
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool read_trace(const char * filename, std::vector<TraceOp> & ops)
+{
+    FILE * f = fopen(filename, "r");
+    if(!f)
+        return false;
+
+    char op[16], key[1024];
+    long long bit;
+    while(fscanf(f, "%15s %1023s %lld", op, key, &bit) == 3)
+    {
+        ops.push_back(TraceOp());
+        ops.back().set = !strcmp(op, "set");
+        ops.back().key = key;
+        ops.back().bit = bit;
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace [policy ...]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<TraceOp> ops;
+    if(!read_trace(argv[1], ops))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    std::vector<std::string> policies;
+    for(int i = 2; i < argc; i++)
+        policies.push_back(argv[i]);
+    if(policies.empty())
+    {
+        policies.push_back("lru");
+        policies.push_back("tinylfu");
+        policies.push_back("gdsf");
+    }
+
+    printf("%zu requests\n", ops.size());
+    printf("%-10s %12s %12s %12s %10s %8s\n", "policy", "hits", "misses", "evictions", "hit rate", "secs");
+    for(size_t p = 0; p < policies.size(); p++)
+    {
+        Bitbox box;
+        box.clear();
+        if(!box.set_eviction_policy(policies[p]))
+        {
+            fprintf(stderr, "no such policy: %s\n", policies[p].c_str());
+            return 1;
+        }
+
+        double start = now();
+        for(size_t i = 0; i < ops.size(); i++)
+        {
+            if(ops[i].set)
+                box.set_bit(ops[i].key, ops[i].bit);
+            else
+                box.get_bit(ops[i].key, ops[i].bit);
+            if(i % 64 == 0)
+                box.run_maintenance_step();
+        }
+        double secs = now() - start;
+
+        std::map<std::string, int64_t> stats;
+        box.get_stats(stats);
+        int64_t lookups = stats["cache_hits"] + stats["cache_misses"];
+        printf("%-10s %12" PRId64 " %12" PRId64 " %12" PRId64 " %9.2f%% %8.2f\n",
+                policies[p].c_str(), stats["cache_hits"], stats["cache_misses"], stats["cache_evictions"],
+                lookups ? 100.0 * stats["cache_hits"] / lookups : 0.0, secs);
+        box.clear();
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+# starts a primary and two replicas on localhost, each in its own directory
+# under /tmp, and checks that the replicas follow the primary.  run from the
+# top of the tree after building bitbox-server.
+
+import sys, time, random
+sys.path.append('gen-py')
+
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType, ReadOnly
+
+from testserver import fresh_dir, start_server, connect, stop
+
+servers = []
+
+def start(name, port, *args):
+    servers.append(start_server(fresh_dir('/tmp/bitbox-replication-test/' + name), port, *args))
+    return servers[-1]
+
+def wait_for_sync(client):
+    for i in range(300):
+        stats = client.stats()
+        if stats['repl_synced'] and stats['repl_lag_ms'] < 1000:
+            return stats
+        time.sleep(0.1)
+    raise Exception('replica never caught up: %r' % client.stats())
+
+def check(client, expected):
+    for key, bits in expected.items():
+        for bit in bits:
+            assert client.get_bit(key, bit) == 1, (key, bit)
+
+try:
+    start('primary', 9190, '-R', '9199')
+    primary = connect(9190)
+
+    expected = {}
+    prefix = str("%0.12f" % time.time())
+    def write(n):
+        for i in range(n):
+            key = prefix + str(random.randint(0, 3000))
+            bit = random.randint(0, 100000)
+            primary.set_bit(key, bit)
+            expected.setdefault(key, set()).add(bit)
+
+    # enough keys that some are only on disk when the first replica arrives
+    write(5000)
+
+    start('replica1', 9191, '-m', 'localhost:9199')
+    replica1 = connect(9191)
+    write(1000)
+    primary.execute_batch([Op(type=OpType.SET_RANGE, key=prefix + 'range', bit=10, end_bit=5000)])
+
+    wait_for_sync(replica1)
+    check(replica1, expected)
+    assert replica1.execute_batch([Op(type=OpType.COUNT_RANGE, key=prefix + 'range', bit=0, end_bit=10000)])[0].count == 4990
+
+    # a replica that shows up late gets everything too
+    start('replica2', 9192, '-m', 'localhost:9199')
+    replica2 = connect(9192)
+    wait_for_sync(replica2)
+    check(replica2, expected)
+
+    try:
+        replica1.set_bit(prefix, 1)
+        assert False, 'replica accepted a write'
+    except ReadOnly:
+        pass
+
+    stats = primary.stats()
+    assert stats['repl_replicas'] == 2
+    assert stats['repl_seq'] >= 6001
+
+    # with the primary gone the lag keeps growing.  (SIGTERM is blocked until
+    # signal handling is wired up, so kill it outright.)
+    stop(servers[0])
+    time.sleep(1.5)
+    stats = replica1.stats()
+    assert stats['repl_connected'] == 0
+    assert stats['repl_lag_ms'] >= 1000
+    check(replica1, expected)
+finally:
+    for server in servers:
+        stop(server)
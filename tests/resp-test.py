@@ -0,0 +1,89 @@
+# run against a server started with: ./bitbox-server -r 6379
+
+import socket, time
+
+def command(*args):
+    out = '*%d\r\n' % len(args)
+    for arg in args:
+        arg = str(arg)
+        out += '$%d\r\n%s\r\n' % (len(arg), arg)
+    return out
+
+sock = socket.create_connection(('localhost', 6379))
+replies = sock.makefile('rb')
+
+def read_reply():
+    line = replies.readline().rstrip('\r\n')
+    if line[0] == ':':
+        return int(line[1:])
+    if line[0] == '$':
+        data = replies.read(int(line[1:]) + 2)
+        return data[:-2]
+    return line
+
+def run(*commands):
+    # send everything at once, to exercise pipelining
+    sock.sendall(''.join(command(*c) for c in commands))
+    return [read_reply() for c in commands]
+
+key = str("%0.12f" % time.time())
+a, b, dest = key + 'a', key + 'b', key + 'dest'
+
+assert run(('SETBIT', key, 7, 1),
+           ('SETBIT', key, 7, 1),
+           ('GETBIT', key, 7),
+           ('GETBIT', key, 8),
+           ('SETBIT', key, 100, 1),
+           ('BITCOUNT', key),
+           ('BITCOUNT', key, 0, 0),
+           ('BITCOUNT', key, -1, -1),
+           ('BITPOS', key, 1),
+           ('BITPOS', key, 0),
+           ('BITPOS', key, 1, 1),
+           ('SETBIT', key, 7, 0),
+           ('GETBIT', key, 7)) == [0, 1, 1, 0, 0, 2, 1, 1, 7, 0, 100, 1, 0]
+
+assert run(('SETBIT', a, 3, 1),
+           ('SETBIT', b, 3, 1),
+           ('SETBIT', b, 4, 1),
+           ('BITOP', 'AND', dest, a, b),
+           ('BITCOUNT', dest),
+           ('BITOP', 'OR', dest, a, b),
+           ('BITCOUNT', dest),
+           ('BITOP', 'XOR', dest, a, b),
+           ('GETBIT', dest, 3),
+           ('GETBIT', dest, 4),
+           ('BITOP', 'NOT', dest, a),
+           ('BITCOUNT', dest)) == [0, 0, 0, 1, 1, 1, 2, 1, 0, 1, 1, 7]
+
+assert run(('PING',), ('GETBIT', key, 'x')) == ['+PONG', '-ERR bit offset is not an integer or out of range']
+
+# names starting with a dot are the server's own files, not keys
+dot = "-ERR keys can't start with a dot"
+assert run(('SETBIT', '.expiries', 3, 1),
+           ('GETBIT', '.delta', 3),
+           ('BITOP', 'OR', dest, a, '.flush'),
+           ('DEL', a, '.expiries'),
+           ('PING', '.x')) == [dot, dot, dot, dot, '.x']
+
+# a long pipeline
+bits = range(0, 300000, 3)
+assert run(*[('SETBIT', key + 'big', bit, 1) for bit in bits]) == [0] * len(bits)
+assert run(('BITCOUNT', key + 'big')) == [len(bits)]
+
+results = run(('EXPIRE', a, 100),
+              ('TTL', a),
+              ('TTL', b),
+              ('TTL', key + 'missing'),
+              ('EXPIRE', key + 'missing', 100),
+              ('DEL', a, b, key + 'missing'),
+              ('TTL', a),
+              ('GETBIT', b, 3))
+assert results[0] == 1 and 99 <= results[1] <= 100
+assert results[2:] == [-1, -2, 0, 2, -2, 0]
+
+# an argument too big to buffer is refused, and the connection closed
+big = socket.create_connection(('localhost', 6379))
+big.sendall('*2\r\n$6\r\nGETBIT\r\n$%d\r\n' % (64 * 1024 * 1024 + 1))
+assert big.makefile('rb').readline().startswith('-ERR Protocol error')
+assert big.recv(1) == ''
@@ -0,0 +1,80 @@
+# starts two bitbox-servers behind a bitbox-router, fills them through the
+# router, adds a third server and checks that every bit is still there and
+# the new server got its share.  run from the top of the tree after building.
+
+import sys, time, subprocess, struct
+sys.path.append('gen-py')
+
+from bitbox import BitboxRouter
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType, InvalidArgument
+
+from testserver import fresh_dir, start_server, connect, stop
+
+processes = []
+
+def start(port):
+    processes.append(start_server(fresh_dir('/tmp/bitbox-router-test/%d' % port), port))
+
+def keys_on(port):
+    return len(connect(port).scan_keys('', 1000000))
+
+try:
+    start(9291)
+    start(9292)
+    start(9293)
+    processes.append(subprocess.Popen(['./bitbox-router', '-p', '9290', 'localhost:9291', 'localhost:9292']))
+    router = connect(9290, BitboxRouter)
+
+    prefix = str("%0.12f" % time.time())
+    keys = [prefix + str(i) for i in range(3000)]
+    for i, key in enumerate(keys):
+        router.set_bits(key, set([i, i + 100000]))
+
+    assert keys_on(9291) + keys_on(9292) == len(keys)
+    assert keys_on(9291) > len(keys) / 4 and keys_on(9292) > len(keys) / 4
+
+    # batches are split between servers and put back together in order
+    results = router.execute_batch([Op(type=OpType.GET_BIT, key=key, bit=i) for i, key in enumerate(keys[:500])])
+    assert all(r.bit for r in results)
+
+    assert router.add_node('localhost', 9293)
+
+    # keep using it while keys move
+    for i, key in enumerate(keys):
+        router.set_bit(key, 7)
+        assert router.get_bit(key, i)
+
+    for i in range(300):
+        if not router.stats()['router_rebalancing']:
+            break
+        time.sleep(0.1)
+    assert not router.stats()['router_rebalancing']
+
+    for i, key in enumerate(keys):
+        results = router.execute_batch([
+            Op(type=OpType.COUNT_RANGE, key=key, bit=0, end_bit=200000),
+            Op(type=OpType.GET_BIT, key=key, bit=i + 100000),
+        ])
+        assert results[0].count == (2 if i == 7 else 3), (key, results[0].count)
+        assert results[1].bit
+
+    # data that isn't a dumped array is refused, and leaves the key alone.
+    data = router.dump_key(keys[0])
+    # (flag, uncompressed size, then the array's size and offset.)
+    for bad in ('', data[:-1], '\x00' + struct.pack('<qqq', 16, 1000, 0), '\x00' + struct.pack('<qqq', 16, -1, 0)):
+        try:
+            router.merge_key(keys[0], bad)
+            assert False
+        except InvalidArgument:
+            pass
+    assert router.dump_key(keys[0]) == data
+
+    counts = [keys_on(9291), keys_on(9292), keys_on(9293)]
+    assert sum(counts) == len(keys)
+    assert counts[2] > len(keys) / 6
+    print 'keys per server:', counts
+finally:
+    # (SIGTERM is blocked until signal handling is wired up.)
+    for p in processes:
+        stop(p)
@@ -0,0 +1,64 @@
+# run against a server started with: ./bitbox-server
+
+import sys, time, random
+sys.path.append('gen-py')
+
+from bitbox import Bitbox
+from bitbox.constants import *
+from bitbox.ttypes import Op, OpType, InvalidArgument
+
+from thrift import Thrift
+from thrift.transport import TSocket
+from thrift.transport import TTransport
+from thrift.protocol import TBinaryProtocol
+
+transport = TSocket.TSocket('localhost', 9090)
+transport = TTransport.TFramedTransport(transport)
+protocol = TBinaryProtocol.TBinaryProtocol(transport)
+
+client = Bitbox.Client(protocol)
+
+transport.open()
+
+prefix = str("%0.12f" % time.time())
+keys = sorted(set(prefix + random.choice(['a', 'b', 'ab']) + str(random.randint(0, 100000)) for i in range(3000)))
+for key in keys:
+    client.set_bit(key, 1)
+
+def scan(p, page):
+    found, after = [], ''
+    while True:
+        got = client.scan_keys(after, page, p)
+        if not got:
+            return found
+        assert len(got) <= page and got == sorted(got)
+        found += got
+        after = got[-1]
+
+assert scan(prefix, 100) == keys
+assert scan(prefix + 'a', 7) == [key for key in keys if key.startswith(prefix + 'a')]
+assert scan(prefix + 'c', 10) == []
+assert client.scan_keys(keys[10], 5, prefix) == keys[11:16]
+
+client.delete_prefix(prefix + 'ab')
+assert scan(prefix, 1000) == [key for key in keys if not key.startswith(prefix + 'ab')]
+client.delete_prefix(prefix)
+assert scan(prefix, 1000) == []
+
+# keys are file names in data/, where the ones starting with a dot are the
+# server's own, so they're turned away rather than disappearing from the index.
+for call in [lambda: client.set_bit('.expiries', 1),
+             lambda: client.get_bit('.delta', 1),
+             lambda: client.drop_key('.expiries'),
+             lambda: client.dump_key('.flush')]:
+    try:
+        call()
+        assert False
+    except InvalidArgument:
+        pass
+results = client.execute_batch([Op(type=OpType.SET_BIT, key='.' + prefix, bit=1),
+                                Op(type=OpType.SET_BIT, key=prefix + 'x', bit=1)])
+assert results[0].failed and not results[1].failed
+assert scan(prefix, 10) == [prefix + 'x']
+assert scan('.', 10) == []
+client.delete_prefix(prefix)
@@ -1,6 +1,26 @@
 #!/bin/bash -xe
 
+# run from the top of the tree against a server started with:
+# ./bitbox-server -r 6379
+
 for i in `seq 30`; do python tests/test.py; done
+python tests/batch-test.py
+python tests/expire-test.py
+python tests/resp-test.py
+python tests/scan-test.py
+make compressedtier-test && ./compressedtier-test
+python tests/replication-test.py
+make bitbox-import && python tests/import-test.py
+make read-export && python tests/export-test.py
+make bitbox-router && python tests/router-test.py
+python tests/prefetch-test.py
+python tests/partition-test.py
+python tests/concurrent-read-test.py
+python tests/hugepage-test.py
+python tests/key-info-test.py
+python tests/get-range-test.py
+python tests/packed-write-test.py
+python tests/field-test.py
 python tests/perf-key-heavy.py
 python tests/perf-bit-heavy.py
 for i in `seq 30`; do python tests/test.py; done
@@ -0,0 +1,34 @@
+# what the tests that start their own servers share: a fresh directory under
+# /tmp for each server, the server itself, and a client that waits for it to
+# come up.  import it after putting gen-py on the path.
+
+import time, os, shutil, subprocess
+
+from bitbox import Bitbox
+
+from thrift.transport import TSocket
+from thrift.transport import TTransport
+from thrift.protocol import TBinaryProtocol
+
+def fresh_dir(d):
+    shutil.rmtree(d, ignore_errors=True)
+    os.makedirs(d + '/data')
+    return d
+
+def start_server(d, port, *args):
+    return subprocess.Popen(['./bitbox-server', '-d', d, '-p', str(port)] + [str(arg) for arg in args])
+
+def connect(port, service=Bitbox):
+    for i in range(50):
+        transport = TTransport.TFramedTransport(TSocket.TSocket('localhost', port))
+        try:
+            transport.open()
+            return service.Client(TBinaryProtocol.TBinaryProtocol(transport))
+        except TTransport.TTransportException:
+            time.sleep(0.1)
+    raise Exception('no server on port %d' % port)
+
+def stop(process):
+    if process.poll() is None:
+        process.kill()
+    process.wait()
@@ -0,0 +1,97 @@
+#include <glib.h>
+
+#include "timerwheel.h"
+
+TimingWheel::TimingWheel()
+    : now(0), count(0)
+{
+}
+
+// the level is picked by the highest group of WHEEL_BITS bits in which
+// `when` differs from `now`, so a timer is never put in a slot that its
+// level has already gone past.  timers due before `earliest` go in its slot.
+void TimingWheel::place(Timer & timer, int64_t earliest)
+{
+    int64_t when = MAX(timer.when, earliest);
+
+    uint64_t diff = (uint64_t)when ^ (uint64_t)this->now;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && (diff >> (WHEEL_BITS * (level + 1))))
+        level++;
+
+    // too far off for the wheel: park it in the top level's last slot
+    // before it comes round, and check it again from there.
+    if(diff >> (WHEEL_BITS * WHEEL_LEVELS))
+        when = this->now + ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    int slot = (when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    this->slots[level][slot].push_back(Timer());
+    this->slots[level][slot].back().key.swap(timer.key);
+    this->slots[level][slot].back().when = timer.when;
+}
+
+void TimingWheel::add(const std::string & key, int64_t when)
+{
+    // the current tick has already been looked at.
+    Timer timer;
+    timer.key = key;
+    timer.when = when;
+    this->place(timer, this->now + 1);
+    this->count++;
+}
+
+void TimingWheel::advance(int64_t to, std::vector<std::pair<std::string, int64_t> > & due)
+{
+    if(!this->count)
+    {
+        this->now = to;
+        return;
+    }
+
+    while(this->now < to)
+    {
+        this->now++;
+
+        // when a level's index wraps round, bring the next level's current
+        // slot down.
+        for(int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if(this->now & (((int64_t)1 << (WHEEL_BITS * level)) - 1))
+                break;
+
+            int slot = (this->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            std::vector<Timer> timers;
+            timers.swap(this->slots[level][slot]);
+            for(size_t i = 0; i < timers.size(); i++)
+                this->place(timers[i], this->now);
+        }
+
+        std::vector<Timer> timers;
+        timers.swap(this->slots[0][this->now & (WHEEL_SLOTS - 1)]);
+        for(size_t i = 0; i < timers.size(); i++)
+        {
+            if(timers[i].when <= this->now)
+            {
+                due.push_back(std::make_pair(std::string(), timers[i].when));
+                due.back().first.swap(timers[i].key);
+                this->count--;
+            }
+            else
+                this->place(timers[i], this->now); // one that was too far off
+        }
+
+        if(!this->count)
+        {
+            this->now = to;
+            return;
+        }
+    }
+}
+
+void TimingWheel::clear()
+{
+    for(int level = 0; level < WHEEL_LEVELS; level++)
+        for(int slot = 0; slot < WHEEL_SLOTS; slot++)
+            std::vector<Timer>().swap(this->slots[level][slot]);
+    this->count = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a hierarchical timing wheel, for expiring keys.  time is in whole ticks
+// (Bitbox uses seconds).  level 0 has a slot for each of the next
+// WHEEL_SLOTS ticks, and each level above covers WHEEL_SLOTS times as long
+// per slot.  a timer goes in the lowest level that can tell its tick apart
+// from the current one, and when a level comes round to a slot, that slot's
+// timers are moved down a level, so each tick only looks at the timers that
+// are due or are being moved closer to it.
+//
+// timers can't be cancelled; callers should check anything that comes due
+// against their own idea of when it should.  the wheel starts at tick 0;
+// advance() it to the current time before adding anything, which is cheap
+// while it's empty.
+
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  6 // 2^36 ticks, or about 2000 years of seconds
+
+class TimingWheel {
+private:
+    struct Timer {
+        std::string key;
+        int64_t when;
+    };
+
+    std::vector<Timer> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    int64_t now; // the last tick processed
+    size_t count;
+
+    void place(Timer & timer, int64_t earliest);
+
+public:
+    TimingWheel();
+
+    // timers at or before the current tick come due on the next one.
+    void add(const std::string & key, int64_t when);
+
+    // moves the wheel on to tick `to`, appending the timers that came due
+    // on the way.
+    void advance(int64_t to, std::vector<std::pair<std::string, int64_t> > & due);
+
+    void clear();
+    size_t size() const { return this->count; }
+};
+
+#endif
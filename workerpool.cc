@@ -0,0 +1,62 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(int nthreads)
+    : tasks(NULL), next(0), unfinished(0), stopping(false)
+{
+    if(nthreads <= 0)
+        nthreads = std::thread::hardware_concurrency();
+    for(int i = 1; i < nthreads; i++)
+        this->threads.push_back(std::thread(&WorkerPool::loop, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mu);
+        this->stopping = true;
+    }
+    this->work.notify_all();
+    for(size_t i = 0; i < this->threads.size(); i++)
+        this->threads[i].join();
+}
+
+bool WorkerPool::run_one(std::unique_lock<std::mutex> & lock)
+{
+    if(!this->tasks || this->next == this->tasks->size())
+        return false;
+
+    const std::function<void()> & task = (*this->tasks)[this->next++];
+    lock.unlock();
+    task();
+    lock.lock();
+    if(--this->unfinished == 0)
+        this->done.notify_all();
+    return true;
+}
+
+void WorkerPool::loop()
+{
+    std::unique_lock<std::mutex> lock(this->mu);
+    while(!this->stopping)
+        if(!this->run_one(lock))
+            this->work.wait(lock);
+}
+
+void WorkerPool::run(const std::vector<std::function<void()> > & tasks)
+{
+    if(tasks.empty())
+        return;
+
+    std::lock_guard<std::mutex> running(this->running);
+    std::unique_lock<std::mutex> lock(this->mu);
+    this->tasks = &tasks;
+    this->next = 0;
+    this->unfinished = tasks.size();
+    this->work.notify_all();
+
+    while(this->run_one(lock))
+        ;
+    while(this->unfinished)
+        this->done.wait(lock);
+    this->tasks = NULL;
+}
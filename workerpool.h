@@ -0,0 +1,44 @@
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of threads for spreading cpu-heavy work, such as compressing
+// arrays, across cores.  run() hands out a batch of tasks and returns when
+// they're all done; the calling thread works on them too, so a pool of n
+// threads starts n-1 of its own.
+
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::mutex mu;
+    std::condition_variable work;
+    std::condition_variable done;
+    std::mutex running; // one run() at a time
+
+    const std::vector<std::function<void()> > * tasks;
+    size_t next;
+    size_t unfinished;
+    bool stopping;
+
+    void loop();
+
+    // runs the next task, if there's one left.  call with mu locked.
+    bool run_one(std::unique_lock<std::mutex> & lock);
+
+public:
+    // 0 threads for one per core.
+    WorkerPool(int nthreads);
+    ~WorkerPool();
+
+    void run(const std::vector<std::function<void()> > & tasks);
+
+    int size() const { return this->threads.size() + 1; }
+};
+
+#endif